@@ -7,6 +7,7 @@
 #include <osg/Geometry>
 #include <osg/Geode>
 #include <osgDB/ReadFile>
+#include "CommonFunctions"
 #include "Player"
 
 Player::Player()
@@ -59,7 +60,7 @@ bool Player::update( const osgGA::GUIEventAdapter& ea, osg::Group* root )
             _speedVec = osg::Vec3();
         break;
     case ENEMY_OBJ:
-        if ( RAND(0, 2000)<1 ) emitBullet = true;
+        if ( osgCookBook::randomValue(0.0f, 2000.0f)<1.0f ) emitBullet = true;
         break;
     default: break;
     }
@@ -9,6 +9,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 #include "Player"
 
 class GameControllor : public osgGA::GUIEventHandler
@@ -96,5 +97,5 @@ int main( int argc, char** argv )
     viewer.getCamera()->setClearColor( osg::Vec4(0.0f, 0.0f, 0.0f, 1.0f) );
     viewer.addEventHandler( new GameControllor(hudCamera.get()) );
     viewer.setSceneData( hudCamera.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -4,10 +4,62 @@
 */
 
 #include <osg/Group>
+#include "ThreadPool"
 #include "BFSVisitor"
 
+// Position of the node being applied in the current level, so that traverseBFS()
+// knows which node to expand without locking
+static thread_local unsigned int t_levelIndex = 0;
+
+/* NodeVisitor::accept() pushes to the visitor's node path, which can't be shared between
+   threads. Each worker dispatches through its own visitor that forwards every apply()
+   to the BFSVisitor with the same static type. */
+class BFSDispatchVisitor : public osg::NodeVisitor
+{
+public:
+    BFSDispatchVisitor( osg::NodeVisitor& target )
+    :   osg::NodeVisitor(target.getTraversalMode()), _target(target)
+    {
+        setTraversalMask( target.getTraversalMask() );
+        setNodeMaskOverride( target.getNodeMaskOverride() );
+    }
+
+#define FORWARD_APPLY(T) virtual void apply( T& node ) { _target.apply(node); }
+    FORWARD_APPLY(osg::Drawable)
+    FORWARD_APPLY(osg::Geometry)
+    FORWARD_APPLY(osg::Node)
+    FORWARD_APPLY(osg::Geode)
+    FORWARD_APPLY(osg::Billboard)
+    FORWARD_APPLY(osg::Group)
+    FORWARD_APPLY(osg::ProxyNode)
+    FORWARD_APPLY(osg::Projection)
+    FORWARD_APPLY(osg::CoordinateSystemNode)
+    FORWARD_APPLY(osg::ClipNode)
+    FORWARD_APPLY(osg::TexGenNode)
+    FORWARD_APPLY(osg::LightSource)
+    FORWARD_APPLY(osg::Transform)
+    FORWARD_APPLY(osg::Camera)
+    FORWARD_APPLY(osg::CameraView)
+    FORWARD_APPLY(osg::MatrixTransform)
+    FORWARD_APPLY(osg::PositionAttitudeTransform)
+    FORWARD_APPLY(osg::AutoTransform)
+    FORWARD_APPLY(osg::Switch)
+    FORWARD_APPLY(osg::Sequence)
+    FORWARD_APPLY(osg::LOD)
+    FORWARD_APPLY(osg::PagedLOD)
+    FORWARD_APPLY(osg::ClearNode)
+    FORWARD_APPLY(osg::OccluderNode)
+    FORWARD_APPLY(osg::OcclusionQueryNode)
+#undef FORWARD_APPLY
+
+protected:
+    osg::NodeVisitor& _target;
+};
+
 BFSVisitor::BFSVisitor()
-:   osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN)
+:   osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN),
+    _levelOffset(0), _currentDepth(0),
+    _visitSharedNodesOnce(false), _parallelTraversal(false), _inLevelTraversal(false)
 {
 }
 
@@ -16,19 +68,105 @@ BFSVisitor::~BFSVisitor()
 }
 
 void BFSVisitor::traverseBFS( osg::Node& node )
+{
+    if ( _inLevelTraversal )
+    {
+        // Children are collected after the whole level is applied
+        _expandedNodes[t_levelIndex] = 1;
+        return;
+    }
+    traverseLevels( node );
+}
+
+unsigned int BFSVisitor::getCurrentIndex() const
+{
+    return _inLevelTraversal ? _levelOffset + t_levelIndex : 0;
+}
+
+int BFSVisitor::getCurrentParentIndex() const
+{
+    return _inLevelTraversal ? _levelParents[t_levelIndex] : -1;
+}
+
+void BFSVisitor::appendChildren( osg::Node& node, unsigned int index, bool visitOnce,
+                                 std::vector<osg::Node*>& level, std::vector<int>& parents )
 {
     osg::Group* group = node.asGroup();
     if ( !group ) return;
-    
+
     for ( unsigned int i=0; i<group->getNumChildren(); ++i )
     {
-        _pendingNodes.push_back( group->getChild(i) );
+        osg::Node* child = group->getChild(i);
+        if ( !visitOnce || _visitedNodes.insert(child).second )
+        {
+            level.push_back( child );
+            parents.push_back( index );
+        }
+    }
+}
+
+void BFSVisitor::traverseLevels( osg::Node& root )
+{
+    bool parallel = _parallelTraversal && isApplyThreadSafe();
+    bool visitOnce = _visitSharedNodesOnce || parallel;
+
+    // Each traversal starts afresh, so the visitor can be applied again
+    _visitedNodes.clear();
+    if ( visitOnce )
+    {
+        initVisitedNodes();
+        _visitedNodes.insert( &root );
     }
-    
-    while ( _pendingNodes.size()>0 )
+
+    std::vector<osg::Node*> level, nextLevel;
+    std::vector<int> nextParents;
+    _levelParents.clear();
+    appendChildren( root, 0, visitOnce, level, _levelParents );
+
+    _inLevelTraversal = true;
+    _levelOffset = 1;
+    _currentDepth = 1;
+    while ( level.size()>0 )
     {
-        osg::Node* node = _pendingNodes.front();
-        _pendingNodes.pop_front();
-        node->accept(*this);
+        startLevel( _currentDepth, level.size() );
+        _expandedNodes.assign( level.size(), 0 );
+        if ( parallel )
+        {
+            osgCookBook::ThreadPool::instance()->parallelFor( 0, level.size(),
+                [this, &level]( unsigned int first, unsigned int last )
+                {
+                    BFSDispatchVisitor dispatcher( *this );
+                    for ( unsigned int i=first; i<last; ++i )
+                    {
+                        t_levelIndex = i;
+                        level[i]->accept( dispatcher );
+                    }
+                }, 64 );
+        }
+        else
+        {
+            for ( unsigned int i=0; i<level.size(); ++i )
+            {
+                t_levelIndex = i;
+                level[i]->accept( *this );
+            }
+        }
+
+        // Build the next frontier in level order, so the sequential result
+        // keeps the classic BFS ordering
+        nextLevel.clear();
+        nextParents.clear();
+        for ( unsigned int i=0; i<level.size(); ++i )
+        {
+            if ( _expandedNodes[i] )
+                appendChildren( *level[i], _levelOffset + i, visitOnce, nextLevel, nextParents );
+        }
+
+        _levelOffset += level.size();
+        _currentDepth++;
+        level.swap( nextLevel );
+        _levelParents.swap( nextParents );
     }
+    _inLevelTraversal = false;
+    _currentDepth = 0;
 }
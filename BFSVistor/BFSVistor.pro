@@ -5,8 +5,10 @@ CONFIG -= qt
 
 SOURCES += \
         BFSVisitor.cpp \
+        SceneIndex.cpp \
         main.cpp
 
 HEADERS += \
-    BFSVisitor
+    BFSVisitor \
+    SceneIndex
 include(../osg.pri)
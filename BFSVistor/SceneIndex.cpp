@@ -0,0 +1,308 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Chapter 2 Recipe 6
+*/
+
+#include <osg/Geode>
+#include <osg/Geometry>
+#include <osg/MatrixTransform>
+#include <osg/PositionAttitudeTransform>
+#include <osg/Camera>
+#include <osg/Switch>
+#include <osg/PagedLOD>
+#include <algorithm>
+
+#include "BFSVisitor"
+#include "SceneIndex"
+
+/* Writes each applied node to its slot in the index. Slots of a level are allocated before
+   the level is applied, so nodes of the same level can be recorded in parallel. */
+class BFSIndexVisitor : public BFSVisitor
+{
+public:
+    BFSIndexVisitor( SceneIndex* index, int rootParent, unsigned int rootDepth )
+    :   _index(index), _base(index->size()), _rootParent(rootParent), _rootDepth(rootDepth)
+    {
+        // Index masked-out subgraphs as well, queries filter them by mask
+        setNodeMaskOverride( 0xffffffff );
+    }
+
+    virtual bool isApplyThreadSafe() const { return true; }
+
+#define INDEX_APPLY(T, TAG) virtual void apply( T& node ) { record( node, SceneIndex::TAG ); }
+    INDEX_APPLY(osg::Node, NODE_TYPE)
+    INDEX_APPLY(osg::Group, GROUP_TYPE)
+    INDEX_APPLY(osg::Geode, GEODE_TYPE)
+    INDEX_APPLY(osg::Transform, TRANSFORM_TYPE)
+    INDEX_APPLY(osg::MatrixTransform, MATRIX_TRANSFORM_TYPE)
+    INDEX_APPLY(osg::PositionAttitudeTransform, POSITION_ATTITUDE_TRANSFORM_TYPE)
+    INDEX_APPLY(osg::Camera, CAMERA_TYPE)
+    INDEX_APPLY(osg::Switch, SWITCH_TYPE)
+    INDEX_APPLY(osg::LOD, LOD_TYPE)
+    INDEX_APPLY(osg::PagedLOD, PAGED_LOD_TYPE)
+    INDEX_APPLY(osg::Drawable, DRAWABLE_TYPE)
+    INDEX_APPLY(osg::Geometry, GEOMETRY_TYPE)
+#undef INDEX_APPLY
+
+protected:
+    virtual void startLevel( unsigned int /*depth*/, unsigned int size )
+    { _index->resizeEntries( _base + _levelOffset + size ); }
+
+    /** Skip nodes already in the index when shared nodes are visited once. */
+    virtual void initVisitedNodes()
+    {
+        for ( unsigned int i=0; i<_base; ++i )
+        {
+            if ( _index->_nodes[i] ) _visitedNodes.insert( _index->_nodes[i] );
+        }
+    }
+
+    void record( osg::Node& node, SceneIndex::TypeTag type )
+    {
+        int parent = getCurrentParentIndex();
+        unsigned int i = _base + getCurrentIndex();
+        if ( parent<0 ) _index->resizeEntries( i + 1 );
+
+        _index->_nodes[i] = &node;
+        _index->_parents[i] = parent<0 ? _rootParent : (int)_base + parent;
+        _index->_depths[i] = (unsigned short)(_rootDepth + getCurrentDepth());
+        _index->_nodeMasks[i] = node.getNodeMask();
+        _index->_bounds[i] = node.getBound();
+        _index->_types[i] = (unsigned char)type;
+        traverseBFS( node );
+    }
+
+    SceneIndex* _index;
+    unsigned int _base;
+    int _rootParent;
+    unsigned int _rootDepth;
+};
+
+template<typename T>
+static void gatherEntries( std::vector<T>& values, const std::vector<unsigned int>& order )
+{
+    std::vector<T> result( order.size() );
+    for ( unsigned int i=0; i<order.size(); ++i )
+        result[i] = values[order[i]];
+    values.swap( result );
+}
+
+SceneIndex::SceneIndex()
+:   _numRemoved(0), _visitSharedNodesOnce(false), _parallel(false)
+{
+}
+
+void SceneIndex::build( osg::Node* root, bool visitSharedNodesOnce, bool parallel )
+{
+    clear();
+    if ( !root ) return;
+
+    _root = root;
+    _visitSharedNodesOnce = visitSharedNodesOnce || parallel;
+    _parallel = parallel;
+    appendSubgraph( root, -1, 0 );
+}
+
+void SceneIndex::clear()
+{
+    resizeEntries( 0 );
+    _root = NULL;
+    _numRemoved = 0;
+}
+
+void SceneIndex::resizeEntries( unsigned int size )
+{
+    _nodes.resize( size, NULL );
+    _parents.resize( size, -1 );
+    _depths.resize( size, 0 );
+    _nodeMasks.resize( size, 0 );
+    _bounds.resize( size );
+    _types.resize( size, REMOVED_TYPE );
+}
+
+void SceneIndex::appendSubgraph( osg::Node* node, int parent, unsigned int depth )
+{
+    // Compute all bounds up front, so that workers of a parallel build only read them
+    node->getBound();
+
+    BFSIndexVisitor iv( this, parent, depth );
+    iv.setVisitSharedNodesOnce( _visitSharedNodesOnce );
+    iv.setParallelTraversal( _parallel );
+    node->accept( iv );
+}
+
+void SceneIndex::addChild( osg::Group* parent, osg::Node* child )
+{
+    if ( !parent || !child ) return;
+    if ( _visitSharedNodesOnce && find(child)>=0 ) return;
+
+    unsigned int numEntries = size();
+    for ( unsigned int i=0; i<numEntries; ++i )
+    {
+        if ( _nodes[i]!=parent ) continue;
+        appendSubgraph( child, i, _depths[i] + 1 );
+        if ( _visitSharedNodesOnce ) break;
+    }
+}
+
+void SceneIndex::removeChild( osg::Group* parent, osg::Node* child )
+{
+    if ( !parent || !child ) return;
+
+    unsigned int numEntries = size(), first = numEntries;
+    for ( unsigned int i=0; i<numEntries; ++i )
+    {
+        if ( _nodes[i]!=child || _parents[i]<0 || _nodes[_parents[i]]!=parent ) continue;
+        _nodes[i] = NULL; _types[i] = REMOVED_TYPE;
+        _numRemoved++;
+        if ( first==numEntries ) first = i;
+    }
+
+    // Parents come before children, so one pass removes the whole subgraph
+    for ( unsigned int i=first+1; i<numEntries; ++i )
+    {
+        int p = _parents[i];
+        if ( _types[i]==REMOVED_TYPE || p<0 || _types[p]!=REMOVED_TYPE ) continue;
+        _nodes[i] = NULL; _types[i] = REMOVED_TYPE;
+        _numRemoved++;
+    }
+
+    // A node indexed once may still be reachable from another parent
+    if ( _visitSharedNodesOnce && first<numEntries )
+    {
+        for ( unsigned int i=0; i<child->getNumParents(); ++i )
+        {
+            osg::Group* other = child->getParent(i);
+            if ( other!=parent && find(other)>=0 ) { addChild( other, child ); break; }
+        }
+    }
+}
+
+void SceneIndex::compact()
+{
+    std::vector< std::vector<unsigned int> > levels;
+    for ( unsigned int i=0; i<size(); ++i )
+    {
+        if ( _types[i]==REMOVED_TYPE ) continue;
+        if ( levels.size()<=_depths[i] ) levels.resize( _depths[i] + 1 );
+        levels[_depths[i]].push_back( i );
+    }
+
+    // Order each level by the new position of the parents, keeping the order of siblings
+    std::vector<int> newIndex( size(), -1 );
+    std::vector<unsigned int> order;
+    order.reserve( size() - _numRemoved );
+    for ( unsigned int d=0; d<levels.size(); ++d )
+    {
+        std::vector<unsigned int>& level = levels[d];
+        std::stable_sort( level.begin(), level.end(),
+            [this, &newIndex]( unsigned int lhs, unsigned int rhs )
+            {
+                int lp = _parents[lhs]<0 ? -1 : newIndex[_parents[lhs]];
+                int rp = _parents[rhs]<0 ? -1 : newIndex[_parents[rhs]];
+                return lp < rp;
+            } );
+
+        for ( unsigned int i=0; i<level.size(); ++i )
+        {
+            newIndex[level[i]] = order.size();
+            order.push_back( level[i] );
+        }
+    }
+
+    for ( unsigned int i=0; i<_parents.size(); ++i )
+    {
+        if ( _parents[i]>=0 ) _parents[i] = newIndex[_parents[i]];
+    }
+    gatherEntries( _nodes, order );
+    gatherEntries( _parents, order );
+    gatherEntries( _depths, order );
+    gatherEntries( _nodeMasks, order );
+    gatherEntries( _bounds, order );
+    gatherEntries( _types, order );
+    _numRemoved = 0;
+}
+
+void SceneIndex::updateAttributes()
+{
+    if ( _root.valid() ) _root->getBound();
+    for ( unsigned int i=0; i<size(); ++i )
+    {
+        if ( _types[i]==REMOVED_TYPE ) continue;
+        _nodeMasks[i] = _nodes[i]->getNodeMask();
+        _bounds[i] = _nodes[i]->getBound();
+    }
+}
+
+int SceneIndex::find( const osg::Node* node ) const
+{
+    std::vector<osg::Node*>::const_iterator itr = std::find( _nodes.begin(), _nodes.end(), node );
+    return (node && itr!=_nodes.end()) ? (int)(itr - _nodes.begin()) : -1;
+}
+
+unsigned int SceneIndex::countByType( TypeTag type ) const
+{
+    return std::count( _types.begin(), _types.end(), (unsigned char)type );
+}
+
+unsigned int SceneIndex::getMaxDepth() const
+{
+    unsigned int maxDepth = 0;
+    for ( unsigned int i=0; i<size(); ++i )
+    {
+        if ( _types[i]!=REMOVED_TYPE && _depths[i]>maxDepth ) maxDepth = _depths[i];
+    }
+    return maxDepth;
+}
+
+void SceneIndex::findByType( TypeTag type, IndexList& result ) const
+{
+    for ( unsigned int i=0; i<_types.size(); ++i )
+    {
+        if ( _types[i]==type ) result.push_back( i );
+    }
+}
+
+void SceneIndex::findByDepth( unsigned int minDepth, unsigned int maxDepth, IndexList& result ) const
+{
+    for ( unsigned int i=0; i<_depths.size(); ++i )
+    {
+        if ( _types[i]!=REMOVED_TYPE && _depths[i]>=minDepth && _depths[i]<=maxDepth )
+            result.push_back( i );
+    }
+}
+
+void SceneIndex::findByMask( osg::Node::NodeMask mask, IndexList& result ) const
+{
+    for ( unsigned int i=0; i<_nodeMasks.size(); ++i )
+    {
+        if ( _types[i]!=REMOVED_TYPE && (_nodeMasks[i] & mask)!=0 ) result.push_back( i );
+    }
+}
+
+void SceneIndex::findChildren( unsigned int parent, IndexList& result ) const
+{
+    for ( unsigned int i=parent+1; i<_parents.size(); ++i )
+    {
+        if ( _parents[i]==(int)parent && _types[i]!=REMOVED_TYPE ) result.push_back( i );
+    }
+}
+
+void SceneIndex::print( std::ostream& out ) const
+{
+    for ( unsigned int i=0; i<size(); ++i )
+    {
+        if ( _types[i]==REMOVED_TYPE ) continue;
+        out << _nodes[i]->libraryName() << "::" << _nodes[i]->className() << std::endl;
+    }
+}
+
+const char* SceneIndex::getTypeName( TypeTag type )
+{
+    static const char* s_names[NUM_TYPES] =
+    {
+        "Removed", "Node", "Group", "Geode", "Transform", "MatrixTransform",
+        "PositionAttitudeTransform", "Camera", "Switch", "LOD", "PagedLOD",
+        "Drawable", "Geometry"
+    };
+    return type<NUM_TYPES ? s_names[type] : "Unknown";
+}
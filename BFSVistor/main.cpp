@@ -5,9 +5,11 @@
 
 #include <osgDB/ReadFile>
 #include <osgUtil/PrintVisitor>
+#include <OpenThreads/Atomic>
 #include <iostream>
 
 #include "BFSVisitor"
+#include "SceneIndex"
 //广度优先遍历
 class BFSPrintVisitor : public BFSVisitor
 {
@@ -19,9 +21,25 @@ public:
     }
 };
 
+// Counts nodes from several threads; nothing but an atomic is touched in apply()
+class BFSCountVisitor : public BFSVisitor
+{
+public:
+    virtual bool isApplyThreadSafe() const { return true; }
+
+    virtual void apply( osg::Node& node )
+    {
+        ++_numNodes;
+        traverseBFS(node);
+    }
+
+    OpenThreads::Atomic _numNodes;
+};
+
 int main( int argc, char** argv )
 {
     osg::ArgumentParser arguments( &argc, argv );
+    bool parallel = arguments.read( "--parallel" );
     osg::ref_ptr<osg::Node> root = osgDB::readNodeFiles( arguments );
     if ( !root ) root = osgDB::readNodeFile("osgcool.osg");
 
@@ -34,6 +52,30 @@ int main( int argc, char** argv )
     std::cout << "BFS Visitor traversal: " << std::endl;
 
     BFSPrintVisitor bpv;
+    bpv.setVisitSharedNodesOnce( true );
     root->accept( bpv );
+
+    // Build the flat snapshot once; the report below only scans its arrays
+    osg::ref_ptr<SceneIndex> index = new SceneIndex;
+    index->build( root.get(), true, parallel );
+
+    std::cout << std::endl;
+    std::cout << "Scene index: " << index->size() << " nodes, max depth "
+              << index->getMaxDepth() << std::endl;
+    for ( unsigned int t=SceneIndex::NODE_TYPE; t<SceneIndex::NUM_TYPES; ++t )
+    {
+        unsigned int count = index->countByType( (SceneIndex::TypeTag)t );
+        if ( count>0 )
+            std::cout << "  " << SceneIndex::getTypeName((SceneIndex::TypeTag)t) << ": " << count << std::endl;
+    }
+
+    if ( parallel )
+    {
+        BFSCountVisitor bcv;
+        bcv.setParallelTraversal( true );
+        root->accept( bcv );
+        std::cout << std::endl << "Parallel BFS visited " << (unsigned int)bcv._numNodes
+                  << " unique nodes" << std::endl;
+    }
     return 0;
 }
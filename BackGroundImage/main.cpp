@@ -11,6 +11,8 @@
 #include <osgViewer/Viewer>
 #include <osg/MatrixTransform>
 
+#include "FrameBenchmark"
+
 int main( int argc, char** argv )
 {
     osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D;
@@ -59,5 +61,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
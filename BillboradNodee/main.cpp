@@ -8,6 +8,8 @@
 #include <osgUtil/CullVisitor>
 #include <osgViewer/Viewer>
 
+#include "FrameBenchmark"
+
 
 
 class BillboardCallback : public osg::NodeCallback
@@ -53,5 +55,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
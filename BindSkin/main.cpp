@@ -15,6 +15,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 osgAnimation::Bone* createBone( const char* name, const osg::Vec3& trans, osg::Group* parent )
 {
@@ -135,5 +136,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
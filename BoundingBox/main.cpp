@@ -47,6 +47,8 @@
 #include <osgDB/ReadFile>
 #include <osgViewer/Viewer>
 
+#include "FrameBenchmark"
+
 class BoundingBoxCallback : public osg::NodeCallback
 {
 public:
@@ -136,5 +138,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
 
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -12,6 +12,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 static const char* vertSource = {
     "attribute vec3 tangent;\n"
@@ -108,5 +109,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( scene.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
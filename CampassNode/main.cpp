@@ -11,6 +11,8 @@
 
 #include <Compass>
 
+#include "FrameBenchmark"
+
 osg::MatrixTransform* createCompassPart( const std::string& image, float radius, float height )
 {
     osg::Vec3 center(-radius, -radius, height);
@@ -62,5 +64,5 @@ int main( int argc, char** argv )
     root->addChild( compass.get() );
     
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
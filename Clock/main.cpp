@@ -10,6 +10,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 osg::Node* createNeedle( float w, float h, float depth, const osg::Vec4& color,
                          float angle, double period )
@@ -103,5 +104,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -5,8 +5,12 @@ CONFIG -= qt
 
 SOURCES += \
         CloudBlock.cpp \
+        CloudCellFile.cpp \
+        CloudLighting.cpp \
         main.cpp
 include(../osg.pri)
 
 HEADERS += \
-    CloudBlock
+    CloudBlock \
+    CloudCellFile \
+    CloudLighting
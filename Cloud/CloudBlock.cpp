@@ -3,22 +3,228 @@
  * Author: Wang Rui <wangray84 at gmail dot com>
 */
 
+#include <osg/GLExtensions>
+#include <osg/Notify>
+#include <osg/Polytope>
+#include <osg/Version>
 #include <osg/io_utils>
 #include <iostream>
 #include <algorithm>
+#include <cstring>
+
+// The instanced mode binds its buffers through osg::VertexArrayState and State::get<GLExtensions>()
+#if OSG_VERSION_LESS_THAN(3,5,6)
+#error "The instanced CloudBlock mode needs OpenSceneGraph 3.5.6 or later"
+#endif
+
+#include "Random"
 #include "CloudBlock"
 
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define COOKBOOK_CLOUD_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+    #include <emmintrin.h>
+    #define COOKBOOK_CLOUD_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #define COOKBOOK_CLOUD_NEON
+#endif
+
+static const unsigned int s_positionAttrib = 6;
+static const unsigned int s_colorAttrib = 7;
+static const unsigned int s_maxOctreeDepth = 16;
+
+static const char* instanceVertSource = {
+    "attribute vec4 cellPosition;\n"
+    "attribute vec4 cellColor;\n"
+    "varying vec2 texCoord;\n"
+    "void main(void)\n"
+    "{\n"
+    "   vec4 eyePos = gl_ModelViewMatrix * vec4(cellPosition.xyz, 1.0);\n"
+    "   eyePos.xy += gl_Vertex.xy * cellPosition.w;\n"
+    "   gl_Position = gl_ProjectionMatrix * eyePos;\n"
+    "   gl_FrontColor = cellColor;\n"
+    "   texCoord = vec2(gl_Vertex.x + 1.0, 1.0 - gl_Vertex.y) * 0.5;\n"
+    "}\n"
+};
+
+static const char* instanceFragSource = {
+    "uniform sampler2D glowTexture;\n"
+    "varying vec2 texCoord;\n"
+    "void main(void)\n"
+    "{\n"
+    "   gl_FragColor = gl_Color * texture2D(glowTexture, texCoord);\n"
+    "}\n"
+};
+
 CloudBlock::CloudBlock()
+:   _cellsRevision(0), _renderMode(IMMEDIATE_MODE), _sortCosine(cosf(osg::DegreesToRadians(0.25f))),
+    _maxCellsPerChunk(4096), _maxDrawnCells(0), _lodDistance(0.0f)
 {
     setUseDisplayList( false );
     setSupportsDisplayList( false );
+    
+    // Corners of the unit quad as a triangle strip, shared by all instances
+    _corners = new osg::Vec2Array;
+    _corners->push_back( osg::Vec2(-1.0f, 1.0f) );
+    _corners->push_back( osg::Vec2(-1.0f,-1.0f) );
+    _corners->push_back( osg::Vec2( 1.0f, 1.0f) );
+    _corners->push_back( osg::Vec2( 1.0f,-1.0f) );
+    _corners->setVertexBufferObject( new osg::VertexBufferObject );
+    
+    _instanceProgram = new osg::Program;
+    _instanceProgram->addShader( new osg::Shader(osg::Shader::VERTEX, instanceVertSource) );
+    _instanceProgram->addShader( new osg::Shader(osg::Shader::FRAGMENT, instanceFragSource) );
+    _instanceProgram->addBindAttribLocation( "cellPosition", s_positionAttrib );
+    _instanceProgram->addBindAttribLocation( "cellColor", s_colorAttrib );
+    setRenderMode( INSTANCED_MODE );
 }
 
 CloudBlock::CloudBlock( const CloudBlock& copy, const osg::CopyOp& copyop )
-:   osg::Drawable(copy, copyop), _cells(copy._cells)
+:   osg::Drawable(copy, copyop), _cells(copy._cells), _cellsRevision(0),
+    _renderMode(copy._renderMode), _sortCosine(copy._sortCosine),
+    _chunks(copy._chunks), _chunkCells(copy._chunkCells), _cellOrigin(copy._cellOrigin),
+    _cellX(copy._cellX), _cellY(copy._cellY), _cellZ(copy._cellZ), _cellColors(copy._cellColors),
+    _maxCellsPerChunk(copy._maxCellsPerChunk),
+    _maxDrawnCells(copy._maxDrawnCells), _lodDistance(copy._lodDistance),
+    _instanceProgram(copy._instanceProgram), _corners(copy._corners)
 {
 }
 
+static inline unsigned int getOctant( const osg::Vec3d& pos, const osg::Vec3d& center )
+{ return (pos.x()>=center.x() ? 1 : 0) + (pos.y()>=center.y() ? 2 : 0) + (pos.z()>=center.z() ? 4 : 0); }
+
+void CloudBlock::dirtyCells()
+{
+    _cellsRevision++;
+    buildChunks();
+    dirtyBound();
+}
+
+void CloudBlock::buildChunks()
+{
+    unsigned int numOfCells = _cells.size();
+    _chunks.clear();
+    _chunkCells.resize( numOfCells );
+    for ( unsigned int i=0; i<numOfCells; ++i ) _chunkCells[i] = i;
+    if ( !numOfCells ) return;
+    
+    struct Node
+    {
+        unsigned int first, count, depth;
+        osg::BoundingBoxd bound;
+    };
+    
+    Node root;
+    root.first = 0; root.count = numOfCells; root.depth = 0;
+    for ( unsigned int i=0; i<numOfCells; ++i ) root.bound.expandBy( _cells[i]._pos );
+    
+    // Split nodes into octants until they are small enough; only the leaves are kept
+    std::vector<Node> stack( 1, root );
+    std::vector<unsigned int> temp( numOfCells );
+    while ( !stack.empty() )
+    {
+        Node node = stack.back(); stack.pop_back();
+        unsigned int* cells = &_chunkCells[node.first];
+        if ( node.count<=_maxCellsPerChunk || node.depth>=s_maxOctreeDepth )
+        {
+            // Shuffle so that the LOD can draw a prefix of the chunk
+            osgCookBook::RandomGenerator random( node.first );
+            for ( unsigned int i=node.count-1; i>0; --i )
+                std::swap( cells[i], cells[random.nextUInt() % (i + 1)] );
+            
+            Chunk chunk;
+            chunk.first = node.first;
+            chunk.count = node.count;
+            for ( unsigned int i=0; i<node.count; ++i )
+                chunk.bound.expandBy( _cells[cells[i]]._pos );
+            _chunks.push_back( chunk );
+            continue;
+        }
+        
+        osg::Vec3d center = node.bound.center();
+        unsigned int offsets[9] = { 0 };
+        for ( unsigned int i=0; i<node.count; ++i )
+        {
+            offsets[1 + getOctant(_cells[cells[i]]._pos, center)]++;
+        }
+        for ( unsigned int o=1; o<9; ++o ) offsets[o] += offsets[o-1];
+        
+        unsigned int next[8] = { 0 };
+        for ( unsigned int i=0; i<node.count; ++i )
+        {
+            unsigned int o = getOctant( _cells[cells[i]]._pos, center );
+            temp[offsets[o] + next[o]++] = cells[i];
+        }
+        std::copy( temp.begin(), temp.begin() + node.count, cells );
+        
+        for ( unsigned int o=0; o<8; ++o )
+        {
+            if ( offsets[o+1]==offsets[o] ) continue;
+            Node child;
+            child.first = node.first + offsets[o];
+            child.count = offsets[o+1] - offsets[o];
+            child.depth = node.depth + 1;
+            child.bound._min.set( (o & 1) ? center.x() : node.bound.xMin(),
+                                  (o & 2) ? center.y() : node.bound.yMin(),
+                                  (o & 4) ? center.z() : node.bound.zMin() );
+            child.bound._max.set( (o & 1) ? node.bound.xMax() : center.x(),
+                                  (o & 2) ? node.bound.yMax() : center.y(),
+                                  (o & 4) ? node.bound.zMax() : center.z() );
+            stack.push_back( child );
+        }
+    }
+    
+    _cellOrigin = root.bound.center();
+    _cellX.resize( numOfCells ); _cellY.resize( numOfCells ); _cellZ.resize( numOfCells );
+    for ( unsigned int k=0; k<numOfCells; ++k )
+    {
+        const CloudCell& cell = _cells[_chunkCells[k]];
+        _cellX[k] = (float)(cell._pos.x() - _cellOrigin.x());
+        _cellY[k] = (float)(cell._pos.y() - _cellOrigin.y());
+        _cellZ[k] = (float)(cell._pos.z() - _cellOrigin.z());
+    }
+    dirtyColors();
+}
+
+void CloudBlock::dirtyColors()
+{
+    if ( _chunkCells.size()!=_cells.size() )
+    {
+        dirtyCells();
+        return;
+    }
+    
+    unsigned int numOfCells = _chunkCells.size();
+    _cellColors.resize( numOfCells );
+    for ( unsigned int k=0; k<numOfCells; ++k )
+    {
+        const CloudCell& cell = _cells[_chunkCells[k]];
+        unsigned char alpha = (unsigned char)( cell._density );
+        unsigned char color = (unsigned char)( cell._brightness * cell._density / 255.0f );
+        _cellColors[k].set( color, color, color, alpha );
+    }
+}
+
+void CloudBlock::setRenderMode( RenderMode mode )
+{
+    _renderMode = mode;
+    
+    // The program lives in the drawable's own state set, so it is only applied for it
+    osg::StateSet* ss = getOrCreateStateSet();
+    if ( mode==INSTANCED_MODE )
+    {
+        ss->setAttributeAndModes( _instanceProgram.get() );
+        ss->addUniform( new osg::Uniform("glowTexture", 0) );
+    }
+    else
+    {
+        ss->removeAttribute( _instanceProgram.get() );
+        ss->removeUniform( "glowTexture" );
+    }
+}
+
 #if OSG_VERSION_GREATER_THAN(3,2,1)
 osg::BoundingBox CloudBlock::computeBoundingBox() const
 #else
@@ -36,38 +242,352 @@ osg::BoundingBox CloudBlock::computeBound() const
 void CloudBlock::drawImplementation( osg::RenderInfo& renderInfo ) const
 {
     const osg::State* state = renderInfo.getState();
-    if ( !state || !_cells.size() ) return;
+    if ( !state || _chunks.empty() ) return;
+    
+    // Views sharing the context keep their own order, so they don't resort each other
+    ContextData& data = _contextData[state->getContextID()];
+    
+    // Orders of deleted cameras are dropped, so a new camera allocated at the same
+    // address starts with a fresh one
+    for ( SortStateMap::iterator itr=data.sortStates.begin(); itr!=data.sortStates.end(); )
+    {
+        if ( !itr->first.valid() ) data.sortStates.erase( itr++ );
+        else ++itr;
+    }
+    std::vector<SortState>& sortStates = data.sortStates[renderInfo.getCurrentCamera()];
     
     const osg::Matrix& modelview = state->getModelViewMatrix();
-    std::sort( _cells.begin(), _cells.end(), LessDepthSortFunctor(modelview) );
+    selectCells( data, sortStates, modelview, state->getProjectionMatrix() );
+    if ( data.drawCells.empty() ) return;
+    
+    if ( _renderMode==INSTANCED_MODE )
+    {
+        renderInstances( data, renderInfo );
+        return;
+    }
     
     glPushMatrix();
-    renderCells( modelview );
+    renderCells( data, modelview );
     glPopMatrix();
 }
 
-void CloudBlock::renderCells( const osg::Matrix& modelview ) const
+void CloudBlock::resizeGLObjectBuffers( unsigned int maxSize )
+{
+    osg::Drawable::resizeGLObjectBuffers( maxSize );
+    _corners->resizeGLObjectBuffers( maxSize );
+    _instanceProgram->resizeGLObjectBuffers( maxSize );
+    _contextData.resize( maxSize );
+}
+
+void CloudBlock::releaseGLObjects( osg::State* state ) const
+{
+    osg::Drawable::releaseGLObjects( state );
+    _corners->releaseGLObjects( state );
+    _instanceProgram->releaseGLObjects( state );
+    for ( unsigned int i=0; i<_contextData.size(); ++i )
+    {
+        if ( state && state->getContextID()!=i ) continue;
+        ContextData& data = _contextData[i];
+        if ( data.positions.valid() ) data.positions->releaseGLObjects( state );
+        data = ContextData();
+    }
+}
+
+/* Map a float to an unsigned integer with the same order, then invert it so that an
+   ascending sort of the keys puts far cells first. */
+static inline unsigned int getDepthKey( float depth )
+{
+    unsigned int bits;
+    memcpy( &bits, &depth, sizeof(float) );
+    bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+    return ~bits;
+}
+
+/* Depth keys of n cells in one pass: depth = x*f0 + y*f1 + z*f2 + f3, then the same
+   mapping as getDepthKey(), which is key = bits ^ (negative ? 0 : 0x7fffffff). The tail
+   adds in the same order as the vector lanes, so all cells get identical rounding. */
+static void computeDepthKeys( const float* x, const float* y, const float* z, unsigned int n,
+                              const float* front, unsigned int* keys )
+{
+    unsigned int i = 0;
+#if defined(COOKBOOK_CLOUD_AVX)
+    __m256 f0 = _mm256_set1_ps( front[0] ), f1 = _mm256_set1_ps( front[1] );
+    __m256 f2 = _mm256_set1_ps( front[2] ), f3 = _mm256_set1_ps( front[3] );
+    __m256 positiveMask = _mm256_castsi256_ps( _mm256_set1_epi32(0x7fffffff) );
+    __m256 zero = _mm256_setzero_ps();
+    for ( ; i+8<=n; i+=8 )
+    {
+        __m256 d = _mm256_add_ps( _mm256_mul_ps(_mm256_loadu_ps(x + i), f0), f3 );
+        d = _mm256_add_ps( d, _mm256_mul_ps(_mm256_loadu_ps(y + i), f1) );
+        d = _mm256_add_ps( d, _mm256_mul_ps(_mm256_loadu_ps(z + i), f2) );
+        
+        // blendv selects by the sign bit, which AVX can't shift out without AVX2
+        __m256 flip = _mm256_blendv_ps( positiveMask, zero, d );
+        _mm256_storeu_ps( (float*)(keys + i), _mm256_xor_ps(d, flip) );
+    }
+#elif defined(COOKBOOK_CLOUD_SSE)
+    __m128 f0 = _mm_set1_ps( front[0] ), f1 = _mm_set1_ps( front[1] );
+    __m128 f2 = _mm_set1_ps( front[2] ), f3 = _mm_set1_ps( front[3] );
+    __m128i positiveMask = _mm_set1_epi32( 0x7fffffff );
+    for ( ; i+4<=n; i+=4 )
+    {
+        __m128 d = _mm_add_ps( _mm_mul_ps(_mm_loadu_ps(x + i), f0), f3 );
+        d = _mm_add_ps( d, _mm_mul_ps(_mm_loadu_ps(y + i), f1) );
+        d = _mm_add_ps( d, _mm_mul_ps(_mm_loadu_ps(z + i), f2) );
+        
+        __m128i bits = _mm_castps_si128( d );
+        __m128i flip = _mm_andnot_si128( _mm_srai_epi32(bits, 31), positiveMask );
+        _mm_storeu_si128( (__m128i*)(keys + i), _mm_xor_si128(bits, flip) );
+    }
+#elif defined(COOKBOOK_CLOUD_NEON)
+    float32x4_t f0 = vdupq_n_f32( front[0] ), f1 = vdupq_n_f32( front[1] );
+    float32x4_t f2 = vdupq_n_f32( front[2] ), f3 = vdupq_n_f32( front[3] );
+    uint32x4_t positiveMask = vdupq_n_u32( 0x7fffffff );
+    for ( ; i+4<=n; i+=4 )
+    {
+        float32x4_t d = vmlaq_f32( f3, vld1q_f32(x + i), f0 );
+        d = vmlaq_f32( d, vld1q_f32(y + i), f1 );
+        d = vmlaq_f32( d, vld1q_f32(z + i), f2 );
+        
+        uint32x4_t bits = vreinterpretq_u32_f32( d );
+        uint32x4_t negative = vreinterpretq_u32_s32( vshrq_n_s32(vreinterpretq_s32_f32(d), 31) );
+        vst1q_u32( keys + i, veorq_u32(bits, vbicq_u32(positiveMask, negative)) );
+    }
+#endif
+    for ( ; i<n; ++i )
+        keys[i] = getDepthKey( (x[i] * front[0] + front[3]) + y[i] * front[1] + z[i] * front[2] );
+}
+
+static bool insertionSort( std::vector<unsigned int>& keys, std::vector<unsigned int>& indices,
+                           unsigned int maxMoves )
+{
+    unsigned int numOfCells = keys.size(), numMoves = 0;
+    for ( unsigned int i=1; i<numOfCells; ++i )
+    {
+        unsigned int key = keys[i], index = indices[i], j = i;
+        for ( ; j>0 && keys[j-1]>key; --j )
+        {
+            keys[j] = keys[j-1];
+            indices[j] = indices[j-1];
+        }
+        keys[j] = key;
+        indices[j] = index;
+        
+        numMoves += i - j;
+        if ( numMoves>maxMoves ) return false;
+    }
+    return true;
+}
+
+static void radixSort( std::vector<unsigned int>& keys, std::vector<unsigned int>& indices,
+                       std::vector<unsigned int>& tempKeys, std::vector<unsigned int>& tempIndices )
+{
+    // Stable LSD sort in three passes of 11 bits; passes where all keys share the digit are skipped
+    const unsigned int numBuckets = 1 << 11;
+    unsigned int numOfCells = keys.size();
+    tempKeys.resize( numOfCells );
+    tempIndices.resize( numOfCells );
+    
+    std::vector<unsigned int> counts( numBuckets * 3, 0 );
+    for ( unsigned int i=0; i<numOfCells; ++i )
+    {
+        unsigned int key = keys[i];
+        counts[key & 0x7ff]++;
+        counts[numBuckets + ((key >> 11) & 0x7ff)]++;
+        counts[numBuckets*2 + (key >> 22)]++;
+    }
+    
+    for ( unsigned int pass=0; pass<3; ++pass )
+    {
+        unsigned int* count = &counts[numBuckets * pass];
+        unsigned int shift = pass * 11;
+        if ( count[(keys[0] >> shift) & 0x7ff]==numOfCells ) continue;
+        
+        unsigned int offset = 0;
+        for ( unsigned int b=0; b<numBuckets; ++b )
+        {
+            unsigned int c = count[b];
+            count[b] = offset;
+            offset += c;
+        }
+        
+        for ( unsigned int i=0; i<numOfCells; ++i )
+        {
+            unsigned int key = keys[i];
+            unsigned int dst = count[(key >> shift) & 0x7ff]++;
+            tempKeys[dst] = key;
+            tempIndices[dst] = indices[i];
+        }
+        keys.swap( tempKeys );
+        indices.swap( tempIndices );
+    }
+}
+
+float CloudBlock::getCellScale( const Chunk& chunk, unsigned int numCells )
+{
+    // Fewer cells are drawn larger, so a thinned chunk covers about the same area
+    return sqrtf( (float)chunk.count / (float)numCells );
+}
+
+osg::BoundingBox CloudBlock::getScaledBound( const Chunk& chunk, float scale )
+{
+    // Quads of unit size reach one unit beyond the cell centers, times their LOD scale
+    osg::BoundingBox bound = chunk.bound;
+    bound._min -= osg::Vec3(scale, scale, scale);
+    bound._max += osg::Vec3(scale, scale, scale);
+    return bound;
+}
+
+void CloudBlock::selectCells( ContextData& data, std::vector<SortState>& sortStates,
+                              const osg::Matrix& modelview, const osg::Matrix& projection ) const
+{
+    LessDepthSortFunctor functor( modelview );
+    osg::Vec3 direction( functor._frontVector[0], functor._frontVector[1], functor._frontVector[2] );
+    direction.normalize();
+    
+    // Cull chunks here rather than in the cull traversal, like the cells are sorted here
+    osg::Polytope frustum;
+    frustum.setToUnitFrustum();
+    frustum.transformProvidingInverse( modelview * projection );
+    
+    struct VisibleChunk
+    {
+        unsigned int index, numCells;
+        float depth;
+        bool operator<( const VisibleChunk& rhs ) const { return depth>rhs.depth; }
+    };
+    
+    // Candidates are the chunks that are visible with the largest quads they may be drawn with
+    std::vector<VisibleChunk> candidates;
+    for ( unsigned int i=0; i<_chunks.size(); ++i )
+    {
+        const Chunk& chunk = _chunks[i];
+        if ( !frustum.contains(getScaledBound(chunk, sqrtf((float)chunk.count))) ) continue;
+        
+        VisibleChunk candidate;
+        candidate.index = i;
+        candidate.depth = functor.getDepth( chunk.bound.center() );
+        candidate.numCells = chunk.count;
+        if ( _lodDistance>0.0f && candidate.depth>_lodDistance )
+            candidate.numCells = osg::maximum( 1u, (unsigned int)(chunk.count * _lodDistance / candidate.depth) );
+        candidates.push_back( candidate );
+    }
+    
+    // Thin out all chunks by the same ratio to stay within the budget. Thinned chunks are
+    // drawn with larger quads, which may bring more of them into view, so the ratio is
+    // lowered again until the visible set stops growing
+    std::vector<VisibleChunk> visibleChunks;
+    float ratio = 1.0f;
+    while ( true )
+    {
+        unsigned int numVisibleCells = 0, numLastVisible = visibleChunks.size();
+        visibleChunks.clear();
+        for ( unsigned int i=0; i<candidates.size(); ++i )
+        {
+            VisibleChunk visible = candidates[i];
+            const Chunk& chunk = _chunks[visible.index];
+            if ( ratio<1.0f )
+                visible.numCells = osg::maximum( 1u, (unsigned int)(visible.numCells * ratio) );
+            if ( !frustum.contains(getScaledBound(chunk, getCellScale(chunk, visible.numCells))) ) continue;
+            
+            numVisibleCells += visible.numCells;
+            visibleChunks.push_back( visible );
+        }
+        
+        if ( _maxDrawnCells==0 || numVisibleCells<=_maxDrawnCells ) break;
+        if ( ratio<1.0f && visibleChunks.size()==numLastVisible ) break;
+        ratio *= (float)_maxDrawnCells / (float)numVisibleCells;
+    }
+    
+    // Chunks don't overlap, so drawing them back to front keeps the cells in order
+    std::sort( visibleChunks.begin(), visibleChunks.end() );
+    
+    sortStates.resize( _chunks.size() );
+    data.drawCells.clear();
+    data.drawScales.clear();
+    for ( unsigned int i=0; i<visibleChunks.size(); ++i )
+    {
+        const VisibleChunk& visible = visibleChunks[i];
+        const Chunk& chunk = _chunks[visible.index];
+        SortState& sortState = sortStates[visible.index];
+        sortCells( sortState, chunk, functor, direction );
+        
+        float scale = getCellScale( chunk, visible.numCells );
+        for ( unsigned int j=0; j<chunk.count; ++j )
+        {
+            unsigned int local = sortState.indices[j];
+            if ( local>=visible.numCells ) continue;
+            data.drawCells.push_back( chunk.first + local );
+            data.drawScales.push_back( scale );
+        }
+    }
+}
+
+void CloudBlock::sortCells( SortState& sortState, const Chunk& chunk, const LessDepthSortFunctor& functor,
+                            const osg::Vec3& direction ) const
+{
+    unsigned int numOfCells = chunk.count;
+    if ( sortState.indices.size()!=numOfCells || sortState.revision!=_cellsRevision )
+    {
+        sortState.indices.resize( numOfCells );
+        for ( unsigned int i=0; i<numOfCells; ++i ) sortState.indices[i] = i;
+        sortState.revision = _cellsRevision;
+        sortState.valid = false;
+    }
+    else if ( sortState.valid && direction*sortState.direction>=_sortCosine )
+        return;
+    sortState.direction = direction;
+    
+    // Keys of the chunk in storage order, with the origin folded into the plane offset
+    const osg::Vec4& f = functor._frontVector;
+    float front[4] = { f[0], f[1], f[2],
+                       (float)(f[3] + _cellOrigin.x()*f[0] + _cellOrigin.y()*f[1] + _cellOrigin.z()*f[2]) };
+    std::vector<unsigned int>& cellKeys = sortState.tempKeys;
+    cellKeys.resize( numOfCells );
+    computeDepthKeys( &_cellX[chunk.first], &_cellY[chunk.first], &_cellZ[chunk.first],
+                      numOfCells, front, &cellKeys[0] );
+    
+    // Keys follow the current order, so counting descents shows how much it is broken
+    std::vector<unsigned int>& keys = sortState.keys;
+    keys.resize( numOfCells );
+    unsigned int numDescents = 0;
+    for ( unsigned int i=0; i<numOfCells; ++i )
+    {
+        keys[i] = cellKeys[sortState.indices[i]];
+        if ( i>0 && keys[i]<keys[i-1] ) numDescents++;
+    }
+    
+    // A slowly turning camera only swaps a few neighbours, which insertion sort repairs
+    // in nearly linear time. It gives up when cells move too far and a radix sort is cheaper
+    if ( numDescents>0 )
+    {
+        if ( !sortState.valid || numDescents>numOfCells/32 ||
+             !insertionSort(keys, sortState.indices, numOfCells * 4) )
+            radixSort( keys, sortState.indices, sortState.tempKeys, sortState.tempIndices );
+    }
+    sortState.valid = true;
+}
+
+void CloudBlock::renderCells( const ContextData& data, const osg::Matrix& modelview ) const
 {
     osg::Vec3d px = osg::Matrix::transform3x3( modelview, osg::X_AXIS );
     osg::Vec3d py = osg::Matrix::transform3x3( modelview, osg::Y_AXIS );
     px.normalize(); py.normalize();
     
-    double size = 1.0f, scale = 1.0f;
+    double size = 1.0f;
     osg::Vec3d right, up;
     glBegin( GL_QUADS );
     
-    unsigned int detail = 1;
-    unsigned int numOfCells = _cells.size();
-    for ( unsigned int i=0; i<numOfCells; i+=detail )
+    unsigned int numOfCells = data.drawCells.size();
+    for ( unsigned int i=0; i<numOfCells; ++i )
     {
-        const CloudCell& cell = _cells[i];
-        osg::Vec3d pos = cell._pos;
-        unsigned char alpha = (unsigned char)( cell._density );
-        unsigned char color = (unsigned char)( cell._brightness * cell._density / 255.0f );
+        unsigned int k = data.drawCells[i];
+        osg::Vec3d pos = _cellOrigin + osg::Vec3d(_cellX[k], _cellY[k], _cellZ[k]);
+        double scale = data.drawScales[i];
         right.set( px * size * scale );
         up.set( py * size * scale );
         
-        glColor4ub( color, color, color, alpha );
+        glColor4ubv( _cellColors[k].ptr() );
         glTexCoord2f( 0.0f, 0.0f );
         glVertex3dv( (pos-right+up).ptr() );
         glTexCoord2f( 0.0f, 1.0f );
@@ -79,3 +599,63 @@ void CloudBlock::renderCells( const osg::Matrix& modelview ) const
     }
     glEnd();
 }
+
+void CloudBlock::renderInstances( ContextData& data, osg::RenderInfo& renderInfo ) const
+{
+    osg::State& state = *renderInfo.getState();
+    const osg::GLExtensions* ext = state.get<osg::GLExtensions>();
+    if ( !ext->glDrawArraysInstanced || !ext->glVertexAttribDivisor )
+    {
+        static bool s_warned = false;
+        if ( !s_warned )
+            OSG_WARN << "CloudBlock: Instanced arrays are not supported, use IMMEDIATE_MODE instead" << std::endl;
+        s_warned = true;
+        return;
+    }
+    
+    if ( !data.positions )
+    {
+        // Rewritten every frame after sorting
+        osg::ref_ptr<osg::VertexBufferObject> vbo = new osg::VertexBufferObject;
+        vbo->setUsage( GL_STREAM_DRAW_ARB );
+        data.positions = new osg::Vec4Array;
+        data.positions->setVertexBufferObject( vbo.get() );
+        data.colors = new osg::Vec4ubArray;
+        data.colors->setNormalize( true );
+        data.colors->setVertexBufferObject( vbo.get() );
+    }
+    
+    // Stream the selected cells in the same colors as the immediate mode, with the
+    // LOD scale of each cell in w
+    unsigned int numOfCells = data.drawCells.size();
+    osg::Vec3 origin = _cellOrigin;
+    osg::Vec4Array& positions = *data.positions;
+    osg::Vec4ubArray& colors = *data.colors;
+    positions.resize( numOfCells );
+    colors.resize( numOfCells );
+    for ( unsigned int i=0; i<numOfCells; ++i )
+    {
+        unsigned int k = data.drawCells[i];
+        positions[i].set( origin.x() + _cellX[k], origin.y() + _cellY[k], origin.z() + _cellZ[k],
+                          data.drawScales[i] );
+        colors[i] = _cellColors[k];
+    }
+    positions.dirty();
+    colors.dirty();
+    
+    osg::VertexArrayState* vas = state.getCurrentVertexArrayState();
+    vas->setVertexBufferObjectSupported( true );
+    vas->lazyDisablingOfVertexAttributes();
+    vas->setVertexArray( state, _corners.get() );
+    vas->setVertexAttribArray( state, s_positionAttrib, &positions );
+    vas->setVertexAttribArray( state, s_colorAttrib, &colors );
+    vas->applyDisablingOfVertexAttributes( state );
+    
+    // Per-cell attributes advance once per quad, and are reset for other drawables
+    ext->glVertexAttribDivisor( s_positionAttrib, 1 );
+    ext->glVertexAttribDivisor( s_colorAttrib, 1 );
+    ext->glDrawArraysInstanced( GL_TRIANGLE_STRIP, 0, 4, numOfCells );
+    ext->glVertexAttribDivisor( s_positionAttrib, 0 );
+    ext->glVertexAttribDivisor( s_colorAttrib, 0 );
+    vas->unbindVertexBufferObject();
+}
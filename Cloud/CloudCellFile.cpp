@@ -0,0 +1,342 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Chapter 6 Recipe 9
+*/
+
+#include <osg/BoundingBox>
+#include <osg/Notify>
+#include <osgDB/FileNameUtils>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+
+#ifdef _WIN32
+    #define WIN32_LEAN_AND_MEAN
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+#include "ThreadPool"
+#include "CloudCellFile"
+
+struct CloudCellHeader
+{
+    char magic[4];
+    unsigned int version;
+    unsigned long long numCells;
+    double origin[3];
+    char reserved[24];
+};
+
+static const unsigned int s_headerSize = 64;
+static const unsigned int s_textChunkSize = 4 * 1024 * 1024;
+
+static inline unsigned long long getPaddedSize( unsigned long long numCells )
+{ return ((numCells + 3) & ~3ull) * sizeof(float); }
+
+MappedFile::MappedFile()
+:   _data(0), _size(0), _fileHandle(0), _mappingHandle(0)
+{
+}
+
+bool MappedFile::open( const std::string& file )
+{
+    close();
+#ifdef _WIN32
+    HANDLE fileHandle = CreateFileA( file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                                     OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+    if ( fileHandle==INVALID_HANDLE_VALUE ) return false;
+
+    LARGE_INTEGER size;
+    if ( !GetFileSizeEx(fileHandle, &size) || !size.QuadPart )
+    {
+        CloseHandle( fileHandle );
+        return false;
+    }
+
+    HANDLE mappingHandle = CreateFileMappingA( fileHandle, NULL, PAGE_READONLY, 0, 0, NULL );
+    void* data = mappingHandle ? MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if ( !data )
+    {
+        if ( mappingHandle ) CloseHandle( mappingHandle );
+        CloseHandle( fileHandle );
+        return false;
+    }
+
+    _fileHandle = fileHandle;
+    _mappingHandle = mappingHandle;
+    _size = size.QuadPart;
+#else
+    int fd = ::open( file.c_str(), O_RDONLY );
+    if ( fd<0 ) return false;
+
+    struct stat st;
+    if ( fstat(fd, &st)!=0 || !st.st_size )
+    {
+        ::close( fd );
+        return false;
+    }
+
+    // The mapping stays valid after closing the descriptor
+    void* data = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    ::close( fd );
+    if ( data==MAP_FAILED ) return false;
+    madvise( data, st.st_size, MADV_SEQUENTIAL );
+    _size = st.st_size;
+#endif
+    _data = (const char*)data;
+    return true;
+}
+
+void MappedFile::close()
+{
+    if ( !_data ) return;
+#ifdef _WIN32
+    UnmapViewOfFile( _data );
+    CloseHandle( (HANDLE)_mappingHandle );
+    CloseHandle( (HANDLE)_fileHandle );
+#else
+    munmap( (void*)_data, _size );
+#endif
+    _data = 0; _size = 0;
+    _fileHandle = 0; _mappingHandle = 0;
+}
+
+CloudCellFile::CloudCellFile()
+:   _numCells(0)
+{
+    for ( unsigned int i=0; i<NUM_ARRAYS; ++i ) _array[i] = 0;
+}
+
+bool CloudCellFile::open( const std::string& file )
+{
+    close();
+    osg::ref_ptr<MappedFile> mapped = new MappedFile;
+    if ( !mapped->open(file) ) return false;
+
+    CloudCellHeader header;
+    if ( mapped->size()<s_headerSize ) return false;
+    memcpy( &header, mapped->data(), sizeof(CloudCellHeader) );
+    if ( memcmp(header.magic, "CELL", 4)!=0 || header.version!=1 )
+    {
+        OSG_WARN << file << " is not a cloud cell file" << std::endl;
+        return false;
+    }
+
+    unsigned long long arraySize = getPaddedSize( header.numCells );
+    if ( header.numCells>0xffffffffull || mapped->size()<s_headerSize + arraySize * NUM_ARRAYS )
+    {
+        OSG_WARN << file << " is truncated" << std::endl;
+        return false;
+    }
+
+    _file = mapped;
+    _numCells = (unsigned int)header.numCells;
+    _origin.set( header.origin[0], header.origin[1], header.origin[2] );
+    for ( unsigned int i=0; i<NUM_ARRAYS; ++i )
+        _array[i] = (const float*)(_file->data() + s_headerSize + arraySize * i);
+    return true;
+}
+
+void CloudCellFile::close()
+{
+    _file = NULL;
+    _numCells = 0;
+    for ( unsigned int i=0; i<NUM_ARRAYS; ++i ) _array[i] = 0;
+}
+
+void CloudCellFile::getCloudCells( CloudBlock::CloudCells& cells ) const
+{
+    cells.resize( _numCells );
+    if ( !_numCells ) return;
+
+    CloudBlock::CloudCell* out = &cells[0];
+    osgCookBook::ThreadPool::instance()->parallelFor( 0, _numCells,
+        [this, out]( unsigned int first, unsigned int last )
+        {
+            for ( unsigned int i=first; i<last; ++i )
+            {
+                out[i]._pos.set( _origin[0] + _array[X][i], _origin[1] + _array[Y][i],
+                                 _origin[2] + _array[Z][i] );
+                out[i]._density = _array[DENSITY][i];
+                out[i]._brightness = _array[BRIGHTNESS][i];
+            }
+        }, 65536 );
+}
+
+bool CloudCellFile::write( const std::string& file, const CloudBlock::CloudCells& cells )
+{
+    std::ofstream os( file.c_str(), std::ios::out|std::ios::binary );
+    if ( !os ) return false;
+
+    osg::BoundingBoxd bb;
+    for ( unsigned int i=0; i<cells.size(); ++i ) bb.expandBy( cells[i]._pos );
+    osg::Vec3d origin = cells.empty() ? osg::Vec3d() : bb.center();
+
+    CloudCellHeader header;
+    memset( &header, 0, sizeof(CloudCellHeader) );
+    memcpy( header.magic, "CELL", 4 );
+    header.version = 1;
+    header.numCells = cells.size();
+    header.origin[0] = origin[0]; header.origin[1] = origin[1]; header.origin[2] = origin[2];
+    os.write( (const char*)&header, sizeof(CloudCellHeader) );
+
+    std::vector<float> values( getPaddedSize(cells.size()) / sizeof(float), 0.0f );
+    for ( unsigned int a=0; a<NUM_ARRAYS; ++a )
+    {
+        for ( unsigned int i=0; i<cells.size(); ++i )
+        {
+            const CloudBlock::CloudCell& cell = cells[i];
+            switch ( a )
+            {
+            case X: values[i] = (float)(cell._pos[0] - origin[0]); break;
+            case Y: values[i] = (float)(cell._pos[1] - origin[1]); break;
+            case Z: values[i] = (float)(cell._pos[2] - origin[2]); break;
+            case DENSITY: values[i] = cell._density; break;
+            default: values[i] = cell._brightness; break;
+            }
+        }
+        if ( !values.empty() ) os.write( (const char*)&values[0], values.size() * sizeof(float) );
+    }
+    return os.good();
+}
+
+/* Number parsing on the mapped range, which is not null terminated, so strtod() can't
+   be used safely at the end of the file. */
+static inline bool parseNumber( const char*& p, const char* end, double& value )
+{
+    while ( p<end && (*p==' ' || *p=='\t' || *p=='\r') ) ++p;
+    if ( p==end || *p=='\n' ) return false;
+
+    bool negative = (*p=='-');
+    if ( *p=='-' || *p=='+' ) ++p;
+
+    unsigned long long mantissa = 0;
+    int exponent = 0, numDigits = 0;
+    for ( ; p<end && *p>='0' && *p<='9'; ++p, ++numDigits )
+    {
+        if ( mantissa<100000000000000000ull ) mantissa = mantissa * 10 + (*p - '0');
+        else exponent++;
+    }
+    if ( p<end && *p=='.' )
+    {
+        for ( ++p; p<end && *p>='0' && *p<='9'; ++p, ++numDigits )
+        {
+            if ( mantissa<100000000000000000ull ) { mantissa = mantissa * 10 + (*p - '0'); exponent--; }
+        }
+    }
+    if ( !numDigits ) return false;
+
+    if ( p<end && (*p=='e' || *p=='E') )
+    {
+        const char* q = p + 1;
+        bool negativeExp = (q<end && *q=='-');
+        if ( q<end && (*q=='-' || *q=='+') ) ++q;
+        int e = 0, expDigits = 0;
+        for ( ; q<end && *q>='0' && *q<='9'; ++q, ++expDigits ) e = e * 10 + (*q - '0');
+        if ( expDigits>0 ) { exponent += negativeExp ? -e : e; p = q; }
+    }
+
+    value = (double)mantissa;
+    if ( exponent ) value *= pow( 10.0, exponent );
+    if ( negative ) value = -value;
+    return true;
+}
+
+static void parseChunk( const char* p, const char* end, CloudBlock::CloudCells& cells )
+{
+    double values[5];
+    while ( p<end )
+    {
+        // Lines without all five fields are skipped, so a trailing newline adds no cell
+        unsigned int numValues = 0;
+        while ( numValues<5 && parseNumber(p, end, values[numValues]) ) numValues++;
+        if ( numValues==5 )
+        {
+            CloudBlock::CloudCell cell;
+            cell._pos.set( values[0], values[1], values[2] );
+            cell._density = (float)values[3];
+            cell._brightness = (float)values[4];
+            cells.push_back( cell );
+        }
+
+        while ( p<end && *p!='\n' ) ++p;
+        if ( p<end ) ++p;
+    }
+}
+
+bool readCloudCellsText( CloudBlock::CloudCells& cells, const std::string& file )
+{
+    osg::ref_ptr<MappedFile> mapped = new MappedFile;
+    if ( !mapped->open(file) ) return false;
+
+    // Chunks start right after a line end, so no line is split between two threads
+    const char* data = mapped->data();
+    const char* end = data + mapped->size();
+    std::vector<const char*> starts( 1, data );
+    while ( end - starts.back()>(long long)s_textChunkSize )
+    {
+        const char* p = (const char*)memchr( starts.back() + s_textChunkSize, '\n',
+                                             end - starts.back() - s_textChunkSize );
+        if ( !p ) break;
+        starts.push_back( p + 1 );
+    }
+    starts.push_back( end );
+
+    unsigned int numChunks = starts.size() - 1;
+    std::vector<CloudBlock::CloudCells> chunkCells( numChunks );
+    osgCookBook::ThreadPool::instance()->parallelFor( 0, numChunks,
+        [&starts, &chunkCells]( unsigned int first, unsigned int last )
+        {
+            for ( unsigned int c=first; c<last; ++c )
+            {
+                // Rough guess of 40 bytes per line to avoid most reallocations
+                chunkCells[c].reserve( (starts[c+1] - starts[c]) / 40 );
+                parseChunk( starts[c], starts[c+1], chunkCells[c] );
+            }
+        } );
+
+    size_t numCells = 0;
+    for ( unsigned int c=0; c<numChunks; ++c ) numCells += chunkCells[c].size();
+    cells.clear();
+    cells.reserve( numCells );
+    for ( unsigned int c=0; c<numChunks; ++c )
+        cells.insert( cells.end(), chunkCells[c].begin(), chunkCells[c].end() );
+    return true;
+}
+
+bool writeCloudCellsText( const CloudBlock::CloudCells& cells, const std::string& file )
+{
+    std::ofstream os( file.c_str() );
+    if ( !os ) return false;
+
+    os << std::setprecision( 10 );
+    for ( CloudBlock::CloudCells::const_iterator itr=cells.begin(); itr!=cells.end(); ++itr )
+    {
+        os << itr->_pos.x() << " " << itr->_pos.y() << " " << itr->_pos.z() << " "
+           << itr->_density << " " << itr->_brightness << "\n";
+    }
+    return os.good();
+}
+
+bool readCloudCells( CloudBlock::CloudCells& cells, const std::string& file )
+{
+    if ( osgDB::getLowerCaseFileExtension(file)!="cells" )
+        return readCloudCellsText( cells, file );
+
+    osg::ref_ptr<CloudCellFile> cellFile = new CloudCellFile;
+    if ( !cellFile->open(file) ) return false;
+    cellFile->getCloudCells( cells );
+    return true;
+}
+
+bool writeCloudCells( const CloudBlock::CloudCells& cells, const std::string& file )
+{
+    if ( osgDB::getLowerCaseFileExtension(file)!="cells" )
+        return writeCloudCellsText( cells, file );
+    return CloudCellFile::write( file, cells );
+}
@@ -0,0 +1,309 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Chapter 6 Recipe 9
+*/
+
+#include <osg/Notify>
+#include <osg/OperationThread>
+#include <osg/Timer>
+#include <OpenThreads/ScopedLock>
+#include <OpenThreads/Thread>
+#include <algorithm>
+#include "ThreadPool"
+#include "CloudLighting"
+
+// Multiple scattering as a sum of octaves, each with the extinction and the weight of
+// the previous one scaled down (Wrenninge et al.)
+static const unsigned int s_numOctaves = 3;
+static const float s_octaveExtinction = 0.5f;
+static const float s_octaveWeight = 0.5f;
+
+class CloudLightingOperation : public osg::Operation
+{
+public:
+    CloudLightingOperation( CloudLighting* lighting, const osg::Vec3& sunDirection )
+    :   osg::Operation("CloudLightingOperation", false), _lighting(lighting), _sunDirection(sunDirection) {}
+
+    virtual void operator()( osg::Object* )
+    {
+        _lighting->run( _sunDirection );
+
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _lighting->_mutex );
+        _lighting->_resultReady = true;
+    }
+
+protected:
+    osg::ref_ptr<CloudLighting> _lighting;
+    osg::Vec3 _sunDirection;
+};
+
+CloudLighting::CloudLighting( CloudBlock* block )
+:   _block(block), _sunDirection(0.0f, 0.0f, 1.0f), _extinction(8.0f), _ambient(0.2f),
+    _updateCosine(cosf(osg::DegreesToRadians(1.0f))), _gridResolution(64),
+    _voxelSize(1.0f), _gridExtent(1.0f), _densityValid(false), _started(false),
+    _running(false), _resultReady(false)
+{
+    _dims[0] = _dims[1] = _dims[2] = 0;
+
+    // The update traversal rewrites the cell colors, so the next frame must not start
+    // before the draw is done with them
+    if ( block ) block->setDataVariance( osg::Object::DYNAMIC );
+}
+
+void CloudLighting::setSunDirection( const osg::Vec3& dir )
+{
+    _sunDirection = dir;
+    _sunDirection.normalize();
+}
+
+void CloudLighting::dirtyDensity()
+{
+    OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+    _densityValid = false;
+}
+
+void CloudLighting::compute()
+{
+    // A running job shares the grids; let it finish and drop its result
+    while ( true )
+    {
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+            if ( !_running || _resultReady )
+            {
+                _running = false;
+                _resultReady = false;
+                break;
+            }
+        }
+        OpenThreads::Thread::YieldCurrentThread();
+    }
+
+    _jobDirection = _sunDirection;
+    _started = true;
+    run( _jobDirection );
+    apply();
+}
+
+void CloudLighting::operator()( osg::Node* node, osg::NodeVisitor* nv )
+{
+    bool startJob = false;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        if ( _resultReady )
+        {
+            apply();
+            _resultReady = false;
+            _running = false;
+        }
+
+        // Directions requested while a job runs are coalesced; only the latest one is
+        // picked up once the job is applied
+        if ( !_running && (!_started || _sunDirection * _jobDirection<_updateCosine) )
+        {
+            _jobDirection = _sunDirection;
+            _started = true;
+            _running = true;
+            startJob = true;
+        }
+    }
+
+    if ( startJob )
+        osgCookBook::ThreadPool::instance()->add( new CloudLightingOperation(this, _jobDirection) );
+    traverse( node, nv );
+}
+
+void CloudLighting::run( const osg::Vec3& sunDirection )
+{
+    osg::ref_ptr<CloudBlock> block;
+    if ( !_block.lock(block) ) return;
+
+    osg::Timer_t start = osg::Timer::instance()->tick();
+    const CloudBlock::CloudCells& cells = block->getCloudCells();
+
+    bool rebuild = false;
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        rebuild = !_densityValid;
+        _densityValid = true;
+    }
+    if ( rebuild ) buildDensityGrid( cells );
+
+    propagateOpticalDepth( sunDirection );
+    computeBrightness( cells );
+
+    OSG_INFO << "CloudLighting: Relit " << cells.size() << " cells on a " << _dims[0] << "x"
+             << _dims[1] << "x" << _dims[2] << " grid in "
+             << osg::Timer::instance()->delta_m(start, osg::Timer::instance()->tick()) << "ms" << std::endl;
+}
+
+void CloudLighting::apply()
+{
+    osg::ref_ptr<CloudBlock> block;
+    if ( !_block.lock(block) ) return;
+
+    // The cells may have been replaced while the job was running
+    CloudBlock::CloudCells& cells = block->getCloudCells();
+    if ( cells.size()!=_brightness.size() ) return;
+
+    for ( unsigned int i=0; i<cells.size(); ++i )
+        cells[i]._brightness = _brightness[i];
+    block->dirtyColors();
+}
+
+void CloudLighting::buildDensityGrid( const CloudBlock::CloudCells& cells )
+{
+    osg::BoundingBoxd bound;
+    for ( unsigned int i=0; i<cells.size(); ++i )
+        bound.expandBy( cells[i]._pos );
+    if ( !bound.valid() )
+    {
+        _dims[0] = _dims[1] = _dims[2] = 0;
+        _density.clear();
+        return;
+    }
+
+    // Cubic voxels centered on the grid points, the longest side gets the full resolution
+    osg::Vec3d size = bound._max - bound._min;
+    double extent = osg::maximum( size.x(), osg::maximum(size.y(), size.z()) );
+    unsigned int resolution = osg::maximum( _gridResolution, 2u );
+    _gridExtent = osg::maximum( (float)extent, 1e-6f );
+    _voxelSize = _gridExtent / (resolution - 1);
+    _gridOrigin = bound._min;
+    for ( int i=0; i<3; ++i )
+        _dims[i] = (int)ceil(size[i] / _voxelSize) + 1;
+
+    // Keep the densest cell of each voxel, so sparse regions don't get smeared out
+    _density.assign( _dims[0] * _dims[1] * _dims[2], 0.0f );
+    for ( unsigned int i=0; i<cells.size(); ++i )
+    {
+        osg::Vec3d pos = (cells[i]._pos - _gridOrigin) / _voxelSize;
+        int x = osg::clampBetween( (int)(pos.x() + 0.5), 0, _dims[0]-1 );
+        int y = osg::clampBetween( (int)(pos.y() + 0.5), 0, _dims[1]-1 );
+        int z = osg::clampBetween( (int)(pos.z() + 0.5), 0, _dims[2]-1 );
+        float& density = _density[getVoxel(x, y, z)];
+        density = osg::maximum( density, cells[i]._density );
+    }
+}
+
+void CloudLighting::propagateOpticalDepth( const osg::Vec3& sunDirection )
+{
+    _opticalDepth.assign( _density.size(), 0.0f );
+    if ( _density.empty() ) return;
+
+    // Sweep along the axis closest to the sun direction. One step towards the sun then
+    // always ends on the neighboring slice, so each slice only reads the one finished
+    // before it and all voxels of a slice can be done in parallel
+    int m = 0;
+    for ( int i=1; i<3; ++i )
+    {
+        if ( fabs(sunDirection[i])>fabs(sunDirection[m]) ) m = i;
+    }
+    int a = (m + 1) % 3, b = (m + 2) % 3;
+    int stride[3] = { 1, _dims[0], _dims[0] * _dims[1] };
+
+    float major = fabs( sunDirection[m] );
+    if ( major<=0.0f ) return;
+    float offsetA = sunDirection[a] / major, offsetB = sunDirection[b] / major;
+    int step = sunDirection[m]>0.0f ? 1 : -1;
+
+    // Trapezoid rule over one step of length voxelSize / major
+    float sigma = _extinction / (_gridExtent * 255.0f);
+    float halfStep = 0.5f * sigma * _voxelSize / major;
+
+    int first = step>0 ? _dims[m]-1 : 0;
+    for ( int s=first; s>=0 && s<_dims[m]; s-=step )
+    {
+        // Beyond the grid there is no cloud, so the first slice starts from zero
+        int upstream = s + step;
+        bool hasUpstream = upstream>=0 && upstream<_dims[m];
+        osgCookBook::ThreadPool::instance()->parallelFor( 0, _dims[a],
+            [&]( unsigned int firstRow, unsigned int lastRow )
+        {
+            for ( int i=firstRow; i<(int)lastRow; ++i )
+            {
+                float fa = i + offsetA;
+                int ia = (int)floorf(fa);
+                float wa = fa - ia;
+                for ( int j=0; j<_dims[b]; ++j )
+                {
+                    float fb = j + offsetB;
+                    int ib = (int)floorf(fb);
+                    float wb = fb - ib;
+
+                    float tau = 0.0f, density = 0.0f;
+                    for ( int c=0; hasUpstream && c<4; ++c )
+                    {
+                        int ca = ia + (c & 1), cb = ib + (c >> 1);
+                        if ( ca<0 || ca>=_dims[a] || cb<0 || cb>=_dims[b] ) continue;
+
+                        float w = ((c & 1) ? wa : 1.0f - wa) * ((c >> 1) ? wb : 1.0f - wb);
+                        unsigned int index = upstream * stride[m] + ca * stride[a] + cb * stride[b];
+                        tau += w * _opticalDepth[index];
+                        density += w * _density[index];
+                    }
+
+                    unsigned int index = s * stride[m] + i * stride[a] + j * stride[b];
+                    _opticalDepth[index] = tau + halfStep * (density + _density[index]);
+                }
+            }
+        }, 4 );
+    }
+}
+
+float CloudLighting::sampleGrid( const std::vector<float>& grid, const osg::Vec3& pos ) const
+{
+    int base[3];
+    float weight[3];
+    for ( int i=0; i<3; ++i )
+    {
+        float p = osg::clampBetween( pos[i], 0.0f, (float)(_dims[i] - 1) );
+        base[i] = osg::minimum( (int)p, osg::maximum(_dims[i] - 2, 0) );
+        weight[i] = p - base[i];
+    }
+
+    float value = 0.0f;
+    for ( int c=0; c<8; ++c )
+    {
+        int x = osg::minimum( base[0] + (c & 1), _dims[0]-1 );
+        int y = osg::minimum( base[1] + ((c >> 1) & 1), _dims[1]-1 );
+        int z = osg::minimum( base[2] + (c >> 2), _dims[2]-1 );
+        float w = ((c & 1) ? weight[0] : 1.0f - weight[0]) *
+                  (((c >> 1) & 1) ? weight[1] : 1.0f - weight[1]) *
+                  ((c >> 2) ? weight[2] : 1.0f - weight[2]);
+        value += w * grid[getVoxel(x, y, z)];
+    }
+    return value;
+}
+
+void CloudLighting::computeBrightness( const CloudBlock::CloudCells& cells )
+{
+    _brightness.resize( cells.size() );
+    if ( _opticalDepth.empty() )
+    {
+        std::fill( _brightness.begin(), _brightness.end(), 255.0f );
+        return;
+    }
+
+    float totalWeight = 0.0f, weight = 1.0f;
+    for ( unsigned int o=0; o<s_numOctaves; ++o, weight*=s_octaveWeight )
+        totalWeight += weight;
+
+    osgCookBook::ThreadPool::instance()->parallelFor( 0, cells.size(),
+        [&]( unsigned int first, unsigned int last )
+    {
+        for ( unsigned int i=first; i<last; ++i )
+        {
+            osg::Vec3 pos = (cells[i]._pos - _gridOrigin) / _voxelSize;
+            float tau = sampleGrid( _opticalDepth, pos );
+
+            float light = 0.0f, octaveWeight = 1.0f, octaveTau = tau;
+            for ( unsigned int o=0; o<s_numOctaves; ++o )
+            {
+                light += octaveWeight * expf(-octaveTau);
+                octaveWeight *= s_octaveWeight;
+                octaveTau *= s_octaveExtinction;
+            }
+            _brightness[i] = 255.0f * (_ambient + (1.0f - _ambient) * light / totalWeight);
+        }
+    }, 4096 );
+}
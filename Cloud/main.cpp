@@ -8,11 +8,13 @@
 #include <osg/Texture2D>
 #include <osgDB/ReadFile>
 #include <osgViewer/Viewer>
-#include <fstream>
 #include <iostream>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 #include "CloudBlock"
+#include "CloudCellFile"
+#include "CloudLighting"
 
 osg::Image* makeGlow( int width, int height, float expose, float sizeDisc )
 {
@@ -38,32 +40,58 @@ osg::Image* makeGlow( int width, int height, float expose, float sizeDisc )
 	return image.release();
 }
 
-void readCloudCells( CloudBlock::CloudCells& cells, const std::string& file )
+/** Turns the sun once around the cloud per day, rising in the east. */
+class DayCycleCallback : public osg::NodeCallback
 {
-    std::ifstream is( file.c_str() );
-    if ( !is ) return;
+public:
+    DayCycleCallback( CloudLighting* lighting, double dayLength )
+    :   _lighting(lighting), _dayLength(dayLength) {}
     
-    double x, y, z;
-    unsigned int density, brightness;
-    while ( !is.eof() )
+    virtual void operator()( osg::Node* node, osg::NodeVisitor* nv )
     {
-        is >> x >> y >> z >> density >> brightness;
-        
-        CloudBlock::CloudCell cell;
-        cell._pos.set( x, y, z );
-        cell._density = (float)density;
-        cell._brightness = (float)brightness;
-        cells.push_back( cell );
+        double angle = osg::PI * 2.0 * nv->getFrameStamp()->getSimulationTime() / _dayLength;
+        _lighting->setSunDirection( osg::Vec3(cos(angle), 0.3f, sin(angle)) );
+        traverse( node, nv );
     }
-}
+    
+protected:
+    osg::observer_ptr<CloudLighting> _lighting;
+    double _dayLength;
+};
 
 int main( int argc, char** argv )
 {
-    CloudBlock::CloudCells cells;
-    readCloudCells( cells, "data.txt" );
+    osg::ArgumentParser arguments( &argc, argv );
+    
+    // Convert between the text and the binary .cells format, e.g. --convert data.txt data.cells
+    std::string inputFile, outputFile;
+    if ( arguments.read("--convert", inputFile, outputFile) )
+    {
+        CloudBlock::CloudCells cells;
+        if ( !readCloudCells(cells, inputFile) || !writeCloudCells(cells, outputFile) )
+        {
+            std::cout << "Failed to convert " << inputFile << " to " << outputFile << std::endl;
+            return 1;
+        }
+        std::cout << "Converted " << cells.size() << " cells" << std::endl;
+        return 0;
+    }
     
+    std::string cellFile = "data.txt";
+    arguments.read( "--cells", cellFile );
+    
+    // Read straight into the block instead of copying a temporary list
     osg::ref_ptr<CloudBlock> clouds = new CloudBlock;
-    clouds->setCloudCells( cells );
+    readCloudCells( clouds->getCloudCells(), cellFile );
+    clouds->dirtyCells();
+    
+    // Distance and budget LOD, e.g. --lod-distance 500 --max-cells 200000
+    float lodDistance = 0.0f;
+    unsigned int maxCells = 0;
+    if ( arguments.read("--lod-distance", lodDistance) ) clouds->setLODDistance( lodDistance );
+    if ( arguments.read("--max-cells", maxCells) ) clouds->setMaxDrawnCells( maxCells );
+    if ( arguments.read("--immediate") )
+        clouds->setRenderMode( CloudBlock::IMMEDIATE_MODE );
     
     osg::StateSet* ss = clouds->getOrCreateStateSet();
     ss->setAttributeAndModes( new osg::BlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA) );
@@ -73,8 +101,23 @@ int main( int argc, char** argv )
     osg::ref_ptr<osg::Geode> geode = new osg::Geode;
     geode->addDrawable( clouds.get() );
     
+    // Replace the brightness of the file by lighting from the sun, e.g. --sun 1 0 1, and
+    // let the sun move with --day-length <seconds>
+    osg::Vec3 sunDirection;
+    double dayLength = 0.0;
+    bool relight = arguments.read("--sun", sunDirection.x(), sunDirection.y(), sunDirection.z());
+    if ( arguments.read("--day-length", dayLength) && dayLength>0.0 ) relight = true;
+    if ( relight )
+    {
+        osg::ref_ptr<CloudLighting> lighting = new CloudLighting( clouds.get() );
+        if ( sunDirection.length2()>0.0f ) lighting->setSunDirection( sunDirection );
+        lighting->compute();
+        geode->setUpdateCallback( lighting.get() );
+        if ( dayLength>0.0 ) lighting->addNestedCallback( new DayCycleCallback(lighting.get(), dayLength) );
+    }
+    
     osgViewer::Viewer viewer;
     viewer.setLightingMode( osg::View::SKY_LIGHT );
     viewer.setSceneData( geode.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -9,6 +9,7 @@
 #include <osgViewer/CompositeViewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 class AuxiliaryViewUpdater : public osgGA::GUIEventHandler
 {
@@ -140,6 +141,9 @@ int main( int argc, char** argv )
     front->addEventHandler( new AuxiliaryViewUpdater );
     left->addEventHandler( new AuxiliaryViewUpdater );
 
+    if ( osgCookBook::isBenchmarkRequested() )
+        return osgCookBook::runBenchmark( viewer );
+
     while ( !viewer.done() )
     {
         viewer.frame();
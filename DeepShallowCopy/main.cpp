@@ -9,6 +9,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 class SetShapeColorHandler : public osgCookBook::PickHandler
 {
@@ -48,5 +49,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.addEventHandler( new SetShapeColorHandler );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -22,6 +22,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 static const char* mrtVertSource = {
     "uniform mat4 osg_ViewMatrix;\n"
@@ -140,5 +141,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
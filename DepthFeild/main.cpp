@@ -9,6 +9,8 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
+#include "RenderGraph"
 
 static const char* vertSource = {
     "void main(void)\n"
@@ -60,50 +62,22 @@ static const char* combineFragSource = {
     "}\n"
 };
 
-typedef std::pair<osg::Camera*, osg::Texture*> RTTPair;
-
-RTTPair createColorInput( osg::Node* scene )
-{
-    osg::ref_ptr<osg::Texture2D> tex2D = new osg::Texture2D;
-    tex2D->setTextureSize( 1024, 1024 );
-    tex2D->setInternalFormat( GL_RGBA );
-
-    osg::ref_ptr<osg::Camera> camera = osgCookBook::createRTTCamera(osg::Camera::COLOR_BUFFER, tex2D.get());
-    camera->addChild( scene );
-    return RTTPair(camera.release(), tex2D.get());
-}
-
-RTTPair createDepthInput( osg::Node* scene )
+osg::Program* createProgram( const char* fragSource )
 {
-    osg::ref_ptr<osg::Texture2D> tex2D = new osg::Texture2D;
-    tex2D->setTextureSize( 1024, 1024 );
-    tex2D->setInternalFormat( GL_DEPTH_COMPONENT24 );
-    tex2D->setSourceFormat( GL_DEPTH_COMPONENT );
-    tex2D->setSourceType( GL_FLOAT );
-
-    osg::ref_ptr<osg::Camera> camera = osgCookBook::createRTTCamera(osg::Camera::DEPTH_BUFFER, tex2D.get());
-    camera->addChild( scene );
-    return RTTPair(camera.release(), tex2D.get());
+    osg::ref_ptr<osg::Program> program = new osg::Program;
+    program->addShader( new osg::Shader(osg::Shader::VERTEX, vertSource) );
+    program->addShader( new osg::Shader(osg::Shader::FRAGMENT, fragSource) );
+    return program.release();
 }
 
-RTTPair createBlurPass( osg::Texture* inputTex, const osg::Vec2& dir )
+void addBlurPass( osgCookBook::RenderGraph* graph, const std::string& name, const std::string& input,
+                  const osg::Vec2& dir, osg::Program* blurProg )
 {
-    osg::ref_ptr<osg::Texture2D> tex2D = new osg::Texture2D;
-    tex2D->setTextureSize( 1024, 1024 );
-    tex2D->setInternalFormat( GL_RGBA );
-    osg::ref_ptr<osg::Camera> camera = osgCookBook::createRTTCamera(
-        osg::Camera::COLOR_BUFFER, tex2D.get(), true);
-
-    osg::ref_ptr<osg::Program> blurProg = new osg::Program;
-    blurProg->addShader( new osg::Shader(osg::Shader::VERTEX, vertSource) );
-    blurProg->addShader( new osg::Shader(osg::Shader::FRAGMENT, blurFragSource) );
-
-    osg::StateSet* ss = camera->getOrCreateStateSet();
-    ss->setTextureAttributeAndModes( 0, inputTex );
-    ss->setAttributeAndModes( blurProg.get(), osg::StateAttribute::ON|osg::StateAttribute::OVERRIDE );
-    ss->addUniform( new osg::Uniform("sceneTex", 0) );
-    ss->addUniform( new osg::Uniform("blurDir", dir) );
-    return RTTPair(camera.release(), tex2D.get());
+    osgCookBook::RenderGraph::Pass* pass = graph->addPass( name );
+    pass->addInput( input, "inputTex" );
+    pass->addOutput( name, osg::Camera::COLOR_BUFFER, osgCookBook::RenderTargetPool::Format(1024, 1024, GL_RGBA) );
+    pass->setProgram( blurProg );
+    pass->getOrCreateStateSet()->addUniform( new osg::Uniform("blurDir", dir) );
 }
 
 int main( int argc, char** argv )
@@ -112,47 +86,39 @@ int main( int argc, char** argv )
     osg::ref_ptr<osg::Node> scene = osgDB::readNodeFiles( arguments );
     if ( !scene ) scene = osgDB::readNodeFile("lz.osg");
 
-    // The first pass: color
-    RTTPair pass0_color = createColorInput( scene.get() );
-
-    // The first pass: depth
-    RTTPair pass0_depth = createDepthInput( scene.get() );
-
-    // The horizonal blur pass
-    RTTPair pass1 = createBlurPass( pass0_color.second, osg::Vec2(1.0f, 0.0f) );
-
-    // The vertical blur pass
-    RTTPair pass2 = createBlurPass( pass1.second, osg::Vec2(0.0f, 1.0f) );
+    // Passes only declare what they read and write; the graph orders them and lets
+    // targets which are no longer read share textures
+    osg::ref_ptr<osgCookBook::RenderGraph> graph = new osgCookBook::RenderGraph;
 
     // The final pass
-    osg::ref_ptr<osg::Camera> hudCamera = osgCookBook::createHUDCamera(0.0, 1.0, 0.0, 1.0);
-    hudCamera->addChild( osgCookBook::createScreenQuad(1.0f, 1.0f) );
-
-    osg::ref_ptr<osg::Program> finalProg = new osg::Program;
-    finalProg->addShader( new osg::Shader(osg::Shader::VERTEX, vertSource) );
-    finalProg->addShader( new osg::Shader(osg::Shader::FRAGMENT, combineFragSource) );
-
-    osg::StateSet* stateset = hudCamera->getOrCreateStateSet();
-    stateset->setTextureAttributeAndModes( 0, pass0_color.second );
-    stateset->setTextureAttributeAndModes( 1, pass2.second );
-    stateset->setTextureAttributeAndModes( 2, pass0_depth.second );
-    stateset->setAttributeAndModes( finalProg.get() );
-    stateset->addUniform( new osg::Uniform("sceneTex", 0) );
-    stateset->addUniform( new osg::Uniform("blurTex", 1) );
-    stateset->addUniform( new osg::Uniform("depthTex", 2) );
-    stateset->addUniform( new osg::Uniform("focalDistance", 100.0f) );
-    stateset->addUniform( new osg::Uniform("focalRange", 200.0f) );
+    osgCookBook::RenderGraph::Pass* finalPass = graph->addPass( "final" );
+    finalPass->addInput( "sceneColor", "sceneTex" );
+    finalPass->addInput( "blurV", "blurTex" );
+    finalPass->addInput( "sceneDepth", "depthTex" );
+    finalPass->setProgram( createProgram(combineFragSource) );
+    finalPass->setRenderToScreen( true );
+    finalPass->getOrCreateStateSet()->addUniform( new osg::Uniform("focalDistance", 100.0f) );
+    finalPass->getOrCreateStateSet()->addUniform( new osg::Uniform("focalRange", 200.0f) );
+
+    // The vertical and horizonal blur passes
+    osg::ref_ptr<osg::Program> blurProg = createProgram( blurFragSource );
+    addBlurPass( graph.get(), "blurV", "blurH", osg::Vec2(0.0f, 1.0f), blurProg.get() );
+    addBlurPass( graph.get(), "blurH", "sceneColor", osg::Vec2(1.0f, 0.0f), blurProg.get() );
+
+    // The first pass: color and depth
+    osgCookBook::RenderGraph::Pass* scenePass = graph->addPass( "scene" );
+    scenePass->setScene( scene.get() );
+    scenePass->addOutput( "sceneColor", osg::Camera::COLOR_BUFFER,
+                          osgCookBook::RenderTargetPool::Format(1024, 1024, GL_RGBA) );
+    scenePass->addOutput( "sceneDepth", osg::Camera::DEPTH_BUFFER,
+                          osgCookBook::RenderTargetPool::Format(1024, 1024, GL_DEPTH_COMPONENT24) );
 
     // Build the scene graph
-    osg::ref_ptr<osg::Group> root = new osg::Group;
-    root->addChild( pass0_color.first );
-    root->addChild( pass0_depth.first );
-    root->addChild( pass1.first );
-    root->addChild( pass2.first );
-    root->addChild( hudCamera.get() );
+    osg::ref_ptr<osg::Group> root = graph->build();
+    graph->report( osg::notify(osg::NOTICE) );
 
     osgViewer::Viewer viewer;
     viewer.getCamera()->setComputeNearFarMode( osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -12,6 +12,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 const double radius_earth = 6378.137;
 const double radius_sun = 695990.0;
@@ -86,5 +87,5 @@ int main( int argc, char** argv )
     viewer.setCameraManipulator( new osgGA::TrackballManipulator );
     viewer.getCameraManipulator()->setHomePosition(
         osg::Vec3d(0.0,-12.5*radius_earth,0.0), osg::Vec3d(), osg::Vec3d(0.0,0.0,1.0) );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
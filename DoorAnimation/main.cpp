@@ -12,6 +12,7 @@
 #include <algorithm>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 osg::Node* createWall()
 {
@@ -123,5 +124,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.addEventHandler( handler.get() );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
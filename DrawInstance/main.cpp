@@ -5,26 +5,15 @@
 
 #include <osg/Geometry>
 #include <osg/Geode>
-#include <osg/Texture2D>
 #include <osgDB/ReadFile>
 #include <osgViewer/Viewer>
 
+#include "ColorIdPickHandler"
 #include "CommonFunctions"
+#include "FrameBenchmark"
+#include "InstancedGeometry"
 
-const char* vertCode = {
-    "uniform sampler2D defaultTex;\n"
-    "const float PI2 = 6.2831852;\n"
-    "void main()\n"
-    "{\n"
-    "    float r = float(gl_InstanceID) / 256.0;\n"
-    "    vec2 uv = vec2(fract(r), floor(r) / 256.0);\n"
-    "    vec4 pos = gl_Vertex + vec4(uv.s * 384.0, 32.0 * sin(uv.s * PI2), uv.t * 384.0, 1.0);\n"
-    "    gl_FrontColor = texture2D(defaultTex, uv);\n"
-    "    gl_Position = gl_ModelViewProjectionMatrix * pos;\n"
-    "}\n"
-};
-
-osg::Geometry* createInstancedGeometry( unsigned int numInstances )
+osgCookBook::InstancedGeometry* createInstancedGeometry( unsigned int numInstances )
 {
     osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array(4);
     (*vertices)[0].set(-0.5f, 0.0f,-0.5f );
@@ -32,34 +21,55 @@ osg::Geometry* createInstancedGeometry( unsigned int numInstances )
     (*vertices)[2].set( 0.5f, 0.0f, 0.5f );
     (*vertices)[3].set(-0.5f, 0.0f, 0.5f );
 
-    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
-    geom->setUseDisplayList( false );
-    geom->setUseVertexBufferObjects( true );
-    geom->setVertexArray( vertices.get() );
+    osg::ref_ptr<osg::Vec3Array> normals = new osg::Vec3Array(1);
+    (*normals)[0].set( 0.0f,-1.0f, 0.0f );
 
-
-//    Using the draw instanced extension may be easier than you think. Either the
-//    osg::DrawArrays or osg::DrawElements* class has a numInstances
-//    argument (at the last of the argument list) that indicates the number of instanced
-//    objects. Set a non-zero value to enable draw instanced. And set up a customized
-//    bounding box again as the system can't decide the actual bound according to only
-//    four original points
-    geom->addPrimitiveSet( new osg::DrawArrays(GL_QUADS, 0, 4, numInstances) );
-    geom->setInitialBound( osg::BoundingBox(-1.0f,-32.0f,-1.0f, 192.0f, 32.0f, 192.0f) );
-
-    osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D;
-    texture->setImage( osgDB::readImageFile("Images/osg256.png") );
-    texture->setFilter( osg::Texture2D::MIN_FILTER, osg::Texture2D::LINEAR );
-    texture->setFilter( osg::Texture2D::MAG_FILTER, osg::Texture2D::LINEAR );
-    geom->getOrCreateStateSet()->setTextureAttributeAndModes( 0, texture.get() );
-    geom->getOrCreateStateSet()->addUniform( new osg::Uniform("defaultTex", 0) );
-
-    osg::ref_ptr<osg::Program> program = new osg::Program;
-    program->addShader( new osg::Shader(osg::Shader::VERTEX, vertCode) );
-    geom->getOrCreateStateSet()->setAttributeAndModes( program.get() );
+    // Each instance gets its own transform and color from per-instance vertex attributes,
+    // so any number of instances can be placed freely. The bound is computed from them
+    osg::ref_ptr<osgCookBook::InstancedGeometry> geom = new osgCookBook::InstancedGeometry;
+    geom->setVertexArray( vertices.get() );
+    geom->setNormalArray( normals.get(), osg::Array::BIND_OVERALL );
+    geom->addPrimitiveSet( new osg::DrawArrays(GL_QUADS, 0, 4) );
+
+    // Keep the layout and colors of the texture lookup version: a square grid on a sine
+    // wave, colored by the image
+    osg::ref_ptr<osg::Image> image = osgDB::readImageFile("Images/osg256.png");
+    unsigned int numRows = (unsigned int)ceil( sqrt((double)numInstances) );
+    for ( unsigned int i=0; i<numInstances; ++i )
+    {
+        osg::Vec2 uv( (float)(i % numRows) / numRows, (float)(i / numRows) / numRows );
+        osg::Vec4 color = image.valid() ? image->getColor(uv) : osg::Vec4(1.0f, 1.0f, 1.0f, 1.0f);
+        geom->addInstance( osg::Matrix::translate(uv.x() * 384.0f, 32.0f * sinf(uv.x() * osg::PI * 2.0f),
+                                                  uv.y() * 384.0f), color );
+    }
     return geom.release();
 }
 
+/** Paints the instance under the mouse red. The instances only exist in vertex attributes,
+    so intersecting the mesh can't find them, but the ID pass draws them as they are seen. */
+class HighlightInstanceHandler : public osgCookBook::ColorIdPickHandler
+{
+public:
+    HighlightInstanceHandler() : _highlighted(~0u) { setHoverMode( true ); }
+
+    virtual void doUserOperations( Result& result )
+    {
+        osgCookBook::InstancedGeometry* geom = dynamic_cast<osgCookBook::InstancedGeometry*>( result.drawable.get() );
+        if ( !geom || result.instanceID==_highlighted || result.instanceID==~0u ) return;
+
+        if ( _geometry.valid() && _highlighted!=~0u )
+            _geometry->setInstanceColor( _highlighted, _color );
+        _geometry = geom;
+        _highlighted = result.instanceID;
+        _color = geom->getInstanceColor( _highlighted );
+        geom->setInstanceColor( _highlighted, osg::Vec4(1.0f, 0.0f, 0.0f, 1.0f) );
+    }
+
+protected:
+    osg::observer_ptr<osgCookBook::InstancedGeometry> _geometry;
+    unsigned int _highlighted;
+    osg::Vec4 _color;
+};
 
 //The draw instanced extension requires OpenGL 2.0 to work properly. It greatly reduces the
 //memory usage of vertices and primitives on the CPU side, but can still perform as effectively
@@ -76,23 +86,37 @@ osg::Geometry* createInstancedGeometry( unsigned int numInstances )
 //matrix or customized offset to them to move the instance to a different location in the
 //3D world.
 
-//In the shader code of this recipe, the pos variable represents the position of each instanced
-//quad in the world coordinate (by adding an offset to the original gl_Vertex variable). Then,
-//we multiply the model-view-projection (MVP) matrix with it to obtain the position in projection
-//coordinate, which is actually required for final vertex composition in the rendering pipeline.
-//Note that the shader code here is not perfect because it fixes the number of row and column
-//instances instead of using uniforms. You may try to alter it to provide a more scalable draw
-//instanced implementation.
+//In the shader code of osgCookBook::InstancedGeometry, the vertex variable represents the position
+//of each instanced quad in the world coordinate (by transforming the original gl_Vertex variable
+//with the instance matrix, read from per-instance vertex attributes). Then, we multiply the
+//model-view-projection (MVP) matrix with it to obtain the position in projection coordinate,
+//which is actually required for final vertex composition in the rendering pipeline. As the
+//instances are ordinary data instead of a fixed layout, they can be added, removed and moved
+//at any time.
 
 int main( int argc, char** argv )
 {
+    osg::ArgumentParser arguments( &argc, argv );
+    unsigned int numInstances = 256*256;
+    arguments.read( "--instances", numInstances );
+
+    // Instances outside the view are culled and not submitted unless --no-cull is given
+    osg::ref_ptr<osgCookBook::InstancedGeometry> geom = createInstancedGeometry( numInstances );
+    if ( arguments.read("--no-cull") ) geom->setInstanceCulling( false );
+
     osg::ref_ptr<osg::Geode> geode = new osg::Geode;
-    geode->addDrawable( createInstancedGeometry(256*256) );
+    geode->addDrawable( geom.get() );
 
     osg::ref_ptr<osg::Group> root = new osg::Group;
     root->addChild( geode.get() );
 
+    // Hovering highlights single instances, picked from an offscreen ID pass
+    osg::ref_ptr<HighlightInstanceHandler> picker = new HighlightInstanceHandler;
+    picker->registerObjects( geode.get() );
+    root->addChild( picker->createPickCamera(geode.get()) );
+
     osgViewer::Viewer viewer;
+    viewer.addEventHandler( picker.get() );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -8,6 +8,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 static const char* vertSource = {
     "uniform vec3 lightPosition;\n"
@@ -78,5 +79,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( model.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -11,6 +11,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 osg::Geometry* createExtrusion( osg::Vec3Array* vertices, const osg::Vec3& direction, float length )
 {
@@ -76,5 +77,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
     viewer.addEventHandler( new osgGA::StateSetManipulator(viewer.getCamera()->getOrCreateStateSet()) );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -10,6 +10,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 class FollowUpdater : public osgGA::GUIEventHandler
 {
@@ -67,5 +68,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.addEventHandler( new FollowUpdater(model) );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -9,6 +9,7 @@
 #include <osgViewer/CompositeViewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 
 //An OSG scene viewer can have only one view (osgViewer::Viewer) or multiple views
@@ -94,6 +95,8 @@ int main( int argc, char** argv )
     viewer.addView( left.get() );
     viewer.addView( mainView.get() );
 
+    if ( osgCookBook::isBenchmarkRequested() )
+        return osgCookBook::runBenchmark( viewer );
 
 //    Start the simulation. Here, we don't use the viewer.run() method but instead
 //    write a simple loop that calls the frame() method all the time. That's because the
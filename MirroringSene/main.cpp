@@ -8,6 +8,8 @@
 #include <osgDB/ReadFile>
 #include <osgViewer/Viewer>
 
+#include "FrameBenchmark"
+
 int main( int argc, char** argv )
 {
     osg::ArgumentParser arguments( &argc, argv );
@@ -41,5 +43,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
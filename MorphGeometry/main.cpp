@@ -12,6 +12,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 typedef void (*VertexFunc)( osg::Vec3Array* );
 osg::Geometry* createEmoticonGeometry( VertexFunc func )
@@ -87,5 +88,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -12,6 +12,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 class TransparencyTechnique : public osgFX::Technique
 {
@@ -65,5 +66,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( fxNode.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -9,6 +9,7 @@
 #include <osgViewer/CompositeViewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 osgViewer::View* createView( int screenNum )
 {
@@ -64,5 +65,5 @@ int main( int argc, char** argv )
 //        viewer.addView( view2 );
 //    }
 
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
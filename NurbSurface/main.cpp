@@ -9,6 +9,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 #include <NurbsSurface>
 
 int main( int argc, char** argv )
@@ -47,5 +48,5 @@ int main( int argc, char** argv )
     
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
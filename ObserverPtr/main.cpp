@@ -8,6 +8,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 class RemoveShapeHandler : public osgCookBook::PickHandler
 {
@@ -64,5 +65,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.addEventHandler( new RemoveShapeHandler );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
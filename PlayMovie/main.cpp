@@ -10,6 +10,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 int main( int argc, char** argv )
 {
@@ -42,5 +43,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( geode.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
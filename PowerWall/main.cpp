@@ -8,6 +8,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 osg::Camera* createSlaveCamera( int x, int y, int width, int height )
 {
@@ -67,5 +68,5 @@ int main( int argc, char** argv )
     }
 
     viewer.setSceneData( scene );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
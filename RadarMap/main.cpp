@@ -11,6 +11,9 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
+#include "InstancingVisitor"
+#include "PathAnimator"
 
 
 //The MAIN_CAMERA_MASK constant set to the main camera makes it only render
@@ -35,7 +38,6 @@
 
 const unsigned int MAIN_CAMERA_MASK = 0x1;
 const unsigned int RADAR_CAMERA_MASK = 0x2;
-#define RAND(min, max) ((min) + (float)rand()/(RAND_MAX) * ((max)-(min)))
 
 osg::Node* createObject( const std::string& filename, const osg::Vec4& color )
 {
@@ -73,10 +75,11 @@ osg::MatrixTransform* createStaticNode( const osg::Vec3& center, osg::Node* chil
     return trans_node.release();
 }
 
-osg::MatrixTransform* createAnimateNode( const osg::Vec3& center, float radius, float time, osg::Node* child )
+osg::MatrixTransform* createAnimateNode( const osg::Vec3& center, float radius, float time, osg::Node* child,
+                                         osgCookBook::PathAnimator* animator )
 {
     osg::ref_ptr<osg::MatrixTransform> anim_node = new osg::MatrixTransform;
-    anim_node->addUpdateCallback( osgCookBook::createAnimationPathCallback(radius, time) );
+    animator->addTarget( anim_node.get(), osgCookBook::getCircularAnimationPath(radius, time) );
     anim_node->addChild( child );
 
     osg::ref_ptr<osg::MatrixTransform> trans_node = new osg::MatrixTransform;
@@ -87,23 +90,45 @@ osg::MatrixTransform* createAnimateNode( const osg::Vec3& center, float radius,
 
 int main( int argc, char** argv )
 {
+    osg::ArgumentParser arguments( &argc, argv );
     osg::Node* obj1 = createObject( "dumptruck.osg", osg::Vec4(1.0f, 0.2f, 0.2f, 1.0f) );
     osg::Node* obj2 = createObject( "dumptruck.osg.0,0,180.rot", osg::Vec4(0.2f, 0.2f, 1.0f, 1.0f) );
     osg::Node* air_obj2 = createObject( "cessna.osg.0,0,90.rot", osg::Vec4(0.2f, 0.2f, 1.0f, 1.0f) );
 
+    // All flying objects are moved by one animator in the update traversal of the scene
+    osg::ref_ptr<osgCookBook::PathAnimator> animator = new osgCookBook::PathAnimator;
     osg::ref_ptr<osg::Group> scene = new osg::Group;
+    scene->addUpdateCallback( animator.get() );
     for ( unsigned int i=0; i<10; ++i )
     {
-        osg::Vec3 center1( RAND(-100, 100), RAND(-100, 100), 0.0f );
+        // Random numbers are drawn one per statement, so seeded runs match on every compiler
+        osg::Vec3 center1;
+        center1.x() = osgCookBook::randomValue(-100, 100);
+        center1.y() = osgCookBook::randomValue(-100, 100);
         scene->addChild( createStaticNode(center1, obj1) );
 
-        osg::Vec3 center2( RAND(-100, 100), RAND(-100, 100), 0.0f );
+        osg::Vec3 center2;
+        center2.x() = osgCookBook::randomValue(-100, 100);
+        center2.y() = osgCookBook::randomValue(-100, 100);
         scene->addChild( createStaticNode(center2, obj2) );
     }
     for ( unsigned int i=0; i<5; ++i )
     {
-        osg::Vec3 center( RAND(-50, 50), RAND(-50, 50), RAND(10, 100) );
-        scene->addChild( createAnimateNode(center, RAND(10.0, 50.0), 5.0f, air_obj2) );
+        osg::Vec3 center;
+        center.x() = osgCookBook::randomValue(-50, 50);
+        center.y() = osgCookBook::randomValue(-50, 50);
+        center.z() = osgCookBook::randomValue(10, 100);
+        float radius = osgCookBook::randomValue(10.0, 50.0);
+        scene->addChild( createAnimateNode(center, radius, 5.0f, air_obj2, animator.get()) );
+    }
+
+    // Draw the static trucks as one instanced geometry per mesh, unless --no-instancing is
+    // given. The flying objects are left alone, as the animator makes their transforms DYNAMIC
+    if ( !arguments.read("--no-instancing") )
+    {
+        osgCookBook::InstancingVisitor iv;
+        scene->accept( iv );
+        iv.replaceSubgraphs();
     }
 
     osg::ref_ptr<osg::Camera> radar = new osg::Camera;
@@ -127,5 +152,5 @@ int main( int argc, char** argv )
     viewer.getCamera()->setCullMask( MAIN_CAMERA_MASK );
     viewer.setSceneData( root.get() );
     viewer.setLightingMode( osg::View::SKY_LIGHT );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -9,6 +9,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 int main( int argc, char** argv )
 {
@@ -37,5 +38,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.getCamera()->setComputeNearFarMode( osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
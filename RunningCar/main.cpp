@@ -9,6 +9,8 @@
 #include <osgDB/ReadFile>
 #include <osgViewer/Viewer>
 
+#include "FrameBenchmark"
+
 osg::MatrixTransform* createTransformNode( osg::Drawable* shape, const osg::Matrix& matrix )
 {
     osg::ref_ptr<osg::Geode> geode = new osg::Geode;
@@ -78,5 +80,5 @@ int main( int argc, char** argv )
     // Start the viewer
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -3,6 +3,7 @@
  * Author: Wang Rui <wangray84 at gmail dot com>
 */
 
+#include <osg/MatrixTransform>
 #include <osgAnimation/EaseMotion>
 #include <osgDB/ReadFile>
 #include <osgViewer/Viewer>
@@ -10,8 +11,8 @@
 #include <iomanip>
 
 #include "CommonFunctions"
-
-#define RAND(min, max) ((min) + (float)rand()/(RAND_MAX) * ((max)-(min)))
+#include "FrameBenchmark"
+#include "LabelBatch"
 
 class ScrollTextCallback : public osg::Drawable::UpdateCallback
 {
@@ -39,7 +40,7 @@ public:
     void computeNewPosition()
     {
         _motion->reset();
-        _currentPos.y() = RAND(50.0, 500.0);
+        _currentPos.y() = osgCookBook::randomValue(50.0, 500.0);
     }
 
 protected:
@@ -47,18 +48,81 @@ protected:
     osg::Vec3 _currentPos;
 };
 
+// Scrolls many labels of one batch, like a track display. All labels move with the
+// transform above the batch, so only the labels wrapping around the screen are changed
+class ScrollLabelsCallback : public osg::NodeCallback
+{
+public:
+    ScrollLabelsCallback( osgCookBook::LabelBatch* batch ) : _batch(batch), _offset(0.0f) {}
+
+    virtual void operator()( osg::Node* node, osg::NodeVisitor* nv )
+    {
+        _offset += 1.6f;
+
+        // Now and then the offset is folded into the labels, to keep positions small
+        bool rebase = _offset>8000.0f;
+        for ( unsigned int i=0; i<_batch->getNumLabels(); ++i )
+        {
+            osg::Vec3 pos = _batch->getPosition(i);
+            bool wrapped = pos.x() + _offset>800.0f;
+            if ( wrapped )
+            {
+                pos.set( -_offset, osgCookBook::randomValue(0.0, 590.0), 0.0f );
+
+                std::stringstream ss; ss << std::setprecision(3);
+                ss << "Track " << i << "; YPos: " << pos.y();
+                _batch->setText( i, ss.str() );
+            }
+            if ( rebase ) pos.x() += _offset;
+            if ( wrapped || rebase ) _batch->setPosition( i, pos );
+        }
+        if ( rebase ) _offset = 0.0f;
+
+        static_cast<osg::MatrixTransform*>( node )->setMatrix( osg::Matrix::translate(_offset, 0.0f, 0.0f) );
+        traverse( node, nv );
+    }
+
+protected:
+    osg::ref_ptr<osgCookBook::LabelBatch> _batch;
+    float _offset;
+};
+
 int main( int argc, char** argv )
 {
-    osgText::Text* text = osgCookBook::createText(osg::Vec3(), "", 20.0f);
-    text->setUpdateCallback( new ScrollTextCallback );
+    osg::ArgumentParser arguments( &argc, argv );
+    unsigned int numLabels = 0;
+    arguments.read( "--labels", numLabels );
 
     osg::ref_ptr<osg::Geode> textGeode = new osg::Geode;
-    textGeode->addDrawable( text );
+    osg::ref_ptr<osg::Node> textRoot = textGeode.get();
+    if ( numLabels>0 )
+    {
+        osg::ref_ptr<osgCookBook::LabelBatch> batch = new osgCookBook::LabelBatch;
+        for ( unsigned int i=0; i<numLabels; ++i )
+        {
+            std::stringstream ss; ss << "Track " << i;
+            float x = osgCookBook::randomValue(0.0, 800.0);
+            float y = osgCookBook::randomValue(0.0, 590.0);
+            batch->addLabel( osg::Vec3(x, y, 0.0f), ss.str(), 10.0f );
+        }
+        textGeode->addDrawable( batch.get() );
+
+        osg::ref_ptr<osg::MatrixTransform> scroll = new osg::MatrixTransform;
+        scroll->addUpdateCallback( new ScrollLabelsCallback(batch.get()) );
+        scroll->addChild( textGeode.get() );
+        textRoot = scroll.get();
+    }
+    else
+    {
+        osgText::Text* text = osgCookBook::createText(osg::Vec3(), "", 20.0f);
+        text->setUpdateCallback( new ScrollTextCallback );
+        textGeode->addDrawable( text );
+    }
 
     osg::ref_ptr<osg::Camera> hudCamera = osgCookBook::createHUDCamera(0, 800, 0, 600);
-    hudCamera->addChild( textGeode.get() );
+    hudCamera->addChild( textRoot.get() );
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( hudCamera.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
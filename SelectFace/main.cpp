@@ -11,6 +11,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 const osg::Vec4 normalColor(1.0f, 1.0f, 1.0f, 1.0f);
 const osg::Vec4 selectedColor(1.0f, 0.0f, 0.0f, 0.5f);
@@ -121,5 +122,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.addEventHandler( selector.get() );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
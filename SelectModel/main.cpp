@@ -9,43 +9,30 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
+#include "HighlightOverlay"
 
 const osg::Vec4 normalColor(1.0f, 1.0f, 1.0f, 1.0f);
 const osg::Vec4 selectedColor(1.0f, 0.0f, 0.0f, 0.5f);
 
+// Selected models are drawn again by the overlay, so their color arrays and buffer
+// objects are never changed and can stay shared with other geometries
 class SelectModelHandler : public osgCookBook::PickHandler
 {
 public:
-    SelectModelHandler() : _lastDrawable(0) {}
+    SelectModelHandler( osgCookBook::HighlightOverlay* overlay ) : _overlay(overlay) {}
 
     virtual void doUserOperations( osgUtil::LineSegmentIntersector::Intersection& result )
     {
-        if ( _lastDrawable.valid() )
-        {
-            setDrawableColor( _lastDrawable.get(), normalColor );
-            _lastDrawable = NULL;
-        }
+        if ( !_overlay ) return;
+        _overlay->removeAllHighlights();
 
         osg::Geometry* geom = dynamic_cast<osg::Geometry*>( result.drawable.get() );
-        if ( geom )
-        {
-            setDrawableColor( geom, selectedColor );
-            _lastDrawable = geom;
-        }
-    }
-
-    void setDrawableColor( osg::Geometry* geom, const osg::Vec4& color )
-    {
-        osg::Vec4Array* colors = dynamic_cast<osg::Vec4Array*>( geom->getColorArray() );
-        if ( colors && colors->size()>0 )
-        {
-            colors->front() = color;
-            colors->dirty();
-        }
+        if ( geom ) _overlay->addHighlight( geom );
     }
 
 protected:
-    osg::observer_ptr<osg::Geometry> _lastDrawable;
+    osg::observer_ptr<osgCookBook::HighlightOverlay> _overlay;
 };
 
 osg::Geometry* createSimpleGeometry()
@@ -72,7 +59,6 @@ osg::Geometry* createSimpleGeometry()
     (*indices)[20]= 3; (*indices)[21]= 0; (*indices)[22]= 4; (*indices)[23]= 7;
 
     osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
-    geom->setDataVariance( osg::Object::DYNAMIC );
     geom->setUseDisplayList( false );
     geom->setUseVertexBufferObjects( true );
     geom->setVertexArray( vertices.get() );
@@ -88,14 +74,21 @@ int main( int argc, char** argv )
 {
     osg::ref_ptr<osg::Geode> geode = new osg::Geode;
     geode->addDrawable( createSimpleGeometry() );
-    geode->getOrCreateStateSet()->setMode( GL_BLEND, osg::StateAttribute::ON );
-    geode->getOrCreateStateSet()->setRenderingHint( osg::StateSet::TRANSPARENT_BIN );
+
+    osg::ref_ptr<osgCookBook::HighlightOverlay> overlay = new osgCookBook::HighlightOverlay;
+    overlay->setColor( selectedColor );
 
     osg::ref_ptr<osg::Group> root = new osg::Group;
     root->addChild( geode.get() );
+    root->addChild( overlay.get() );
+
+    // Use --hover to highlight the model under the cursor without clicking
+    osg::ArgumentParser arguments( &argc, argv );
+    osg::ref_ptr<SelectModelHandler> selector = new SelectModelHandler( overlay.get() );
+    selector->setHoverMode( arguments.read("--hover") );
 
     osgViewer::Viewer viewer;
-    viewer.addEventHandler( new SelectModelHandler );
+    viewer.addEventHandler( selector.get() );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -8,19 +8,31 @@
 #include <osg/MatrixTransform>
 #include <osg/Point>
 #include <osg/PolygonOffset>
+#include <osgDB/ReadFile>
 #include <osgUtil/SmoothingVisitor>
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
+#include "PickAccelerator"
+#include "RegionSelectHandler"
+#include "ScreenPointIndex"
 
 const osg::Vec4 normalColor(1.0f, 1.0f, 1.0f, 1.0f);
 const osg::Vec4 selectedColor(1.0f, 0.0f, 0.0f, 1.0f);
 
+// Selection markers are drawn but never picked themselves
+const unsigned int SELECTOR_MASK = 0x2;
+
 class SelectModelHandler : public osgCookBook::PickHandler
 {
 public:
     SelectModelHandler( osg::Camera* camera )
-    : _selector(0), _camera(camera) {}
+    : _selector(0), _camera(camera), _tolerance(8.0f)
+    {
+        _index = new osgCookBook::ScreenPointIndex;
+        _index->setTraversalMask( ~SELECTOR_MASK );
+    }
 
     osg::Geode* createPointSelector()
     {
@@ -38,19 +50,54 @@ public:
 
         osg::ref_ptr<osg::Geode> geode = new osg::Geode;
         geode->addDrawable( _selector.get() );
+        geode->setNodeMask( SELECTOR_MASK );
         geode->getOrCreateStateSet()->setAttributeAndModes( new osg::Point(10.0f) );
         geode->getOrCreateStateSet()->setMode( GL_LIGHTING, osg::StateAttribute::OFF );
         return geode.release();
     }
 
+    virtual bool handle( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa )
+    {
+        osgViewer::View* viewer = dynamic_cast<osgViewer::View*>(&aa);
+        if ( viewer && ea.getEventType()==osgGA::GUIEventAdapter::FRAME )
+        {
+            // The index is rebuilt in the background once the camera stops
+            _index->update( viewer->getCamera(), viewer->getSceneData(), ea.getTime() );
+        }
+        else if ( viewer && ea.getEventType()==osgGA::GUIEventAdapter::RELEASE &&
+                  ea.getButton()==osgGA::GUIEventAdapter::LEFT_MOUSE_BUTTON &&
+                  (ea.getModKeyMask()&osgGA::GUIEventAdapter::MODKEY_CTRL) )
+        {
+            osgCookBook::ScreenPointIndex::Result result;
+            if ( _index->query(viewer->getCamera(), ea.getX(), ea.getY(), _tolerance, result) )
+            {
+                selectVertex( result.worldPoint );
+                return false;
+            }
+        }
+
+        // Intersect the scene while the index doesn't match the camera yet
+        return osgCookBook::PickHandler::handle( ea, aa );
+    }
+
+    void selectVertex( const osg::Vec3& vertex )
+    {
+        if ( !_selector ) return;
+        osg::Vec3Array* selVertices = dynamic_cast<osg::Vec3Array*>( _selector->getVertexArray() );
+        if ( !selVertices ) return;
+
+        selVertices->front() = vertex;
+        selVertices->dirty();
+        _selector->dirtyBound();
+    }
+
     virtual void doUserOperations( osgUtil::LineSegmentIntersector::Intersection& result )
     {
         osg::Geometry* geom = dynamic_cast<osg::Geometry*>( result.drawable.get() );
         if ( !geom || !_selector || geom==_selector ) return;
 
         osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( geom->getVertexArray() );
-        osg::Vec3Array* selVertices = dynamic_cast<osg::Vec3Array*>( _selector->getVertexArray() );
-        if ( !vertices || !selVertices ) return;
+        if ( !vertices ) return;
 
         osg::Vec3 point = result.getWorldIntersectPoint();
         osg::Matrix matrix = osg::computeLocalToWorld( result.nodePath );
@@ -68,18 +115,67 @@ public:
             unsigned int pos = selIndices[i];
             osg::Vec3 vertex = (*vertices)[pos] * matrix;
             float distance = (vertex * vpMatrix - point).length();
-            if ( distance<0.1f )
-            {
-                selVertices->front() = vertex;
-            }
+            if ( distance<0.1f ) selectVertex( vertex );
+        }
+    }
+
+protected:
+    osg::ref_ptr<osg::Geometry> _selector;
+    osg::observer_ptr<osg::Camera> _camera;
+    osg::ref_ptr<osgCookBook::ScreenPointIndex> _index;
+    float _tolerance;
+};
+
+class SelectRegionHandler : public osgCookBook::RegionSelectHandler
+{
+public:
+    SelectRegionHandler() : _selector(0) {}
+
+    osg::Geode* createRegionSelector()
+    {
+        osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array(1);
+        (*colors)[0] = selectedColor;
+
+        _selector = new osg::Geometry;
+        _selector->setDataVariance( osg::Object::DYNAMIC );
+        _selector->setUseDisplayList( false );
+        _selector->setUseVertexBufferObjects( true );
+        _selector->setVertexArray( new osg::Vec3Array );
+        _selector->setColorArray( colors.get() );
+        _selector->setColorBinding( osg::Geometry::BIND_OVERALL );
+        _selector->addPrimitiveSet( new osg::DrawArrays(GL_POINTS, 0, 0) );
+
+        osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+        geode->addDrawable( _selector.get() );
+        geode->setNodeMask( SELECTOR_MASK );
+        geode->getOrCreateStateSet()->setAttributeAndModes( new osg::Point(6.0f) );
+        geode->getOrCreateStateSet()->setMode( GL_LIGHTING, osg::StateAttribute::OFF );
+        return geode.release();
+    }
+
+    virtual void doUserOperations( Selections& results )
+    {
+        if ( !_selector ) return;
+        osg::Vec3Array* selVertices = static_cast<osg::Vec3Array*>( _selector->getVertexArray() );
+        selVertices->clear();
+
+        for ( unsigned int i=0; i<results.size(); ++i )
+        {
+            const Selection& selection = results[i];
+            osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( selection.geometry->getVertexArray() );
+            if ( !vertices ) continue;
+
+            for ( unsigned int j=0; j<selection.vertexIndices.size(); ++j )
+                selVertices->push_back( (*vertices)[selection.vertexIndices[j]] * selection.localToWorld );
         }
+
+        static_cast<osg::DrawArrays*>( _selector->getPrimitiveSet(0) )->setCount( selVertices->size() );
         selVertices->dirty();
         _selector->dirtyBound();
     }
 
 protected:
     osg::ref_ptr<osg::Geometry> _selector;
-    osg::observer_ptr<osg::Camera> _camera;
 };
 
 osg::Geometry* createSimpleGeometry()
@@ -120,6 +216,8 @@ osg::Geometry* createSimpleGeometry()
 
 int main( int argc, char** argv )
 {
+    osg::ArgumentParser arguments( &argc, argv );
+
     osg::ref_ptr<osg::Geode> geode = new osg::Geode;
     geode->addDrawable( createSimpleGeometry() );
     geode->getOrCreateStateSet()->setAttributeAndModes( new osg::PolygonOffset(1.0f, 1.0f) );
@@ -133,12 +231,25 @@ int main( int argc, char** argv )
 
     osg::ref_ptr<osg::Group> root = new osg::Group;
     root->addChild( trans.get() );
+
+    // Ctrl+click picks the nearest vertex of any model given, point clouds included.
+    // Models are indexed for picking while they load, not at the first click.
+    osgDB::Registry::instance()->setReadFileCallback( new osgCookBook::PickAcceleratorReadCallback );
+    osg::ref_ptr<osg::Node> model = osgDB::readNodeFiles( arguments );
+    if ( model.valid() ) root->addChild( model.get() );
     root->addChild( selector->createPointSelector() );  // Caution: It has bound, too
 
+    // Shift+drag selects all vertices in a rectangle, Shift+Alt+drag in a lasso
+    osg::ref_ptr<SelectRegionHandler> regionSelector = new SelectRegionHandler;
+    regionSelector->setTraversalMask( ~SELECTOR_MASK );
+    root->addChild( regionSelector->createRegionSelector() );
+    root->addChild( regionSelector->createSelectionOverlay() );
+
     viewer.addEventHandler( selector.get() );
+    viewer.addEventHandler( regionSelector.get() );
     viewer.setSceneData( root.get() );
 
     osg::CullSettings::CullingMode mode = viewer.getCamera()->getCullingMode();
     viewer.getCamera()->setCullingMode( mode & (~osg::CullSettings::SMALL_FEATURE_CULLING) );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -12,9 +12,12 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
+#include "InstancingVisitor"
 
 int main( int argc, char** argv )
 {
+    osg::ArgumentParser arguments( &argc, argv );
     unsigned int rcvShadowMask = 0x1;
     unsigned int castShadowMask = 0x2;
 
@@ -52,6 +55,14 @@ int main( int argc, char** argv )
         }
     }
 
+    // Draw all cessnas of the shadow and the main pass at once, unless --no-instancing is given
+    if ( !arguments.read("--no-instancing") )
+    {
+        osgCookBook::InstancingVisitor iv;
+        shadowRoot->accept( iv );
+        iv.replaceSubgraphs();
+    }
+
     const osg::BoundingSphere& bs = groundNode->getBound();
     osg::ref_ptr<osgGA::TrackballManipulator> trackball = new osgGA::TrackballManipulator;
     trackball->setHomePosition( bs.center()+osg::Vec3(0.0f, 0.0f, bs.radius()*0.4f), bs.center(), osg::Y_AXIS );
@@ -60,5 +71,5 @@ int main( int argc, char** argv )
     viewer.setCameraManipulator( trackball.get() );
     viewer.setSceneData( shadowRoot.get() );
     viewer.addEventHandler( new osgViewer::StatsHandler );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -14,6 +14,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 osg::Geode* createBoneShape( const osg::Vec3& trans, const osg::Vec4& color )
 {
@@ -107,5 +108,5 @@ int main( int argc, char** argv )
 
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -11,6 +11,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 #include "SkyBox"
 
 int main( int argc, char** argv )
@@ -38,5 +39,5 @@ int main( int argc, char** argv )
     
     osgViewer::Viewer viewer;
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
@@ -12,6 +12,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
 int main( int argc, char** argv )
 {
@@ -43,5 +44,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.setCameraManipulator( keySwitch.get() );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
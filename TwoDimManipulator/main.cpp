@@ -9,6 +9,7 @@
 #include <osgViewer/Viewer>
 
 #include "CommonFunctions"
+#include "FrameBenchmark"
 #include "TwoDimManipulator"
 
 int main( int argc, char** argv )
@@ -26,5 +27,5 @@ int main( int argc, char** argv )
     osgViewer::Viewer viewer;
     viewer.setCameraManipulator( keySwitch.get() );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
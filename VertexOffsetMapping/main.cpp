@@ -5,15 +5,25 @@
 
 #include <osg/Geometry>
 #include <osg/Geode>
+#include <osg/MatrixTransform>
+#include <osg/Point>
 #include <osg/Texture2D>
 #include <osgDB/ReadFile>
 #include <osgViewer/Viewer>
 
+#include "ColorIdPickHandler"
 #include "CommonFunctions"
+#include "FrameBenchmark"
 
+// The PICKING variant is used by the ID pass of the pick handler, which hence sees the
+// displaced surface instead of the flat grid kept in CPU memory
 const char* vertCode = {
+    "#pragma import_defines ( PICKING )\n"
     "uniform sampler2D defaultTex;\n"
     "varying float height;\n"
+    "#ifdef PICKING\n"
+    "varying float pickDepth;\n"
+    "#endif\n"
     "void main()\n"
     "{\n"
     "    vec2 uv = gl_MultiTexCoord0.xy;\n"
@@ -23,10 +33,23 @@ const char* vertCode = {
     "    vec4 pos = gl_Vertex;\n"
     "    pos.z = pos.z + 100.0*height;\n"
     "    gl_Position = gl_ModelViewProjectionMatrix * pos;\n"
+    "#ifdef PICKING\n"
+    "    pickDepth = -(gl_ModelViewMatrix * pos).z;\n"
+    "#endif\n"
     "}\n"
 };
 
 const char* fragCode = {
+    "#pragma import_defines ( PICKING )\n"
+    "#ifdef PICKING\n"
+    "#extension GL_EXT_gpu_shader4 : enable\n"
+    "uniform float pickObjectId;\n"
+    "varying float pickDepth;\n"
+    "void main()\n"
+    "{\n"
+    "    gl_FragColor = vec4(pickObjectId, float(gl_PrimitiveID), -1.0, pickDepth);\n"
+    "}\n"
+    "#else\n"
     "varying float height;\n"
     "const vec4 lowerColor = vec4(0.1, 0.1, 0.1, 1.0);\n"
     "const vec4 higherColor = vec4(0.2, 1.0, 0.2, 1.0);\n"
@@ -34,8 +57,51 @@ const char* fragCode = {
     "{\n"
     "    gl_FragColor = mix(lowerColor, higherColor, height);\n"
     "}\n"
+    "#endif\n"
 };
 
+/** Moves a marker to the point of the displaced surface under the mouse. */
+class HoverMarkerHandler : public osgCookBook::ColorIdPickHandler
+{
+public:
+    HoverMarkerHandler( osg::MatrixTransform* marker ) : _marker(marker) { setHoverMode( true ); }
+
+    virtual void doUserOperations( Result& result )
+    {
+        if ( _marker.valid() )
+        {
+            _marker->setMatrix( osg::Matrix::translate(result.worldPoint) );
+            _marker->setNodeMask( 0xffffffff );
+        }
+    }
+
+protected:
+    osg::observer_ptr<osg::MatrixTransform> _marker;
+};
+
+osg::MatrixTransform* createMarker()
+{
+    osg::ref_ptr<osg::Geometry> geom = new osg::Geometry;
+    osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array(1);
+    osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array;
+    colors->push_back( osg::Vec4(1.0f, 0.0f, 0.0f, 1.0f) );
+    geom->setVertexArray( vertices.get() );
+    geom->setColorArray( colors.get() );
+    geom->setColorBinding( osg::Geometry::BIND_OVERALL );
+    geom->addPrimitiveSet( new osg::DrawArrays(GL_POINTS, 0, 1) );
+
+    osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+    geode->addDrawable( geom.get() );
+    geode->getOrCreateStateSet()->setAttributeAndModes( new osg::Point(8.0f) );
+    geode->getOrCreateStateSet()->setMode( GL_DEPTH_TEST, osg::StateAttribute::OFF );
+    geode->getOrCreateStateSet()->setRenderBinDetails( 1000, "RenderBin" );
+
+    osg::ref_ptr<osg::MatrixTransform> marker = new osg::MatrixTransform;
+    marker->addChild( geode.get() );
+    marker->setNodeMask( 0 );
+    return marker.release();
+}
+
 osg::Geometry* createGridGeometry( unsigned int column, unsigned int row )
 {
     osg::ref_ptr<osg::Vec3Array> vertices = new osg::Vec3Array(column * row);
@@ -86,7 +152,8 @@ osg::Geometry* createGridGeometry( unsigned int column, unsigned int row )
     osg::ref_ptr<osg::Program> program = new osg::Program;
     program->addShader( new osg::Shader(osg::Shader::VERTEX, vertCode) );
     program->addShader( new osg::Shader(osg::Shader::FRAGMENT, fragCode) );
-    geom->getOrCreateStateSet()->setAttributeAndModes( program.get() );
+    geom->getOrCreateStateSet()->setAttributeAndModes(
+        program.get(), osg::StateAttribute::ON|osg::StateAttribute::PROTECTED );
     return geom.release();
 }
 
@@ -99,7 +166,15 @@ int main( int argc, char** argv )
     osg::ref_ptr<osg::Group> root = new osg::Group;
     root->addChild( geode.get() );
 
+    // The marker is outside the picked scene, so it never hides the surface from the ID pass
+    osg::ref_ptr<osg::MatrixTransform> marker = createMarker();
+    osg::ref_ptr<HoverMarkerHandler> picker = new HoverMarkerHandler( marker.get() );
+    picker->registerObjects( geode.get() );
+    root->addChild( marker.get() );
+    root->addChild( picker->createPickCamera(geode.get()) );
+
     osgViewer::Viewer viewer;
+    viewer.addEventHandler( picker.get() );
     viewer.setSceneData( root.get() );
-    return viewer.run();
+    return osgCookBook::runViewer( viewer );
 }
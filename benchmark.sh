@@ -0,0 +1,47 @@
+#!/bin/sh
+# Run every example of osgExample.pro offscreen and collect frame timings.
+#
+# Usage: benchmark.sh <build-dir> [output-dir]
+#
+# Each example runs in its source directory (so local data files like Cloud/data.txt
+# are found) with OSG_COOKBOOK_BENCHMARK set, and writes <output-dir>/<example>.json.
+# Without a display, the run is wrapped in xvfb-run; set LIBGL_ALWAYS_SOFTWARE=1 to
+# force Mesa software rendering on machines without a GPU.
+
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+BUILD_DIR=${1:-$SRC_DIR}
+OUTPUT_DIR=${2:-$BUILD_DIR/benchmark}
+BUILD_DIR=$(cd "$BUILD_DIR" && pwd)
+mkdir -p "$OUTPUT_DIR" && OUTPUT_DIR=$(cd "$OUTPUT_DIR" && pwd)
+
+: "${OSG_COOKBOOK_BENCHMARK:=300}"
+export OSG_COOKBOOK_BENCHMARK
+
+run_offscreen() {
+    if [ -z "$DISPLAY" ] && command -v xvfb-run >/dev/null 2>&1; then
+        xvfb-run -a -s "-screen 0 1920x1080x24" "$@"
+    else
+        "$@"
+    fi
+}
+
+# Tests under tests/ are run by "make check" instead
+EXAMPLES=$(sed -n '/SUBDIRS/,/^$/p' "$SRC_DIR/osgExample.pro" | tr -d '\\' | grep -v 'SUBDIRS\|tests/')
+FAILED=0
+for example in $EXAMPLES; do
+    binary="$BUILD_DIR/$example/$example"
+    if [ ! -x "$binary" ]; then
+        echo "skip $example: $binary not built"
+        continue
+    fi
+
+    echo "run $example"
+    if ! (cd "$SRC_DIR/$example" &&
+          export OSG_COOKBOOK_BENCHMARK_NAME="$example" \
+                 OSG_COOKBOOK_BENCHMARK_OUTPUT="$OUTPUT_DIR/$example.json" &&
+          run_offscreen "$binary"); then
+        echo "FAILED $example"
+        FAILED=1
+    fi
+done
+exit $FAILED
@@ -0,0 +1,365 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Offscreen color-ID picking
+*/
+
+#include <osg/BufferObject>
+#include <osg/ClampColor>
+#include <osg/Notify>
+#include <osg/Version>
+#include <osgViewer/View>
+#include <OpenThreads/ScopedLock>
+#include <set>
+
+// The PBO readback takes its entry points from State::get<GLExtensions>()
+#if OSG_VERSION_LESS_THAN(3,5,6)
+#error "ColorIdPickHandler needs OpenSceneGraph 3.5.6 or later"
+#endif
+
+#include "CommonFunctions"
+#include "InstancedGeometry"
+#include "ColorIdPickHandler"
+
+namespace osgCookBook
+{
+
+    static const char* pickVertSource = {
+        "varying float pickDepth;\n"
+        "void main(void)\n"
+        "{\n"
+        "   vec4 eye = gl_ModelViewMatrix * gl_Vertex;\n"
+        "   pickDepth = -eye.z;\n"
+        "   gl_Position = gl_ProjectionMatrix * eye;\n"
+        "}\n"
+    };
+
+    static const char* pickFragSource = {
+        "#extension GL_EXT_gpu_shader4 : enable\n"
+        "uniform float pickObjectId;\n"
+        "varying float pickDepth;\n"
+        "void main(void)\n"
+        "{\n"
+        "   gl_FragColor = vec4(pickObjectId, float(gl_PrimitiveID), -1.0, pickDepth);\n"
+        "}\n"
+    };
+
+    class PickReadbackCallback : public osg::Camera::DrawCallback
+    {
+    public:
+        PickReadbackCallback( ColorIdPickHandler* handler ) : _handler(handler) {}
+
+        virtual void operator()( osg::RenderInfo& renderInfo ) const
+        {
+            osg::ref_ptr<ColorIdPickHandler> handler;
+            if ( _handler.lock(handler) ) handler->readback( renderInfo );
+        }
+
+    protected:
+        osg::observer_ptr<ColorIdPickHandler> _handler;
+    };
+
+    class CollectDrawableVisitor : public osg::NodeVisitor
+    {
+    public:
+        CollectDrawableVisitor() : osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN) {}
+
+        virtual void apply( osg::Drawable& drawable )
+        {
+            if ( _visited.insert(&drawable).second ) _drawables.push_back( &drawable );
+        }
+
+        std::set<osg::Drawable*> _visited;
+        std::vector<osg::Drawable*> _drawables;
+    };
+
+    ColorIdPickHandler::ColorIdPickHandler( int size )
+    :   _size(size), _hoverMode(false), _lastRequestFrame(~0u), _lastPickLatency(0.0)
+    {
+    }
+
+    osg::Camera* ColorIdPickHandler::createPickCamera( osg::Node* scene )
+    {
+        // Floats keep IDs exact up to 2^24 and the eye depth unclamped
+        _pickTexture = new osg::Texture2D;
+        _pickTexture->setTextureSize( _size, _size );
+        _pickTexture->setInternalFormat( GL_RGBA32F_ARB );
+        _pickTexture->setSourceFormat( GL_RGBA );
+        _pickTexture->setSourceType( GL_FLOAT );
+
+        // Relative to the main view, so only the projection is narrowed to the cursor
+        _pickCamera = createRTTCamera( osg::Camera::COLOR_BUFFER, _pickTexture.get() );
+        _pickCamera->attach( osg::Camera::DEPTH_BUFFER, GL_DEPTH_COMPONENT24 );
+        _pickCamera->setRenderOrder( osg::Camera::POST_RENDER );
+        // The pick window is applied to the clip coordinates of the main projection
+        _pickCamera->setTransformOrder( osg::Camera::POST_MULTIPLY );
+        _pickCamera->setComputeNearFarMode( osg::CullSettings::DO_NOT_COMPUTE_NEAR_FAR );
+        _pickCamera->setInheritanceMask( _pickCamera->getInheritanceMask() & ~osg::CullSettings::CULL_MASK );
+        _pickCamera->setCullMask( 0 );
+        _pickCamera->setFinalDrawCallback( new PickReadbackCallback(this) );
+        _pickCamera->addChild( scene );
+        _pickTexture->setFilter( osg::Texture2D::MIN_FILTER, osg::Texture2D::NEAREST );
+        _pickTexture->setFilter( osg::Texture2D::MAG_FILTER, osg::Texture2D::NEAREST );
+
+        osg::ref_ptr<osg::Program> program = new osg::Program;
+        program->addShader( new osg::Shader(osg::Shader::VERTEX, pickVertSource) );
+        program->addShader( new osg::Shader(osg::Shader::FRAGMENT, pickFragSource) );
+
+        // Anything that would change the written values is switched off; textures only
+        // matter to the fixed function fragment stage, which the instanced picking uses
+        int values = osg::StateAttribute::ON|osg::StateAttribute::OVERRIDE;
+        osg::StateSet* ss = _pickCamera->getOrCreateStateSet();
+        ss->setAttributeAndModes( program.get(), values );
+        ss->setDefine( "PICKING", values );
+        ss->setAttribute( new osg::ClampColor(GL_FALSE, GL_FALSE, GL_FALSE), values );
+        ss->setMode( GL_BLEND, osg::StateAttribute::OFF|osg::StateAttribute::OVERRIDE );
+        ss->setMode( GL_ALPHA_TEST, osg::StateAttribute::OFF|osg::StateAttribute::OVERRIDE );
+        ss->setMode( GL_FOG, osg::StateAttribute::OFF|osg::StateAttribute::OVERRIDE );
+        ss->setMode( GL_LIGHTING, osg::StateAttribute::OFF|osg::StateAttribute::OVERRIDE );
+        for ( unsigned int i=0; i<8; ++i )
+            ss->setTextureMode( i, GL_TEXTURE_2D, osg::StateAttribute::OFF|osg::StateAttribute::OVERRIDE );
+        return _pickCamera.get();
+    }
+
+    void ColorIdPickHandler::registerObjects( osg::Node* node )
+    {
+        if ( !node ) return;
+        CollectDrawableVisitor cdv;
+        node->accept( cdv );
+
+        for ( unsigned int i=0; i<cdv._drawables.size(); ++i )
+        {
+            // A state set shared with other drawables would share the ID, too
+            osg::Drawable* drawable = cdv._drawables[i];
+            osg::StateSet* ss = drawable->getStateSet();
+            if ( ss && ss->getNumParents()==1 && ss->getUniform("pickObjectId") ) continue;
+            if ( !ss ) drawable->setStateSet( new osg::StateSet );
+            else if ( ss->getNumParents()>1 ) drawable->setStateSet( new osg::StateSet(*ss) );
+
+            _objects.push_back( drawable );
+            drawable->getStateSet()->addUniform( new osg::Uniform("pickObjectId", (float)_objects.size()) );
+        }
+    }
+
+    bool ColorIdPickHandler::handle( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa )
+    {
+        osgViewer::View* viewer = dynamic_cast<osgViewer::View*>(&aa);
+        if ( !viewer || !_pickCamera ) return false;
+
+        unsigned int frameNumber = viewer->getFrameStamp()->getFrameNumber();
+        switch ( ea.getEventType() )
+        {
+        case osgGA::GUIEventAdapter::FRAME:
+            // The pick camera only draws the scene in frames with a request
+            if ( _lastRequestFrame!=frameNumber ) _pickCamera->setCullMask( 0 );
+            deliverResults();
+            break;
+
+        case osgGA::GUIEventAdapter::MOVE:
+            if ( _hoverMode ) requestPick( viewer->getCamera(), frameNumber, ea.getX(), ea.getY() );
+            break;
+
+        case osgGA::GUIEventAdapter::RELEASE:
+            if ( ea.getButton()==osgGA::GUIEventAdapter::LEFT_MOUSE_BUTTON &&
+                 (ea.getModKeyMask()&osgGA::GUIEventAdapter::MODKEY_CTRL) )
+                requestPick( viewer->getCamera(), frameNumber, ea.getX(), ea.getY() );
+            break;
+
+        default:
+            break;
+        }
+        return false;
+    }
+
+    void ColorIdPickHandler::requestPick( osg::Camera* camera, unsigned int frameNumber, float x, float y )
+    {
+        osg::Viewport* vp = camera ? camera->getViewport() : 0;
+        if ( !vp ) return;
+
+        // Map the pixels around the cursor to the whole pick target. The translation is
+        // scaled by w, so it shifts the normalized device coordinates
+        double ndcX = 2.0 * (x - vp->x()) / vp->width() - 1.0;
+        double ndcY = 2.0 * (y - vp->y()) / vp->height() - 1.0;
+        _pickCamera->setProjectionMatrix( osg::Matrix::translate(-ndcX, -ndcY, 0.0) *
+                                          osg::Matrix::scale(vp->width() / _size, vp->height() / _size, 1.0) );
+        _pickCamera->setCullMask( camera->getCullMask() );
+        _lastRequestFrame = frameNumber;
+
+        PickRequest request;
+        request.frameNumber = frameNumber;
+        request.x = x;
+        request.y = y;
+        request.view = camera->getViewMatrix();
+        request.inverseViewProjection = osg::Matrixd::inverse( camera->getViewMatrix() * camera->getProjectionMatrix() );
+        request.viewport = new osg::Viewport( *vp );
+        request.tick = osg::Timer::instance()->tick();
+
+        // Several moves in one frame are drawn with the last projection only
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        if ( !_requests.empty() && _requests.back().frameNumber==frameNumber )
+            _requests.back() = request;
+        else
+            _requests.push_back( request );
+    }
+
+    void ColorIdPickHandler::readback( osg::RenderInfo& renderInfo )
+    {
+        osg::State& state = *renderInfo.getState();
+        const osg::GLExtensions* ext = state.get<osg::GLExtensions>();
+        if ( !ext->isPBOSupported || !_pickTexture ) return;
+
+        unsigned int frameNumber = state.getFrameStamp()->getFrameNumber();
+        unsigned int numPixels = _size * _size;
+        ReadbackRing& ring = _rings[state.getContextID()];
+        if ( ring.empty() )
+        {
+            ring.resize( RING_SIZE );
+            for ( unsigned int i=0; i<ring.size(); ++i )
+            {
+                ReadbackSlot& slot = ring[i];
+                ext->glGenBuffers( 1, &slot.pbo );
+                ext->glBindBuffer( GL_PIXEL_PACK_BUFFER_ARB, slot.pbo );
+                ext->glBufferData( GL_PIXEL_PACK_BUFFER_ARB, numPixels * sizeof(osg::Vec4f), 0, GL_STREAM_READ_ARB );
+                slot.fence = 0;
+                slot.frameNumber = 0;
+                slot.pending = false;
+            }
+        }
+
+        // Map only the copies the GPU has finished. Without fences, assume it is done
+        // once the ring has come round
+        for ( unsigned int i=0; i<ring.size(); ++i )
+        {
+            ReadbackSlot& slot = ring[i];
+            if ( !slot.pending ) continue;
+            if ( slot.fence )
+            {
+                GLenum status = ext->glClientWaitSync( slot.fence, 0, 0 );
+                if ( status!=GL_ALREADY_SIGNALED && status!=GL_CONDITION_SATISFIED ) continue;
+                ext->glDeleteSync( slot.fence );
+                slot.fence = 0;
+            }
+            else if ( frameNumber<slot.frameNumber + RING_SIZE - 1 )
+                continue;
+
+            Readback readback;
+            readback.request = slot.request;
+            ext->glBindBuffer( GL_PIXEL_PACK_BUFFER_ARB, slot.pbo );
+            const osg::Vec4f* data = (const osg::Vec4f*)ext->glMapBuffer( GL_PIXEL_PACK_BUFFER_ARB, GL_READ_ONLY_ARB );
+            if ( data )
+            {
+                readback.pixels.assign( data, data + numPixels );
+                ext->glUnmapBuffer( GL_PIXEL_PACK_BUFFER_ARB );
+
+                OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+                _readbacks.push_back( readback );
+            }
+            slot.request.viewport = 0;
+            slot.pending = false;
+        }
+
+        // The request drawn in this frame is the latest one made before its cull
+        bool found = false;
+        PickRequest request;
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+            unsigned int numDrawn = 0;
+            while ( numDrawn<_requests.size() && _requests[numDrawn].frameNumber<=frameNumber ) ++numDrawn;
+            if ( numDrawn>0 && _requests[numDrawn - 1].frameNumber==frameNumber )
+            {
+                request = _requests[numDrawn - 1];
+                found = true;
+            }
+            _requests.erase( _requests.begin(), _requests.begin() + numDrawn );
+        }
+
+        if ( found )
+        {
+            // With every buffer in flight, drop the request; a newer one will follow
+            ReadbackSlot* slot = 0;
+            for ( unsigned int i=0; i<ring.size() && !slot; ++i )
+            {
+                if ( !ring[i].pending ) slot = &ring[i];
+            }
+
+            if ( slot )
+            {
+                // Reading into a bound pack buffer returns at once, the copy happens later
+                state.setActiveTextureUnit( 0 );
+                state.applyTextureAttribute( 0, _pickTexture.get() );
+                ext->glBindBuffer( GL_PIXEL_PACK_BUFFER_ARB, slot->pbo );
+                glGetTexImage( GL_TEXTURE_2D, 0, GL_RGBA, GL_FLOAT, 0 );
+                if ( ext->glFenceSync ) slot->fence = ext->glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+                slot->frameNumber = frameNumber;
+                slot->request = request;
+                slot->pending = true;
+            }
+            else
+                OSG_INFO << "ColorIdPickHandler: All readback buffers in use" << std::endl;
+        }
+        ext->glBindBuffer( GL_PIXEL_PACK_BUFFER_ARB, 0 );
+    }
+
+    void ColorIdPickHandler::deliverResults()
+    {
+        std::vector<Readback> readbacks;
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+            readbacks.swap( _readbacks );
+        }
+
+        for ( unsigned int i=0; i<readbacks.size(); ++i )
+        {
+            const Readback& readback = readbacks[i];
+            _lastPickLatency = osg::Timer::instance()->delta_m( readback.request.tick, osg::Timer::instance()->tick() );
+
+            Result result;
+            if ( decode(readback, result) ) doUserOperations( result );
+        }
+    }
+
+    bool ColorIdPickHandler::decode( const Readback& readback, Result& result ) const
+    {
+        // Take the covered pixel closest to the cursor, which is at the target center
+        int half = _size / 2, best = -1, bestDistance = 0;
+        for ( int j=0; j<_size; ++j )
+        {
+            for ( int i=0; i<_size; ++i )
+            {
+                if ( readback.pixels[j * _size + i].x()<0.5f ) continue;
+                int distance = (i - half) * (i - half) + (j - half) * (j - half);
+                if ( best<0 || distance<bestDistance )
+                {
+                    best = j * _size + i;
+                    bestDistance = distance;
+                }
+            }
+        }
+        if ( best<0 ) return false;
+
+        const osg::Vec4f& pixel = readback.pixels[best];
+        unsigned int objectID = (unsigned int)(pixel.x() + 0.5f);
+        if ( objectID>_objects.size() || !_objects[objectID - 1].lock(result.drawable) ) return false;
+
+        result.primitiveIndex = pixel.y()<0.0f ? ~0u : (unsigned int)(pixel.y() + 0.5f);
+        result.instanceID = ~0u;
+        if ( pixel.z()>=0.0f )
+        {
+            InstancedGeometry* geom = dynamic_cast<InstancedGeometry*>( result.drawable.get() );
+            if ( geom ) result.instanceID = geom->getInstanceIDFromIndex( (unsigned int)(pixel.z() + 0.5f) );
+        }
+
+        // Walk along the ray of the pixel to the eye depth, which doesn't depend on the
+        // near and far planes the pick pass was drawn with
+        const PickRequest& request = readback.request;
+        const osg::Viewport* vp = request.viewport.get();
+        double x = request.x - half + (best % _size) + 0.5, y = request.y - half + (best / _size) + 0.5;
+        double ndcX = 2.0 * (x - vp->x()) / vp->width() - 1.0;
+        double ndcY = 2.0 * (y - vp->y()) / vp->height() - 1.0;
+        osg::Vec3d start = osg::Vec3d(ndcX, ndcY,-1.0) * request.inverseViewProjection;
+        osg::Vec3d end = osg::Vec3d(ndcX, ndcY, 1.0) * request.inverseViewProjection;
+        double startDepth = -(start * request.view).z(), endDepth = -(end * request.view).z();
+        double t = (endDepth!=startDepth) ? (pixel.w() - startDepth) / (endDepth - startDepth) : 0.0;
+        result.worldPoint = start + (end - start) * t;
+        return true;
+    }
+
+}
@@ -3,11 +3,19 @@
  * Author: Wang Rui <wangray84 at gmail dot com>
 */
 
+#include <osg/Notify>
+#include <osg/ObserverNodePath>
 #include <osg/PolygonMode>
 #include <osgText/Font>
 #include <osgViewer/View>
+#include <OpenThreads/ScopedLock>
 
 #include "CommonFunctions"
+#include "LabelBatch"
+#include "PathAnimator"
+#include "PickAccelerator"
+#include "Random"
+#include "ThreadPool"
 
 namespace osgCookBook
 {
@@ -16,26 +24,13 @@ namespace osgCookBook
     
     osg::AnimationPathCallback* createAnimationPathCallback( float radius, float time )
     {
-        osg::ref_ptr<osg::AnimationPath> path = new osg::AnimationPath;
-        path->setLoopMode( osg::AnimationPath::LOOP );
-        
-        unsigned int numSamples = 32;
-        float delta_yaw = 2.0f * osg::PI/((float)numSamples - 1.0f);
-        float delta_time = time / (float)numSamples;
-        for ( unsigned int i=0; i<numSamples; ++i )
-        {
-            float yaw = delta_yaw * (float)i;
-            osg::Vec3 pos( sinf(yaw)*radius, cosf(yaw)*radius, 0.0f );
-            osg::Quat rot( -yaw, osg::Z_AXIS );
-            path->insert( delta_time * (float)i, osg::AnimationPath::ControlPoint(pos, rot) );
-        }
-        
         osg::ref_ptr<osg::AnimationPathCallback> apcb = new osg::AnimationPathCallback;
-        apcb->setAnimationPath( path.get() );
+        apcb->setAnimationPath( getCircularAnimationPath(radius, time) );
         return apcb.release();    
     }
     
-    osg::Camera* createRTTCamera( osg::Camera::BufferComponent buffer, osg::Texture* tex, bool isAbsolute )
+    osg::Camera* createRTTCamera( osg::Camera::BufferComponent buffer, osg::Texture* tex, bool isAbsolute,
+                                  unsigned int samples )
     {
         osg::ref_ptr<osg::Camera> camera = new osg::Camera;
         camera->setClearColor( osg::Vec4() );
@@ -47,7 +42,7 @@ namespace osgCookBook
             tex->setFilter( osg::Texture2D::MIN_FILTER, osg::Texture2D::LINEAR );
             tex->setFilter( osg::Texture2D::MAG_FILTER, osg::Texture2D::LINEAR );
             camera->setViewport( 0, 0, tex->getTextureWidth(), tex->getTextureHeight() );
-            camera->attach( buffer, tex );
+            camera->attach( buffer, tex, 0, 0, false, samples );
         }
         
         if ( isAbsolute )
@@ -91,7 +86,10 @@ namespace osgCookBook
     {
         osg::ref_ptr<osgText::Text> text = new osgText::Text;
         text->setDataVariance( osg::Object::DYNAMIC );
-        text->setFont( g_font.get() );
+        // Same font and glyph resolution as LabelBatch, so both fill the same glyph atlas
+        osgText::FontResolution resolution = LabelBatch::getSharedFontResolution();
+        text->setFont( LabelBatch::getSharedFont() );
+        text->setFontResolution( resolution.first, resolution.second );
         text->setCharacterSize( size );
         text->setAxisAlignment( osgText::TextBase::XY_PLANE );
         text->setPosition( pos );
@@ -101,14 +99,16 @@ namespace osgCookBook
     
     float randomValue( float min, float max )
     {
-        return (min + (float)rand()/(RAND_MAX+1.0f) * (max - min));
+        return getThreadRandomGenerator().uniform( min, max );
     }
     
     osg::Vec3 randomVector( float min, float max )
     {
-        return osg::Vec3( randomValue(min, max),
-                          randomValue(min, max),
-                          randomValue(min, max) );
+        // Drawn in turn, as arguments of one call may be evaluated in any order
+        float x = randomValue(min, max);
+        float y = randomValue(min, max);
+        float z = randomValue(min, max);
+        return osg::Vec3( x, y, z );
     }
     
     osg::Matrix randomMatrix( float min, float max )
@@ -119,8 +119,233 @@ namespace osgCookBook
                osg::Matrix::translate(pos);
     }
     
+    void randomVectors( unsigned int n, osg::Vec3* out, float min, float max )
+    {
+        if ( n>0 ) getThreadRandomGenerator().fill( out->ptr(), n * 3, min, max );
+    }
+    
+    void randomMatrices( unsigned int n, osg::Matrix* out, float min, float max )
+    {
+        if ( !n ) return;
+        
+        // Draw the numbers in the order of randomMatrix() and build the matrices in parallel,
+        // so the result doesn't depend on the number of threads. Numbers in [0, 1) are scaled
+        // with the float arithmetic of RandomGenerator::uniform(), so both match bit by bit.
+        std::vector<float> values( n * 6 );
+        getThreadRandomGenerator().fill( &values[0], n * 6, 0.0f, 1.0f );
+        ThreadPool::instance()->parallelFor( 0, n, [&values, out, min, max]( unsigned int first, unsigned int last )
+            {
+                const float rotMin = -osg::PI, rotMax = osg::PI;
+                for ( unsigned int i=first; i<last; ++i )
+                {
+                    const float* v = &values[i * 6];
+                    osg::Vec3 rot( rotMin + v[0] * (rotMax - rotMin), rotMin + v[1] * (rotMax - rotMin),
+                                   rotMin + v[2] * (rotMax - rotMin) );
+                    osg::Vec3 pos( min + v[3] * (max - min), min + v[4] * (max - min), min + v[5] * (max - min) );
+                    out[i].makeRotate( rot[0], osg::X_AXIS, rot[1], osg::Y_AXIS, rot[2], osg::Z_AXIS );
+                    out[i].setTrans( pos );
+                }
+            }, 4096 );
+    }
+    
+    /* Drawables along the segment of one hover request, taken in the update traversal.
+       Geometries are copied without state, sharing arrays and trees that the scene doesn't
+       change in place; DYNAMIC ones get their own vertices and tree, so the worker never
+       reads anything the next update may write. */
+    struct PickHandler::HoverSnapshot : public osg::Referenced
+    {
+        struct Item
+        {
+            Item() : buildTree(false), refitTree(false) {}
+
+            osg::ref_ptr<osg::Drawable> drawable;   // Intersected by the worker
+            osg::RefNodePath path;                  // Ends with the drawable of the scene
+            osg::Matrix matrix;
+            osg::ref_ptr<PickKdTree> builtTree;     // Attached in the update traversal
+            bool buildTree, refitTree;
+        };
+
+        std::vector<Item> items;
+        osg::Vec3d start, end;
+        osg::Timer_t tick;
+        osgUtil::LineSegmentIntersector::Intersection result;
+    };
+    
+    static bool segmentHitsSphere( const osg::Vec3d& start, const osg::Vec3d& end, const osg::BoundingSphere& bs )
+    {
+        if ( !bs.valid() ) return false;
+        osg::Vec3d dir = end - start;
+        double length2 = dir.length2();
+        double t = length2>0.0 ? ((osg::Vec3d(bs.center()) - start) * dir) / length2 : 0.0;
+        osg::Vec3d closest = start + dir * osg::clampBetween(t, 0.0, 1.0);
+        return (closest - osg::Vec3d(bs.center())).length2()<=bs.radius2();
+    }
+    
+    class CollectHoverItemsVisitor : public osg::NodeVisitor
+    {
+    public:
+        CollectHoverItemsVisitor( PickHandler::HoverSnapshot* snapshot )
+        :   osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ACTIVE_CHILDREN), _snapshot(snapshot)
+        {
+            _matrices.push_back( osg::Matrix() );
+            _segments.push_back( std::make_pair(snapshot->start, snapshot->end) );
+        }
+        
+        virtual void apply( osg::Node& node )
+        {
+            if ( hits(node) ) traverse( node );
+        }
+        
+        virtual void apply( osg::Transform& transform )
+        {
+            if ( !hits(transform) ) return;
+            osg::Matrix matrix = _matrices.back();
+            transform.computeLocalToWorldMatrix( matrix, this );
+            
+            // Subgraphs are tested against the segment in their own coordinates
+            osg::Matrix inverse = osg::Matrix::inverse( matrix );
+            _matrices.push_back( matrix );
+            _segments.push_back( std::make_pair(_snapshot->start * inverse, _snapshot->end * inverse) );
+            traverse( transform );
+            _segments.pop_back();
+            _matrices.pop_back();
+        }
+        
+        // HUD and RTT cameras aren't seen through the picked window position
+        virtual void apply( osg::Camera& ) {}
+        
+        virtual void apply( osg::Drawable& drawable )
+        {
+            if ( !hits(drawable) ) return;
+            
+            PickHandler::HoverSnapshot::Item item;
+            osg::Geometry* geometry = drawable.asGeometry();
+            if ( geometry ) item.drawable = createPickGeometry( *geometry, item );
+            else if ( drawable.getDataVariance()!=osg::Object::DYNAMIC ) item.drawable = &drawable;
+            if ( !item.drawable ) return;
+            
+            const osg::NodePath& path = getNodePath();
+            item.path.assign( path.begin(), path.end() );
+            item.matrix = _matrices.back();
+            _snapshot->items.push_back( item );
+        }
+        
+    protected:
+        bool hits( osg::Node& node ) const
+        { return segmentHitsSphere( _segments.back().first, _segments.back().second, node.getBound() ); }
+        
+        osg::Geometry* createPickGeometry( osg::Geometry& geometry, PickHandler::HoverSnapshot::Item& item ) const
+        {
+            osg::ref_ptr<osg::Geometry> copy = new osg::Geometry;
+            copy->setUseDisplayList( false );
+            copy->setUseVertexBufferObjects( false );
+            copy->setInitialBound( geometry.getBoundingBox() );
+            copy->setPrimitiveSetList( geometry.getPrimitiveSetList() );
+            
+            osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( geometry.getVertexArray() );
+            PickKdTree* tree = dynamic_cast<PickKdTree*>( geometry.getShape() );
+            if ( geometry.getDataVariance()==osg::Object::DYNAMIC )
+            {
+                if ( !vertices ) return NULL;
+                osg::ref_ptr<osg::Vec3Array> copiedVertices = new osg::Vec3Array( vertices->begin(), vertices->end() );
+                copy->setVertexArray( copiedVertices.get() );
+                if ( tree && !tree->needsRebuild(&geometry) )
+                {
+                    osg::ref_ptr<PickKdTree> copiedTree = new PickKdTree( *tree );
+                    copiedTree->setVertices( copiedVertices.get() );
+                    copy->setShape( copiedTree.get() );
+                    item.refitTree = tree->isDirty( &geometry );
+                }
+            }
+            else
+            {
+                // Plain KdTrees and shapes of ShapeDrawables are used as they are
+                copy->setVertexArray( geometry.getVertexArray() );
+                if ( !tree || !tree->needsRebuild(&geometry) ) copy->setShape( geometry.getShape() );
+                item.buildTree = vertices && !copy->getShape();
+            }
+            return copy.release();
+        }
+        
+        PickHandler::HoverSnapshot* _snapshot;
+        std::vector<osg::Matrix> _matrices;
+        std::vector< std::pair<osg::Vec3d, osg::Vec3d> > _segments;
+    };
+    
+    /* Intersects drawables of a snapshot as if they were found under their paths. */
+    class SnapshotIntersectionVisitor : public osgUtil::IntersectionVisitor
+    {
+    public:
+        SnapshotIntersectionVisitor( osgUtil::Intersector* intersector )
+        :   osgUtil::IntersectionVisitor(intersector) {}
+        
+        void intersectItem( const PickHandler::HoverSnapshot::Item& item )
+        {
+            for ( unsigned int i=0; i<item.path.size(); ++i )
+                _nodePath.push_back( item.path[i].get() );
+            pushModelMatrix( new osg::RefMatrix(item.matrix) );
+            push_clone();
+            apply( *item.drawable );
+            pop_clone();
+            popModelMatrix();
+            _nodePath.clear();
+        }
+    };
+    
+    class HoverPickOperation : public osg::Operation
+    {
+    public:
+        HoverPickOperation( PickHandler* handler, PickHandler::HoverSnapshot* snapshot )
+        :   osg::Operation("HoverPickOperation", false), _handler(handler), _snapshot(snapshot) {}
+        
+        virtual void operator()( osg::Object* )
+        {
+            // Handed over without a reference of the worker, so the snapshot and the scene
+            // references in it are always released in the update traversal
+            _handler->runHoverPick( _snapshot.release() );
+        }
+        
+    protected:
+        osg::ref_ptr<PickHandler> _handler;
+        osg::ref_ptr<PickHandler::HoverSnapshot> _snapshot;
+    };
+    
+    class HoverDeliveryCallback : public osg::NodeCallback
+    {
+    public:
+        HoverDeliveryCallback( PickHandler* handler ) : _handler(handler) {}
+        
+        virtual void operator()( osg::Node* node, osg::NodeVisitor* nv )
+        {
+            traverse( node, nv );
+            
+            osg::ref_ptr<PickHandler> handler;
+            if ( _handler.lock(handler) ) handler->updateHoverPicks();
+        }
+        
+    protected:
+        osg::observer_ptr<PickHandler> _handler;
+    };
+    
+    PickHandler::PickHandler()
+    :   _pickAcceleratorsDirty(false), _hoverMode(false), _hasPendingRequest(false), _workerRunning(false),
+        _lastPickLatency(0.0), _totalPickLatency(0.0), _numHoverPicks(0)
+    {
+    }
+    
+    PickHandler::~PickHandler()
+    {
+    }
+    
     bool PickHandler::handle( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa )
     {
+        if ( _hoverMode && ea.getEventType()==osgGA::GUIEventAdapter::MOVE )
+        {
+            osgViewer::View* viewer = dynamic_cast<osgViewer::View*>(&aa);
+            if ( viewer ) requestHoverPick( viewer->getCamera(), viewer->getSceneData(), ea.getX(), ea.getY() );
+            return false;
+        }
+        
         if ( ea.getEventType()!=osgGA::GUIEventAdapter::RELEASE ||
              ea.getButton()!=osgGA::GUIEventAdapter::LEFT_MOUSE_BUTTON ||
              !(ea.getModKeyMask()&osgGA::GUIEventAdapter::MODKEY_CTRL) )
@@ -129,6 +354,9 @@ namespace osgCookBook
         osgViewer::View* viewer = dynamic_cast<osgViewer::View*>(&aa);
         if ( viewer )
         {
+            // Hover picks only read their snapshots, so the scene needs no lock here
+            preparePickAccelerators( viewer->getSceneData() );
+            
             osg::ref_ptr<osgUtil::LineSegmentIntersector> intersector =
                 new osgUtil::LineSegmentIntersector(osgUtil::Intersector::WINDOW, ea.getX(), ea.getY());
             osgUtil::IntersectionVisitor iv( intersector.get() );
@@ -142,5 +370,148 @@ namespace osgCookBook
         }
         return false;
     }
+    
+    void PickHandler::requestHoverPick( osg::Camera* camera, osg::Node* scene, float x, float y )
+    {
+        if ( !camera || !camera->getViewport() || !scene ) return;
+        if ( scene!=_hoverScene.get() )
+        {
+            // Wrap the whole update traversal of the scene, so snapshots are taken and
+            // results are delivered after the scene is updated
+            osg::ref_ptr<osg::Callback> callback = new HoverDeliveryCallback( this );
+            callback->setNestedCallback( scene->getUpdateCallback() );
+            scene->setUpdateCallback( callback.get() );
+            _hoverScene = scene;
+        }
+        
+        // Snapshot the camera matrices now, as the manipulator changes them later
+        osg::Matrixd windowMatrix = camera->getViewMatrix() * camera->getProjectionMatrix() *
+                                    camera->getViewport()->computeWindowMatrix();
+        osg::Matrixd inverse = osg::Matrixd::inverse( windowMatrix );
+        
+        HoverRequest request;
+        request.scene = scene;
+        request.start = osg::Vec3d(x, y, 0.0) * inverse;
+        request.end = osg::Vec3d(x, y, 1.0) * inverse;
+        request.tick = osg::Timer::instance()->tick();
+        
+        // Moves arriving while the worker is busy replace each other; only the latest is picked
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _hoverMutex );
+        _pendingRequest = request;
+        _hasPendingRequest = true;
+    }
+    
+    void PickHandler::updateHoverPicks()
+    {
+        osg::ref_ptr<HoverSnapshot> finished;
+        HoverRequest request;
+        bool startWorker = false;
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _hoverMutex );
+            finished.swap( _finishedSnapshot );
+            if ( _hasPendingRequest && !_workerRunning )
+            {
+                request = _pendingRequest;
+                _pendingRequest.scene = NULL;
+                _hasPendingRequest = false;
+                _workerRunning = true;
+                startWorker = true;
+            }
+        }
+        
+        if ( finished.valid() ) deliverHoverResult( finished.get() );
+        if ( startWorker )
+            ThreadPool::instance()->add( new HoverPickOperation(this, createHoverSnapshot(request)) );
+    }
+    
+    PickHandler::HoverSnapshot* PickHandler::createHoverSnapshot( const HoverRequest& request ) const
+    {
+        osg::ref_ptr<HoverSnapshot> snapshot = new HoverSnapshot;
+        snapshot->start = request.start;
+        snapshot->end = request.end;
+        snapshot->tick = request.tick;
+        
+        // Only subgraphs whose bounds touch the segment are visited and copied
+        CollectHoverItemsVisitor chiv( snapshot.get() );
+        request.scene->accept( chiv );
+        return snapshot.release();
+    }
+    
+    void PickHandler::runHoverPick( HoverSnapshot* snapshot )
+    {
+        std::vector<HoverSnapshot::Item>& items = snapshot->items;
+        ThreadPool::instance()->parallelFor( 0, items.size(), [&items]( unsigned int first, unsigned int last )
+            {
+                for ( unsigned int i=first; i<last; ++i )
+                {
+                    HoverSnapshot::Item& item = items[i];
+                    osg::Geometry* geometry = item.drawable->asGeometry();
+                    if ( item.refitTree )
+                        static_cast<PickKdTree*>( geometry->getShape() )->refit( geometry );
+                    else if ( item.buildTree )
+                    {
+                        osg::ref_ptr<PickKdTree> tree = new PickKdTree;
+                        if ( tree->build(geometry) )
+                        {
+                            geometry->setShape( tree.get() );
+                            item.builtTree = tree;
+                        }
+                    }
+                }
+            } );
+        
+        osg::ref_ptr<osgUtil::LineSegmentIntersector> intersector =
+            new osgUtil::LineSegmentIntersector(osgUtil::Intersector::MODEL, snapshot->start, snapshot->end);
+        SnapshotIntersectionVisitor siv( intersector.get() );
+        for ( unsigned int i=0; i<items.size(); ++i )
+            siv.intersectItem( items[i] );
+        
+        // Report the drawable of the scene rather than its copy; a miss leaves it empty
+        if ( intersector->containsIntersections() )
+        {
+            snapshot->result = *(intersector->getIntersections().begin());
+            snapshot->result.drawable = snapshot->result.nodePath.empty() ? NULL :
+                                        snapshot->result.nodePath.back()->asDrawable();
+        }
+        
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _hoverMutex );
+        _finishedSnapshot = snapshot;
+        _workerRunning = false;
+    }
+    
+    void PickHandler::deliverHoverResult( HoverSnapshot* snapshot )
+    {
+        // Trees built for the pick are kept, unless the geometry changed meanwhile
+        for ( unsigned int i=0; i<snapshot->items.size(); ++i )
+        {
+            const HoverSnapshot::Item& item = snapshot->items[i];
+            osg::Geometry* geometry = item.path.back()->asGeometry();
+            PickKdTree* tree = item.builtTree.get();
+            if ( !tree || !geometry || tree->needsRebuild(geometry) || tree->isDirty(geometry) ) continue;
+            
+            PickKdTree* oldTree = dynamic_cast<PickKdTree*>( geometry->getShape() );
+            if ( !geometry->getShape() || (oldTree && oldTree->needsRebuild(geometry)) )
+                geometry->setShape( tree );
+        }
+        
+        _lastPickLatency = osg::Timer::instance()->delta_m( snapshot->tick, osg::Timer::instance()->tick() );
+        _totalPickLatency += _lastPickLatency;
+        ++_numHoverPicks;
+        OSG_DEBUG << "Hover pick latency: " << _lastPickLatency << "ms" << std::endl;
+        doUserOperations( snapshot->result );
+    }
+    
+    void PickHandler::preparePickAccelerators( osg::Node* scene )
+    {
+        // The scene is only traversed when it is new or was dirtied; the trees of DYNAMIC
+        // geometries are tracked on their own and refitted if their vertices moved
+        if ( scene!=_acceleratedScene.get() || _pickAcceleratorsDirty )
+        {
+            buildPickAccelerators( scene );
+            _acceleratedScene = scene;
+            _pickAcceleratorsDirty = false;
+        }
+        refitPickAccelerators();
+    }
 
 }
@@ -0,0 +1,303 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Headless frame benchmark
+*/
+
+#include <osg/AnimationPath>
+#include <osg/Notify>
+#include <osg/Timer>
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+
+#include "FrameBenchmark"
+
+namespace osgCookBook
+{
+
+    struct FrameTimings
+    {
+        FrameTimings() : event(0.0), update(0.0), cull(0.0), draw(0.0), frame(0.0) {}
+        double event, update, cull, draw, frame;
+    };
+
+    static int getEnvInt( const char* name, int defaultValue )
+    {
+        const char* value = getenv( name );
+        return (value && *value) ? atoi(value) : defaultValue;
+    }
+
+    static std::string getEnvString( const char* name, const std::string& defaultValue )
+    {
+        const char* value = getenv( name );
+        return (value && *value) ? std::string(value) : defaultValue;
+    }
+
+    static osg::GraphicsContext* createPbuffer( int width, int height )
+    {
+        osg::ref_ptr<osg::GraphicsContext::Traits> traits = new osg::GraphicsContext::Traits;
+        traits->readDISPLAY();
+        traits->setUndefinedScreenDetailsToDefaultScreen();
+        traits->x = 0;
+        traits->y = 0;
+        traits->width = width;
+        traits->height = height;
+        traits->windowDecoration = false;
+        traits->doubleBuffer = false;
+        traits->pbuffer = true;
+        traits->sharedContext = 0;
+        return osg::GraphicsContext::createGraphicsContext( traits.get() );
+    }
+
+    static bool setUpHeadlessCamera( osg::Camera* camera, osg::ref_ptr<osg::GraphicsContext>& pbuffer,
+                                     int width, int height )
+    {
+        // Cameras which already own a context (multi-screen and power-wall slaves)
+        // are left as they are; they render into hidden windows under Xvfb
+        if ( camera->getGraphicsContext() ) return true;
+        if ( !pbuffer )
+        {
+            pbuffer = createPbuffer( width, height );
+            if ( !pbuffer ) return false;
+        }
+
+        camera->setGraphicsContext( pbuffer.get() );
+        camera->setViewport( 0, 0, width, height );
+        camera->setProjectionMatrixAsPerspective(
+            30.0f, static_cast<double>(width)/static_cast<double>(height), 1.0f, 10000.0f );
+        camera->setDrawBuffer( GL_FRONT );
+        camera->setReadBuffer( GL_FRONT );
+        return true;
+    }
+
+    static double computePercentile( const std::vector<double>& sorted, double percent )
+    {
+        if ( sorted.empty() ) return 0.0;
+        unsigned int rank = (unsigned int)( percent * 0.01 * (double)(sorted.size() - 1) + 0.5 );
+        return sorted[osg::minimum(rank, (unsigned int)sorted.size() - 1)];
+    }
+
+    static void writePhase( std::ostream& os, const std::string& name, std::vector<double> values, bool last )
+    {
+        std::sort( values.begin(), values.end() );
+        double sum = 0.0;
+        for ( unsigned int i=0; i<values.size(); ++i ) sum += values[i];
+
+        os << "    \"" << name << "\": { "
+           << "\"mean\": " << (values.empty() ? 0.0 : sum / (double)values.size()) << ", "
+           << "\"min\": " << (values.empty() ? 0.0 : values.front()) << ", "
+           << "\"p50\": " << computePercentile(values, 50.0) << ", "
+           << "\"p90\": " << computePercentile(values, 90.0) << ", "
+           << "\"p95\": " << computePercentile(values, 95.0) << ", "
+           << "\"p99\": " << computePercentile(values, 99.0) << ", "
+           << "\"max\": " << (values.empty() ? 0.0 : values.back()) << " }"
+           << (last ? "\n" : ",\n");
+    }
+
+    static bool writeReport( const std::string& file, const std::string& name, int width, int height,
+                             const std::vector<FrameTimings>& frames )
+    {
+        std::ofstream os( file.c_str() );
+        if ( !os ) return false;
+
+        std::vector<double> event, update, cull, draw, frame;
+        for ( unsigned int i=0; i<frames.size(); ++i )
+        {
+            event.push_back( frames[i].event );
+            update.push_back( frames[i].update );
+            cull.push_back( frames[i].cull );
+            draw.push_back( frames[i].draw );
+            frame.push_back( frames[i].frame );
+        }
+
+        os << std::fixed << std::setprecision(4);
+        os << "{\n"
+           << "  \"name\": \"" << name << "\",\n"
+           << "  \"width\": " << width << ",\n"
+           << "  \"height\": " << height << ",\n"
+           << "  \"frames\": " << frames.size() << ",\n"
+           << "  \"unit\": \"ms\",\n"
+           << "  \"summary\": {\n";
+        writePhase( os, "event", event, false );
+        writePhase( os, "update", update, false );
+        writePhase( os, "cull", cull, false );
+        writePhase( os, "draw", draw, false );
+        writePhase( os, "frame", frame, true );
+        os << "  },\n"
+           << "  \"samples\": [\n";
+        for ( unsigned int i=0; i<frames.size(); ++i )
+        {
+            const FrameTimings& ft = frames[i];
+            os << "    { \"event\": " << ft.event << ", \"update\": " << ft.update
+               << ", \"cull\": " << ft.cull << ", \"draw\": " << ft.draw
+               << ", \"frame\": " << ft.frame << " }"
+               << (i+1<frames.size() ? ",\n" : "\n");
+        }
+        os << "  ]\n"
+           << "}\n";
+        return true;
+    }
+
+    /** Views without a fixed camera follow the benchmark path. Manipulators installed
+        by the example itself are only overridden by an explicitly recorded path. */
+    static bool isDrivenView( osgViewer::View* view, bool isComposite, bool hasRecordedPath )
+    {
+        if ( view->getCameraManipulator() ) return hasRecordedPath;
+        return !isComposite;
+    }
+
+    static int runFrames( osgViewer::ViewerBase& viewer, const std::vector<osgViewer::View*>& views,
+                          bool isComposite )
+    {
+        int numFrames = getEnvInt( "OSG_COOKBOOK_BENCHMARK", 0 );
+        int numWarmup = getEnvInt( "OSG_COOKBOOK_BENCHMARK_WARMUP", 10 );
+        int width = getEnvInt( "OSG_COOKBOOK_BENCHMARK_WIDTH", 1280 );
+        int height = getEnvInt( "OSG_COOKBOOK_BENCHMARK_HEIGHT", 720 );
+        std::string pathFile = getEnvString( "OSG_COOKBOOK_BENCHMARK_PATH", "" );
+        std::string outputFile = getEnvString( "OSG_COOKBOOK_BENCHMARK_OUTPUT", "benchmark.json" );
+        std::string name = getEnvString( "OSG_COOKBOOK_BENCHMARK_NAME", "osgExample" );
+        if ( numFrames<=0 || views.empty() ) return 1;
+
+        osg::ref_ptr<osg::AnimationPath> path;
+        if ( !pathFile.empty() )
+        {
+            std::ifstream is( pathFile.c_str() );
+            path = new osg::AnimationPath;
+            if ( is ) path->read( is );
+            if ( path->empty() )
+            {
+                OSG_WARN << "Benchmark: can't read camera path " << pathFile << std::endl;
+                return 1;
+            }
+        }
+
+        // Stats of frame N must be complete when frame() returns
+        viewer.setThreadingModel( osgViewer::ViewerBase::SingleThreaded );
+
+        osg::ref_ptr<osg::GraphicsContext> pbuffer;
+        for ( unsigned int i=0; i<views.size(); ++i )
+        {
+            osgViewer::View* view = views[i];
+            bool ok = setUpHeadlessCamera( view->getCamera(), pbuffer, width, height );
+            for ( unsigned int j=0; ok && j<view->getNumSlaves(); ++j )
+                ok = setUpHeadlessCamera( view->getSlave(j)._camera.get(), pbuffer, width, height );
+            if ( !ok )
+            {
+                OSG_WARN << "Benchmark: can't create an offscreen pbuffer" << std::endl;
+                return 1;
+            }
+        }
+
+        viewer.realize();
+        if ( !viewer.isRealized() ) return 1;
+
+        osgViewer::ViewerBase::Cameras cameras;
+        viewer.getCameras( cameras );
+        for ( unsigned int i=0; i<cameras.size(); ++i )
+        {
+            if ( !cameras[i]->getStats() ) cameras[i]->setStats( new osg::Stats("Camera") );
+            cameras[i]->getStats()->collectStats( "rendering", true );
+        }
+
+        osg::Stats* viewerStats = viewer.getViewerStats();
+        viewerStats->collectStats( "event", true );
+        viewerStats->collectStats( "update", true );
+
+        std::vector<FrameTimings> frames;
+        osg::Timer timer;
+        for ( int i=0; i<numWarmup+numFrames; ++i )
+        {
+            double t = (double)osg::maximum(i - numWarmup, 0) / (double)osg::maximum(numFrames - 1, 1);
+            osg::Timer_t startTick = timer.tick();
+
+            // Fixed time steps keep animation callbacks deterministic between runs
+            viewer.advance( (double)i / 60.0 );
+            viewer.eventTraversal();
+            viewer.updateTraversal();
+
+            for ( unsigned int v=0; v<views.size(); ++v )
+            {
+                osgViewer::View* view = views[v];
+                if ( !isDrivenView(view, isComposite, path.valid()) ) continue;
+
+                osg::Matrixd viewMatrix;
+                if ( path.valid() )
+                {
+                    path->getInverse( path->getFirstTime() + t * path->getPeriod(), viewMatrix );
+                }
+                else if ( view->getSceneData() )
+                {
+                    // Default path: one orbit around the scene bound
+                    const osg::BoundingSphere& bs = view->getSceneData()->getBound();
+                    double angle = t * 2.0 * osg::PI;
+                    osg::Vec3d eye = bs.center() +
+                        osg::Vec3d(sin(angle), -cos(angle), 0.3) * bs.radius() * 2.5;
+                    viewMatrix = osg::Matrixd::lookAt( eye, bs.center(), osg::Z_AXIS );
+                }
+                view->getCamera()->setViewMatrix( viewMatrix );
+            }
+            viewer.renderingTraversals();
+
+            if ( i<numWarmup ) continue;
+            FrameTimings ft;
+            ft.frame = timer.delta_m( startTick, timer.tick() );
+
+            unsigned int frameNumber = viewer.getViewerFrameStamp()->getFrameNumber();
+            double value = 0.0;
+            if ( viewerStats->getAttribute(frameNumber, "Event traversal time taken", value) )
+                ft.event = value * 1000.0;
+            if ( viewerStats->getAttribute(frameNumber, "Update traversal time taken", value) )
+                ft.update = value * 1000.0;
+            for ( unsigned int c=0; c<cameras.size(); ++c )
+            {
+                osg::Stats* stats = cameras[c]->getStats();
+                if ( stats->getAttribute(frameNumber, "Cull traversal time taken", value) )
+                    ft.cull += value * 1000.0;
+                if ( stats->getAttribute(frameNumber, "Draw traversal time taken", value) )
+                    ft.draw += value * 1000.0;
+            }
+            frames.push_back( ft );
+        }
+
+        if ( !writeReport(outputFile, name, width, height, frames) )
+        {
+            OSG_WARN << "Benchmark: can't write report " << outputFile << std::endl;
+            return 1;
+        }
+        OSG_NOTICE << "Benchmark: " << frames.size() << " frames written to " << outputFile << std::endl;
+        return 0;
+    }
+
+    bool isBenchmarkRequested()
+    {
+        return getEnvInt( "OSG_COOKBOOK_BENCHMARK", 0 )>0;
+    }
+
+    int runBenchmark( osgViewer::Viewer& viewer )
+    {
+        std::vector<osgViewer::View*> views;
+        views.push_back( &viewer );
+        return runFrames( viewer, views, false );
+    }
+
+    int runBenchmark( osgViewer::CompositeViewer& viewer )
+    {
+        std::vector<osgViewer::View*> views;
+        for ( unsigned int i=0; i<viewer.getNumViews(); ++i )
+            views.push_back( viewer.getView(i) );
+        return runFrames( viewer, views, true );
+    }
+
+    int runViewer( osgViewer::Viewer& viewer )
+    {
+        if ( isBenchmarkRequested() ) return runBenchmark( viewer );
+        return viewer.run();
+    }
+
+    int runViewer( osgViewer::CompositeViewer& viewer )
+    {
+        if ( isBenchmarkRequested() ) return runBenchmark( viewer );
+        return viewer.run();
+    }
+
+}
@@ -0,0 +1,120 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Highlighting drawables in an overlay pass
+*/
+
+#include <osg/BlendFunc>
+#include <osg/Depth>
+#include <osg/PolygonOffset>
+#include <osg/Program>
+#include <osgUtil/CullVisitor>
+
+#include "HighlightOverlay"
+
+namespace osgCookBook
+{
+
+    static const char* highlightVertCode = {
+        "void main()\n"
+        "{\n"
+        "   gl_Position = ftransform();\n"
+        "}\n"
+    };
+
+    static const char* highlightFragCode = {
+        "uniform vec4 highlightColor;\n"
+        "void main()\n"
+        "{\n"
+        "   gl_FragColor = highlightColor;\n"
+        "}\n"
+    };
+
+    HighlightOverlay::HighlightOverlay()
+    :   _color(1.0f, 0.0f, 0.0f, 0.5f)
+    {
+        // The overlay has no bound of its own; the highlighted drawables are culled one by one
+        setCullingActive( false );
+
+        osg::ref_ptr<osg::Program> program = new osg::Program;
+        program->addShader( new osg::Shader(osg::Shader::VERTEX, highlightVertCode) );
+        program->addShader( new osg::Shader(osg::Shader::FRAGMENT, highlightFragCode) );
+
+        // Drawn on top of the surfaces already in the depth buffer, after transparent ones
+        osg::StateAttribute::GLModeValue values = osg::StateAttribute::ON|osg::StateAttribute::OVERRIDE;
+        osg::StateSet* ss = getOrCreateStateSet();
+        ss->setAttributeAndModes( program.get(), values );
+        ss->setAttributeAndModes( new osg::BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA), values );
+        ss->setAttributeAndModes( new osg::Depth(osg::Depth::LEQUAL, 0.0, 1.0, false), values );
+        ss->setAttributeAndModes( new osg::PolygonOffset(-1.0f, -1.0f), values );
+        ss->setMode( GL_LIGHTING, osg::StateAttribute::OFF|osg::StateAttribute::OVERRIDE );
+        ss->setRenderBinDetails( 20, "DepthSortedBin", osg::StateSet::OVERRIDE_RENDERBIN_DETAILS );
+        ss->addUniform( new osg::Uniform("highlightColor", _color) );
+    }
+
+    HighlightOverlay::HighlightOverlay( const HighlightOverlay& copy, const osg::CopyOp& copyop )
+    :   osg::Node(copy, copyop), _highlights(copy._highlights), _color(copy._color)
+    {
+    }
+
+    void HighlightOverlay::setColor( const osg::Vec4& color )
+    {
+        _color = color;
+        getOrCreateStateSet()->getOrCreateUniform("highlightColor", osg::Uniform::FLOAT_VEC4)->set( color );
+    }
+
+    void HighlightOverlay::addHighlight( osg::Drawable* drawable )
+    {
+        if ( !drawable ) return;
+
+        // Entries of deleted drawables are dropped here, as the cull traversal can't change the map
+        for ( HighlightMap::iterator itr=_highlights.begin(); itr!=_highlights.end(); )
+        {
+            if ( !itr->second.drawable.valid() ) _highlights.erase( itr++ );
+            else ++itr;
+        }
+
+        Highlight& highlight = _highlights[drawable];
+        highlight.drawable = drawable;
+        highlight.paths.clear();
+
+        osg::NodePathList paths = drawable->getParentalNodePaths();
+        for ( unsigned int i=0; i<paths.size(); ++i )
+            highlight.paths.push_back( osg::ObserverNodePath(paths[i]) );
+    }
+
+    void HighlightOverlay::removeHighlight( osg::Drawable* drawable )
+    {
+        _highlights.erase( drawable );
+    }
+
+    void HighlightOverlay::removeAllHighlights()
+    {
+        _highlights.clear();
+    }
+
+    void HighlightOverlay::traverse( osg::NodeVisitor& nv )
+    {
+        osgUtil::CullVisitor* cv = dynamic_cast<osgUtil::CullVisitor*>( &nv );
+        if ( !cv || _highlights.empty() ) return;
+
+        osg::Matrix view = *cv->getModelViewMatrix();
+        for ( HighlightMap::const_iterator itr=_highlights.begin(); itr!=_highlights.end(); ++itr )
+        {
+            osg::ref_ptr<osg::Drawable> drawable;
+            if ( !itr->second.drawable.lock(drawable) ) continue;
+
+            const std::vector<osg::ObserverNodePath>& paths = itr->second.paths;
+            for ( unsigned int i=0; i<paths.size(); ++i )
+            {
+                osg::NodePath path;
+                if ( !paths[i].getNodePath(path) ) continue;
+
+                // The drawable itself is culled with its own state, under the overlay state
+                osg::ref_ptr<osg::RefMatrix> matrix = cv->createOrReuseMatrix( osg::computeLocalToWorld(path) * view );
+                cv->pushModelViewMatrix( matrix.get(), osg::Transform::RELATIVE_RF );
+                drawable->accept( *cv );
+                cv->popModelViewMatrix();
+            }
+        }
+    }
+
+}
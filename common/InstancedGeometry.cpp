@@ -0,0 +1,750 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Instanced geometry with per-instance attributes
+*/
+
+#include <osg/BufferObject>
+#include <osg/GLExtensions>
+#include <osg/Notify>
+#include <osg/Polytope>
+#include <osg/State>
+#include <osg/Version>
+
+// Instance arrays are set up through osg::VertexArrayState and State::get<GLExtensions>()
+#if OSG_VERSION_LESS_THAN(3,5,6)
+#error "InstancedGeometry needs OpenSceneGraph 3.5.6 or later"
+#endif
+
+#include "InstancedGeometry"
+#include "ThreadPool"
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define COOKBOOK_INSTANCE_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+    #include <emmintrin.h>
+    #define COOKBOOK_INSTANCE_SSE
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #include <arm_neon.h>
+    #define COOKBOOK_INSTANCE_NEON
+#endif
+
+namespace osgCookBook
+{
+
+    /* With the PICKING define of an ID pass, the color carries the object ID, no primitive,
+       the position of the instance in the dense list and the eye depth instead. Instances
+       are then drawn from their chunks, with pickInstanceBase at the first slot of each. */
+    static const char* instanceVertSource = {
+        "#pragma import_defines ( PICKING )\n"
+        "#ifdef PICKING\n"
+        "#extension GL_ARB_draw_instanced : enable\n"
+        "uniform float pickObjectId;\n"
+        "uniform int pickInstanceBase;\n"
+        "#endif\n"
+        "attribute vec4 instanceMatrix0;\n"
+        "attribute vec4 instanceMatrix1;\n"
+        "attribute vec4 instanceMatrix2;\n"
+        "attribute vec4 instanceColor;\n"
+        "void main(void)\n"
+        "{\n"
+        "   vec4 vertex = vec4(dot(gl_Vertex, instanceMatrix0), dot(gl_Vertex, instanceMatrix1),\n"
+        "                      dot(gl_Vertex, instanceMatrix2), 1.0);\n"
+        "   vec3 normal = vec3(dot(gl_Normal, instanceMatrix0.xyz), dot(gl_Normal, instanceMatrix1.xyz),\n"
+        "                      dot(gl_Normal, instanceMatrix2.xyz));\n"
+        "   normal = normalize(gl_NormalMatrix * normal);\n"
+        "   float diffuse = max(dot(normal, normalize(gl_LightSource[0].position.xyz)), 0.0);\n"
+        "   vec4 light = gl_FrontLightModelProduct.sceneColor + gl_FrontLightProduct[0].ambient +\n"
+        "                gl_FrontLightProduct[0].diffuse * diffuse;\n"
+        "   vec4 color = gl_Color * instanceColor;\n"
+        "   gl_FrontColor = vec4(color.rgb * light.rgb, color.a * gl_FrontMaterial.diffuse.a);\n"
+        "#ifdef PICKING\n"
+        "   gl_FrontColor = vec4(pickObjectId, -1.0, float(pickInstanceBase + gl_InstanceIDARB),\n"
+        "                        -(gl_ModelViewMatrix * vertex).z);\n"
+        "#endif\n"
+        "   gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;\n"
+        "   gl_Position = gl_ModelViewProjectionMatrix * vertex;\n"
+        "}\n"
+    };
+
+    static osg::Program* createDefaultProgram()
+    {
+        unsigned int location = InstancedGeometry::getAttributeLocation();
+        osg::ref_ptr<osg::Program> program = new osg::Program;
+        program->addShader( new osg::Shader(osg::Shader::VERTEX, instanceVertSource) );
+        program->addBindAttribLocation( "instanceMatrix0", location );
+        program->addBindAttribLocation( "instanceMatrix1", location + 1 );
+        program->addBindAttribLocation( "instanceMatrix2", location + 2 );
+        program->addBindAttribLocation( "instanceColor", location + 3 );
+        return program.release();
+    }
+
+    static inline osg::Vec4ub toColor( const osg::Vec4& color )
+    {
+        return osg::Vec4ub( (unsigned char)(osg::clampBetween(color.r(), 0.0f, 1.0f) * 255.0f + 0.5f),
+                            (unsigned char)(osg::clampBetween(color.g(), 0.0f, 1.0f) * 255.0f + 0.5f),
+                            (unsigned char)(osg::clampBetween(color.b(), 0.0f, 1.0f) * 255.0f + 0.5f),
+                            (unsigned char)(osg::clampBetween(color.a(), 0.0f, 1.0f) * 255.0f + 0.5f) );
+    }
+
+    /* Write the indices of the boxes (center x, y, z, half size hx, hy, hz) that are at
+       least partly on the positive side of all planes (a, b, c, d), i.e.
+       a*x + b*y + c*z + d + |a|*hx + |b|*hy + |c|*hz > 0, and return their number. */
+    static unsigned int cullBoxes( const float* const box[6], unsigned int n,
+                                   const std::vector<osg::Vec4>& planes, unsigned int* visible )
+    {
+        unsigned int numPlanes = planes.size(), count = 0, i = 0;
+        std::vector<osg::Vec3> absNormals( numPlanes );
+        for ( unsigned int p=0; p<numPlanes; ++p )
+            absNormals[p].set( fabs(planes[p][0]), fabs(planes[p][1]), fabs(planes[p][2]) );
+#if defined(COOKBOOK_INSTANCE_AVX)
+        for ( ; i+8<=n; i+=8 )
+        {
+            __m256 x = _mm256_loadu_ps(box[0] + i), y = _mm256_loadu_ps(box[1] + i), z = _mm256_loadu_ps(box[2] + i);
+            __m256 hx = _mm256_loadu_ps(box[3] + i), hy = _mm256_loadu_ps(box[4] + i), hz = _mm256_loadu_ps(box[5] + i);
+            __m256 inside = _mm256_castsi256_ps( _mm256_set1_epi32(-1) );
+            for ( unsigned int p=0; p<numPlanes; ++p )
+            {
+                const osg::Vec4& plane = planes[p];
+                const osg::Vec3& a = absNormals[p];
+                __m256 d = _mm256_add_ps( _mm256_mul_ps(x, _mm256_set1_ps(plane[0])), _mm256_set1_ps(plane[3]) );
+                d = _mm256_add_ps( d, _mm256_mul_ps(y, _mm256_set1_ps(plane[1])) );
+                d = _mm256_add_ps( d, _mm256_mul_ps(z, _mm256_set1_ps(plane[2])) );
+                __m256 e = _mm256_add_ps( _mm256_mul_ps(hx, _mm256_set1_ps(a[0])), _mm256_mul_ps(hy, _mm256_set1_ps(a[1])) );
+                e = _mm256_add_ps( e, _mm256_mul_ps(hz, _mm256_set1_ps(a[2])) );
+                inside = _mm256_and_ps( inside, _mm256_cmp_ps(_mm256_add_ps(d, e), _mm256_setzero_ps(), _CMP_GT_OQ) );
+            }
+
+            int mask = _mm256_movemask_ps( inside );
+            for ( unsigned int b=0; mask; ++b, mask>>=1 )
+            {
+                if ( mask & 1 ) visible[count++] = i + b;
+            }
+        }
+#elif defined(COOKBOOK_INSTANCE_SSE)
+        for ( ; i+4<=n; i+=4 )
+        {
+            __m128 x = _mm_loadu_ps(box[0] + i), y = _mm_loadu_ps(box[1] + i), z = _mm_loadu_ps(box[2] + i);
+            __m128 hx = _mm_loadu_ps(box[3] + i), hy = _mm_loadu_ps(box[4] + i), hz = _mm_loadu_ps(box[5] + i);
+            __m128 inside = _mm_castsi128_ps( _mm_set1_epi32(-1) );
+            for ( unsigned int p=0; p<numPlanes; ++p )
+            {
+                const osg::Vec4& plane = planes[p];
+                const osg::Vec3& a = absNormals[p];
+                __m128 d = _mm_add_ps( _mm_mul_ps(x, _mm_set1_ps(plane[0])), _mm_set1_ps(plane[3]) );
+                d = _mm_add_ps( d, _mm_mul_ps(y, _mm_set1_ps(plane[1])) );
+                d = _mm_add_ps( d, _mm_mul_ps(z, _mm_set1_ps(plane[2])) );
+                __m128 e = _mm_add_ps( _mm_mul_ps(hx, _mm_set1_ps(a[0])), _mm_mul_ps(hy, _mm_set1_ps(a[1])) );
+                e = _mm_add_ps( e, _mm_mul_ps(hz, _mm_set1_ps(a[2])) );
+                inside = _mm_and_ps( inside, _mm_cmpgt_ps(_mm_add_ps(d, e), _mm_setzero_ps()) );
+            }
+
+            int mask = _mm_movemask_ps( inside );
+            for ( unsigned int b=0; mask; ++b, mask>>=1 )
+            {
+                if ( mask & 1 ) visible[count++] = i + b;
+            }
+        }
+#elif defined(COOKBOOK_INSTANCE_NEON)
+        for ( ; i+4<=n; i+=4 )
+        {
+            float32x4_t x = vld1q_f32(box[0] + i), y = vld1q_f32(box[1] + i), z = vld1q_f32(box[2] + i);
+            float32x4_t hx = vld1q_f32(box[3] + i), hy = vld1q_f32(box[4] + i), hz = vld1q_f32(box[5] + i);
+            uint32x4_t inside = vdupq_n_u32( 0xffffffffu );
+            for ( unsigned int p=0; p<numPlanes; ++p )
+            {
+                const osg::Vec4& plane = planes[p];
+                const osg::Vec3& a = absNormals[p];
+                float32x4_t d = vaddq_f32( vmulq_n_f32(x, plane[0]), vdupq_n_f32(plane[3]) );
+                d = vaddq_f32( d, vmulq_n_f32(y, plane[1]) );
+                d = vaddq_f32( d, vmulq_n_f32(z, plane[2]) );
+                float32x4_t e = vaddq_f32( vmulq_n_f32(hx, a[0]), vmulq_n_f32(hy, a[1]) );
+                e = vaddq_f32( e, vmulq_n_f32(hz, a[2]) );
+                inside = vandq_u32( inside, vcgtq_f32(vaddq_f32(d, e), vdupq_n_f32(0.0f)) );
+            }
+
+            unsigned int lanes[4];
+            vst1q_u32( lanes, inside );
+            for ( unsigned int b=0; b<4; ++b )
+            {
+                if ( lanes[b] ) visible[count++] = i + b;
+            }
+        }
+#endif
+        for ( ; i<n; ++i )
+        {
+            bool inside = true;
+            for ( unsigned int p=0; p<numPlanes && inside; ++p )
+            {
+                const osg::Vec4& plane = planes[p];
+                const osg::Vec3& a = absNormals[p];
+                float d = (box[0][i] * plane[0] + plane[3]) + box[1][i] * plane[1] + box[2][i] * plane[2];
+                float e = (box[3][i] * a[0] + box[4][i] * a[1]) + box[5][i] * a[2];
+                inside = d + e > 0.0f;
+            }
+            if ( inside ) visible[count++] = i;
+        }
+        return count;
+    }
+
+    class InstancedGeometryUpdateCallback : public osg::Drawable::UpdateCallback
+    {
+    public:
+        virtual void update( osg::NodeVisitor* nv, osg::Drawable* drawable )
+        {
+            // Let the nested callback move instances first, so their bounds are tight this frame
+            osg::Callback* nested = getNestedCallback();
+            if ( nested ) nested->run( drawable, nv );
+            static_cast<InstancedGeometry*>( drawable )->updateBounds();
+        }
+    };
+
+    InstancedGeometry::InstancedGeometry()
+    :   _instanceCulling(true)
+    {
+        initialize();
+    }
+
+    InstancedGeometry::InstancedGeometry( const osg::Geometry& mesh, const osg::CopyOp& copyop )
+    :   osg::Geometry(mesh, copyop), _instanceCulling(true)
+    {
+        initialize();
+    }
+
+    InstancedGeometry::InstancedGeometry( const InstancedGeometry& copy, const osg::CopyOp& copyop )
+    :   osg::Geometry(copy, copyop), _chunks(copy._chunks),
+        _idSlots(copy._idSlots), _slotIDs(copy._slotIDs), _freeIDs(copy._freeIDs),
+        _looseChunks(copy._looseChunks),
+        _meshBound(copy._meshBound), _instanceCulling(copy._instanceCulling)
+    {
+        // Chunks own their buffers, so the copy can't share them
+        for ( unsigned int c=0; c<_chunks.size(); ++c )
+        {
+            Chunk& chunk = _chunks[c];
+            osg::ref_ptr<osg::VertexBufferObject> vbo = new osg::VertexBufferObject;
+            vbo->setUsage( GL_DYNAMIC_DRAW_ARB );
+            for ( unsigned int i=0; i<3; ++i )
+            {
+                chunk.matrices[i] = new osg::Vec4Array( *chunk.matrices[i] );
+                chunk.matrices[i]->setVertexBufferObject( vbo.get() );
+            }
+            chunk.colors = new osg::Vec4ubArray( *chunk.colors );
+            chunk.colors->setVertexBufferObject( vbo.get() );
+        }
+    }
+
+    void InstancedGeometry::initialize()
+    {
+        // Instances are changed in the update traversal while they may still be drawn
+        setDataVariance( osg::Object::DYNAMIC );
+        setUseDisplayList( false );
+        setUseVertexBufferObjects( true );
+        setUseVertexArrayObject( false );
+        setUpdateCallback( new InstancedGeometryUpdateCallback );
+
+        // The shader multiplies by the mesh color, which fixed function lighting ignores
+        if ( !getColorArray() )
+        {
+            osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array;
+            colors->push_back( osg::Vec4(1.0f, 1.0f, 1.0f, 1.0f) );
+            setColorArray( colors.get(), osg::Array::BIND_OVERALL );
+        }
+
+        // Don't put the program into a state set shared with the original mesh. Only the
+        // program places the instances, so keep passes like shadow casting from replacing it
+        osg::ref_ptr<osg::StateSet> ss = getStateSet() ?
+            new osg::StateSet(*getStateSet(), osg::CopyOp::SHALLOW_COPY) : new osg::StateSet;
+        ss->setAttributeAndModes( getDefaultProgram(), osg::StateAttribute::ON|osg::StateAttribute::PROTECTED );
+        setStateSet( ss.get() );
+        _meshBound = osg::Geometry::computeBoundingBox();
+    }
+
+    osg::Program* InstancedGeometry::getDefaultProgram()
+    {
+        static osg::ref_ptr<osg::Program> s_program = createDefaultProgram();
+        return s_program.get();
+    }
+
+    unsigned int InstancedGeometry::addInstance( const osg::Matrix& matrix, const osg::Vec4& color )
+    {
+        unsigned int id = _idSlots.size();
+        if ( !_freeIDs.empty() )
+        {
+            id = _freeIDs.back();
+            _freeIDs.pop_back();
+        }
+        else
+            _idSlots.push_back( ~0u );
+
+        unsigned int slot = _slotIDs.size();
+        if ( slot==_chunks.size() * CHUNK_SIZE )
+        {
+            Chunk chunk;
+            osg::ref_ptr<osg::VertexBufferObject> vbo = new osg::VertexBufferObject;
+            vbo->setUsage( GL_DYNAMIC_DRAW_ARB );
+            for ( unsigned int i=0; i<3; ++i )
+            {
+                chunk.matrices[i] = new osg::Vec4Array( CHUNK_SIZE );
+                chunk.matrices[i]->setVertexBufferObject( vbo.get() );
+            }
+            chunk.colors = new osg::Vec4ubArray( CHUNK_SIZE );
+            chunk.colors->setNormalize( true );
+            chunk.colors->setVertexBufferObject( vbo.get() );
+            chunk.boxes.resize( CHUNK_SIZE * 6 );
+            chunk.count = 0;
+            chunk.loose = false;
+            _chunks.push_back( chunk );
+        }
+
+        _idSlots[id] = slot;
+        _slotIDs.push_back( id );
+        Chunk& chunk = getChunk( slot );
+        chunk.count++;
+        (*chunk.colors)[slot % CHUNK_SIZE] = toColor( color );
+        chunk.colors->dirty();
+        writeMatrix( slot, matrix );
+        return id;
+    }
+
+    void InstancedGeometry::removeInstance( unsigned int id )
+    {
+        if ( id>=_idSlots.size() || _idSlots[id]==~0u ) return;
+
+        // Move the last instance into the hole, so the list stays dense
+        unsigned int slot = _idSlots[id], last = _slotIDs.size() - 1;
+        markLoose( slot );
+        markLoose( last );
+        if ( slot!=last )
+        {
+            const Chunk& from = getChunk( last );
+            Chunk& to = getChunk( slot );
+            unsigned int f = last % CHUNK_SIZE, t = slot % CHUNK_SIZE;
+            for ( unsigned int i=0; i<3; ++i )
+            {
+                (*to.matrices[i])[t] = (*from.matrices[i])[f];
+                to.matrices[i]->dirty();
+            }
+            (*to.colors)[t] = (*from.colors)[f];
+            to.colors->dirty();
+            for ( unsigned int i=0; i<6; ++i )
+                to.boxes[CHUNK_SIZE * i + t] = from.boxes[CHUNK_SIZE * i + f];
+            expandChunkBound( to, t );
+
+            _slotIDs[slot] = _slotIDs[last];
+            _idSlots[_slotIDs[slot]] = slot;
+        }
+
+        _slotIDs.pop_back();
+        _idSlots[id] = ~0u;
+        _freeIDs.push_back( id );
+        if ( --_chunks.back().count==0 )
+        {
+            _chunks.pop_back();
+            dirtyBound();
+        }
+    }
+
+    void InstancedGeometry::removeAllInstances()
+    {
+        _chunks.clear();
+        _looseChunks.clear();
+        _idSlots.clear();
+        _slotIDs.clear();
+        _freeIDs.clear();
+        dirtyBound();
+    }
+
+    void InstancedGeometry::setInstanceMatrix( unsigned int id, const osg::Matrix& matrix )
+    {
+        unsigned int slot = _idSlots[id];
+        markLoose( slot );
+        writeMatrix( slot, matrix );
+    }
+
+    void InstancedGeometry::setInstanceColor( unsigned int id, const osg::Vec4& color )
+    {
+        unsigned int slot = _idSlots[id];
+        Chunk& chunk = getChunk( slot );
+        (*chunk.colors)[slot % CHUNK_SIZE] = toColor( color );
+        chunk.colors->dirty();
+    }
+
+    osg::Matrix InstancedGeometry::getInstanceMatrix( unsigned int id ) const
+    {
+        unsigned int slot = _idSlots[id];
+        const Chunk& chunk = getChunk( slot );
+        osg::Matrix matrix;
+        for ( unsigned int j=0; j<3; ++j )
+        {
+            const osg::Vec4& column = (*chunk.matrices[j])[slot % CHUNK_SIZE];
+            for ( unsigned int i=0; i<4; ++i ) matrix(i, j) = column[i];
+        }
+        return matrix;
+    }
+
+    osg::Vec4 InstancedGeometry::getInstanceColor( unsigned int id ) const
+    {
+        unsigned int slot = _idSlots[id];
+        const osg::Vec4ub& color = (*getChunk(slot).colors)[slot % CHUNK_SIZE];
+        return osg::Vec4( color.r(), color.g(), color.b(), color.a() ) / 255.0f;
+    }
+
+    unsigned int InstancedGeometry::getInstanceIDFromIndex( unsigned int index ) const
+    {
+        return index<_slotIDs.size() ? _slotIDs[index] : ~0u;
+    }
+
+    void InstancedGeometry::writeMatrix( unsigned int slot, const osg::Matrix& matrix )
+    {
+        // OSG matrices transform row vectors, so the shader dots the vertex with columns
+        Chunk& chunk = getChunk( slot );
+        unsigned int index = slot % CHUNK_SIZE;
+        for ( unsigned int j=0; j<3; ++j )
+        {
+            (*chunk.matrices[j])[index].set( matrix(0, j), matrix(1, j), matrix(2, j), matrix(3, j) );
+            chunk.matrices[j]->dirty();
+        }
+        writeBox( slot );
+    }
+
+    void InstancedGeometry::writeBox( unsigned int slot )
+    {
+        // The mesh may only get its vertices after the geometry was created
+        if ( !_meshBound.valid() ) _meshBound = osg::Geometry::computeBoundingBox();
+        osg::Vec4 center( _meshBound.center(), 1.0f );
+        osg::Vec3 extent;
+        if ( _meshBound.valid() ) extent = (_meshBound._max - _meshBound._min) * 0.5f;
+
+        // Transform the center of the mesh box, and project its extent onto each axis
+        Chunk& chunk = getChunk( slot );
+        unsigned int index = slot % CHUNK_SIZE;
+        for ( unsigned int j=0; j<3; ++j )
+        {
+            const osg::Vec4& column = (*chunk.matrices[j])[index];
+            chunk.boxes[CHUNK_SIZE * j + index] = column * center;
+            chunk.boxes[CHUNK_SIZE * (j + 3) + index] = fabs(column.x()) * extent.x() +
+                fabs(column.y()) * extent.y() + fabs(column.z()) * extent.z();
+        }
+        expandChunkBound( chunk, index );
+    }
+
+    void InstancedGeometry::expandChunkBound( Chunk& chunk, unsigned int index )
+    {
+        const float* boxes = &chunk.boxes[index];
+        osg::Vec3 center( boxes[0], boxes[CHUNK_SIZE], boxes[CHUNK_SIZE * 2] );
+        osg::Vec3 halfSize( boxes[CHUNK_SIZE * 3], boxes[CHUNK_SIZE * 4], boxes[CHUNK_SIZE * 5] );
+        if ( !chunk.bound.contains(center - halfSize) || !chunk.bound.contains(center + halfSize) )
+        {
+            chunk.bound.expandBy( center - halfSize );
+            chunk.bound.expandBy( center + halfSize );
+            dirtyBound();
+        }
+    }
+
+    void InstancedGeometry::markLoose( unsigned int slot )
+    {
+        // An instance leaving the chunk bound may let it shrink. Only instances touching
+        // the bound can do that; the others never need a rescan
+        Chunk& chunk = getChunk( slot );
+        if ( chunk.loose ) return;
+
+        const float* boxes = &chunk.boxes[slot % CHUNK_SIZE];
+        for ( unsigned int j=0; j<3; ++j )
+        {
+            float center = boxes[CHUNK_SIZE * j], halfSize = boxes[CHUNK_SIZE * (j + 3)];
+            if ( center - halfSize<=chunk.bound._min[j] || center + halfSize>=chunk.bound._max[j] )
+            {
+                chunk.loose = true;
+                _looseChunks.push_back( slot / CHUNK_SIZE );
+                return;
+            }
+        }
+    }
+
+    void InstancedGeometry::updateBounds()
+    {
+        // Chunks may be gone, or listed again after being popped and re-added
+        for ( unsigned int k=0; k<_looseChunks.size(); ++k )
+        {
+            unsigned int c = _looseChunks[k];
+            if ( c>=_chunks.size() || !_chunks[c].loose ) continue;
+
+            Chunk& chunk = _chunks[c];
+            osg::BoundingBox bound;
+            const float* boxes = &chunk.boxes[0];
+            for ( unsigned int i=0; i<chunk.count; ++i )
+            {
+                osg::Vec3 center( boxes[i], boxes[CHUNK_SIZE + i], boxes[CHUNK_SIZE * 2 + i] );
+                osg::Vec3 halfSize( boxes[CHUNK_SIZE * 3 + i], boxes[CHUNK_SIZE * 4 + i], boxes[CHUNK_SIZE * 5 + i] );
+                bound.expandBy( center - halfSize );
+                bound.expandBy( center + halfSize );
+            }
+
+            if ( bound._min!=chunk.bound._min || bound._max!=chunk.bound._max ) dirtyBound();
+            chunk.bound = bound;
+            chunk.loose = false;
+        }
+        _looseChunks.clear();
+    }
+
+    void InstancedGeometry::dirtyMesh()
+    {
+        _meshBound = osg::Geometry::computeBoundingBox();
+        for ( unsigned int c=0; c<_chunks.size(); ++c )
+        {
+            _chunks[c].bound.init();
+            for ( unsigned int i=0; i<_chunks[c].count; ++i )
+                writeBox( c * CHUNK_SIZE + i );
+        }
+        dirtyBound();
+    }
+
+    osg::BoundingBox InstancedGeometry::computeBoundingBox() const
+    {
+        // Chunk bounds are kept up to date, so this is independent of the instance count
+        osg::BoundingBox bb;
+        for ( unsigned int c=0; c<_chunks.size(); ++c )
+            bb.expandBy( _chunks[c].bound );
+        return bb;
+    }
+
+    void InstancedGeometry::drawImplementation( osg::RenderInfo& renderInfo ) const
+    {
+        if ( _chunks.empty() ) return;
+
+        osg::State& state = *renderInfo.getState();
+        const osg::GLExtensions* ext = state.get<osg::GLExtensions>();
+        if ( !ext->glDrawArraysInstanced || !ext->glDrawElementsInstanced || !ext->glVertexAttribDivisor )
+        {
+            static bool s_warned = false;
+            if ( !s_warned )
+                OSG_WARN << "InstancedGeometry: Instanced arrays are not supported" << std::endl;
+            s_warned = true;
+            return;
+        }
+
+        // Fully visible chunks are drawn from their own buffers, the visible instances of
+        // partly visible ones are packed into the stream buffer of this context
+        ContextData& data = _contextData[state.getContextID()];
+        bool culling = _instanceCulling && _meshBound.valid();
+        unsigned int numPacked = 0;
+
+        // The picking variant of the program needs the dense list position of each
+        // instance, so it gets every chunk which is not culled without packing
+        static unsigned int s_instanceBaseID = osg::Uniform::getNameID( "pickInstanceBase" );
+        const osg::Program::PerContextProgram* pcp = state.getLastAppliedProgramObject();
+        GLint baseLocation = pcp ? pcp->getUniformLocation( s_instanceBaseID ) : -1;
+        bool picking = baseLocation>=0;
+        if ( culling )
+        {
+            cullInstances( data, state.getModelViewMatrix(), state.getProjectionMatrix() );
+            if ( !picking ) numPacked = packInstances( data );
+        }
+
+        // Bind the mesh arrays as osg::Geometry does, then draw all primitives once per
+        // chunk with the instance arrays of that chunk
+        osg::VertexArrayState* vas = state.getCurrentVertexArrayState();
+        vas->setVertexBufferObjectSupported( true );
+        drawVertexArraysImplementation( renderInfo );
+
+        unsigned int location = getAttributeLocation();
+        for ( unsigned int i=0; i<4; ++i ) ext->glVertexAttribDivisor( location + i, 1 );
+        for ( unsigned int c=0; c<_chunks.size(); ++c )
+        {
+            if ( culling && (picking ? data.numVisible[c]==0 : data.numVisible[c]!=~0u) ) continue;
+            if ( picking ) ext->glUniform1i( baseLocation, c * CHUNK_SIZE );
+
+            const Chunk& chunk = _chunks[c];
+            for ( unsigned int i=0; i<3; ++i )
+                vas->setVertexAttribArray( state, location + i, chunk.matrices[i].get() );
+            vas->setVertexAttribArray( state, location + 3, chunk.colors.get() );
+            drawInstances( state, chunk.count );
+        }
+
+        if ( numPacked>0 )
+        {
+            for ( unsigned int i=0; i<3; ++i )
+                vas->setVertexAttribArray( state, location + i, data.matrices[i].get() );
+            vas->setVertexAttribArray( state, location + 3, data.colors.get() );
+            drawInstances( state, numPacked );
+        }
+
+        // Divisors are global state, reset them for other drawables
+        for ( unsigned int i=0; i<4; ++i ) ext->glVertexAttribDivisor( location + i, 0 );
+        vas->unbindVertexBufferObject();
+        vas->unbindElementBufferObject();
+    }
+
+    void InstancedGeometry::cullInstances( ContextData& data, const osg::Matrix& modelview,
+                                           const osg::Matrix& projection ) const
+    {
+        osg::Polytope frustum;
+        frustum.setToUnitFrustum();
+        frustum.transformProvidingInverse( modelview * projection );
+        const osg::Polytope::PlaneList& planeList = frustum.getPlaneList();
+        std::vector<osg::Vec4> planes;
+        for ( unsigned int p=0; p<planeList.size(); ++p )
+            planes.push_back( planeList[p].asVec4() );
+
+        unsigned int numChunks = _chunks.size();
+        data.visible.resize( numChunks * CHUNK_SIZE );
+        data.numVisible.resize( numChunks );
+        ThreadPool::instance()->parallelFor( 0, numChunks, [&]( unsigned int first, unsigned int last )
+        {
+            for ( unsigned int c=first; c<last; ++c )
+            {
+                // Only chunks crossing a plane need their instances tested
+                const Chunk& chunk = _chunks[c];
+                bool inside = true, outside = false;
+                for ( unsigned int p=0; p<planeList.size() && !outside; ++p )
+                {
+                    int side = planeList[p].intersect( chunk.bound );
+                    if ( side<0 ) outside = true;
+                    else if ( side==0 ) inside = false;
+                }
+
+                if ( outside ) data.numVisible[c] = 0;
+                else if ( inside ) data.numVisible[c] = ~0u;
+                else
+                {
+                    const float* boxes[6];
+                    for ( unsigned int i=0; i<6; ++i ) boxes[i] = &chunk.boxes[CHUNK_SIZE * i];
+                    data.numVisible[c] = cullBoxes( boxes, chunk.count, planes, &data.visible[c * CHUNK_SIZE] );
+                }
+            }
+        }, 4 );
+    }
+
+    unsigned int InstancedGeometry::packInstances( ContextData& data ) const
+    {
+        unsigned int numChunks = _chunks.size(), numPacked = 0;
+        data.offsets.resize( numChunks );
+        for ( unsigned int c=0; c<numChunks; ++c )
+        {
+            data.offsets[c] = numPacked;
+            if ( data.numVisible[c]!=~0u ) numPacked += data.numVisible[c];
+        }
+        if ( !numPacked ) return 0;
+
+        if ( !data.colors )
+        {
+            // Rewritten on every draw
+            osg::ref_ptr<osg::VertexBufferObject> vbo = new osg::VertexBufferObject;
+            vbo->setUsage( GL_STREAM_DRAW_ARB );
+            for ( unsigned int i=0; i<3; ++i )
+            {
+                data.matrices[i] = new osg::Vec4Array;
+                data.matrices[i]->setVertexBufferObject( vbo.get() );
+            }
+            data.colors = new osg::Vec4ubArray;
+            data.colors->setNormalize( true );
+            data.colors->setVertexBufferObject( vbo.get() );
+        }
+
+        for ( unsigned int i=0; i<3; ++i ) data.matrices[i]->resize( numPacked );
+        data.colors->resize( numPacked );
+        ThreadPool::instance()->parallelFor( 0, numChunks, [&]( unsigned int first, unsigned int last )
+        {
+            for ( unsigned int c=first; c<last; ++c )
+            {
+                if ( data.numVisible[c]==~0u ) continue;
+
+                const Chunk& chunk = _chunks[c];
+                const unsigned int* visible = &data.visible[c * CHUNK_SIZE];
+                for ( unsigned int k=0, dst=data.offsets[c]; k<data.numVisible[c]; ++k, ++dst )
+                {
+                    unsigned int src = visible[k];
+                    for ( unsigned int i=0; i<3; ++i ) (*data.matrices[i])[dst] = (*chunk.matrices[i])[src];
+                    (*data.colors)[dst] = (*chunk.colors)[src];
+                }
+            }
+        }, 4 );
+
+        for ( unsigned int i=0; i<3; ++i ) data.matrices[i]->dirty();
+        data.colors->dirty();
+        return numPacked;
+    }
+
+    void InstancedGeometry::drawInstances( osg::State& state, unsigned int numInstances ) const
+    {
+        const osg::GLExtensions* ext = state.get<osg::GLExtensions>();
+        for ( unsigned int i=0; i<_primitives.size(); ++i )
+        {
+            const osg::PrimitiveSet* primitive = _primitives[i].get();
+            GLenum mode = primitive->getMode();
+            switch ( primitive->getType() )
+            {
+            case osg::PrimitiveSet::DrawArraysPrimitiveType:
+                {
+                    const osg::DrawArrays* da = static_cast<const osg::DrawArrays*>( primitive );
+                    ext->glDrawArraysInstanced( mode, da->getFirst(), da->getCount(), numInstances );
+                }
+                break;
+            case osg::PrimitiveSet::DrawArrayLengthsPrimitiveType:
+                {
+                    const osg::DrawArrayLengths* dal = static_cast<const osg::DrawArrayLengths*>( primitive );
+                    GLint first = dal->getFirst();
+                    for ( unsigned int j=0; j<dal->size(); ++j )
+                    {
+                        ext->glDrawArraysInstanced( mode, first, (*dal)[j], numInstances );
+                        first += (*dal)[j];
+                    }
+                }
+                break;
+            case osg::PrimitiveSet::DrawElementsUBytePrimitiveType:
+            case osg::PrimitiveSet::DrawElementsUShortPrimitiveType:
+            case osg::PrimitiveSet::DrawElementsUIntPrimitiveType:
+                {
+                    // Same as osg::DrawElements*::draw() with our own instance count
+                    const osg::DrawElements* de = primitive->getDrawElements();
+                    osg::GLBufferObject* ebo = de->getOrCreateGLBufferObject( state.getContextID() );
+                    if ( !ebo ) break;
+
+                    GLenum type = GL_UNSIGNED_INT;
+                    if ( primitive->getType()==osg::PrimitiveSet::DrawElementsUBytePrimitiveType )
+                        type = GL_UNSIGNED_BYTE;
+                    else if ( primitive->getType()==osg::PrimitiveSet::DrawElementsUShortPrimitiveType )
+                        type = GL_UNSIGNED_SHORT;
+                    state.getCurrentVertexArrayState()->bindElementBufferObject( ebo );
+                    ext->glDrawElementsInstanced( mode, de->getNumIndices(), type,
+                                                  (const GLvoid*)(ebo->getOffset(de->getBufferIndex())),
+                                                  numInstances );
+                }
+                break;
+            default:
+                OSG_WARN << "InstancedGeometry: Primitive set type " << primitive->getType()
+                         << " is not supported" << std::endl;
+                break;
+            }
+        }
+    }
+
+    void InstancedGeometry::resizeGLObjectBuffers( unsigned int maxSize )
+    {
+        osg::Geometry::resizeGLObjectBuffers( maxSize );
+        for ( unsigned int c=0; c<_chunks.size(); ++c )
+        {
+            for ( unsigned int i=0; i<3; ++i ) _chunks[c].matrices[i]->resizeGLObjectBuffers( maxSize );
+            _chunks[c].colors->resizeGLObjectBuffers( maxSize );
+        }
+        _contextData.resize( maxSize );
+    }
+
+    void InstancedGeometry::releaseGLObjects( osg::State* state ) const
+    {
+        osg::Geometry::releaseGLObjects( state );
+        for ( unsigned int c=0; c<_chunks.size(); ++c )
+        {
+            for ( unsigned int i=0; i<3; ++i ) _chunks[c].matrices[i]->releaseGLObjects( state );
+            _chunks[c].colors->releaseGLObjects( state );
+        }
+
+        for ( unsigned int i=0; i<_contextData.size(); ++i )
+        {
+            if ( state && state->getContextID()!=i ) continue;
+            ContextData& data = _contextData[i];
+            if ( data.colors.valid() ) data.colors->releaseGLObjects( state );
+            data = ContextData();
+        }
+    }
+
+}
@@ -0,0 +1,258 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Replacing shared subgraphs with instanced geometries
+*/
+
+#include <osg/Geode>
+#include <osg/MatrixTransform>
+#include <osg/PositionAttitudeTransform>
+#include <osg/Switch>
+#include <typeinfo>
+
+#include "InstancedGeometry"
+#include "InstancingVisitor"
+
+namespace osgCookBook
+{
+
+    /* Moves the instances of one geometry along with the transforms of the original
+       subgraph, which is still updated under the switch. */
+    class InstanceRefreshCallback : public osg::Drawable::UpdateCallback
+    {
+    public:
+        InstanceRefreshCallback( const osg::NodePath& path, const std::vector<osg::Matrix>& matrices,
+                                 const std::vector<unsigned int>& ids, const osg::Matrix& inner )
+        :   _root(path.front()), _path(path), _matrices(matrices), _ids(ids), _inner(inner) {}
+
+        virtual void update( osg::NodeVisitor*, osg::Drawable* drawable )
+        {
+            osg::Matrix inner = osg::computeLocalToWorld( _path );
+            if ( inner==_inner ) return;
+
+            InstancedGeometry* geom = static_cast<InstancedGeometry*>( drawable );
+            for ( unsigned int i=0; i<_ids.size(); ++i )
+                geom->setInstanceMatrix( _ids[i], inner * _matrices[i] );
+            _inner = inner;
+        }
+
+    protected:
+        osg::ref_ptr<osg::Node> _root;  // Keeps the path alive
+        osg::NodePath _path;
+        std::vector<osg::Matrix> _matrices;
+        std::vector<unsigned int> _ids;
+        osg::Matrix _inner;
+    };
+
+    /* Transforms of one subgraph under the same parent, which can share instanced
+       geometries as they inherit the same state. */
+    struct InstanceGroup
+    {
+        osg::ref_ptr<osg::Group> parent;
+        osg::Node::NodeMask nodeMask;
+        osg::ref_ptr<osg::StateSet> stateSet;
+        std::vector< osg::ref_ptr<osg::Transform> > transforms;
+        std::vector<osg::Matrix> matrices;
+    };
+
+    static bool isAnimated( const osg::Node* node )
+    {
+        return node->getUpdateCallback() || node->getEventCallback() ||
+               node->getDataVariance()==osg::Object::DYNAMIC;
+    }
+
+    InstancingVisitor::InstancingVisitor( unsigned int minInstances )
+    :   osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN), _minInstances(minInstances)
+    {
+    }
+
+    void InstancingVisitor::apply( osg::Node& node )
+    {
+        // Shared nodes are only searched once
+        if ( !_visited.insert(&node).second ) return;
+        if ( node.getNumParents()>=_minInstances ) _subgraphs.push_back( &node );
+        traverse( node );
+    }
+
+    bool InstancingVisitor::isInstanceTransform( osg::Node* node ) const
+    {
+        osg::Transform* transform = node->asTransform();
+        if ( !transform || !(transform->asMatrixTransform() || transform->asPositionAttitudeTransform()) )
+            return false;
+        return transform->getReferenceFrame()==osg::Transform::RELATIVE_RF &&
+               transform->getNumParents()==1 && !transform->getCullCallback() && !isAnimated(transform);
+    }
+
+    bool InstancingVisitor::isInstanceable( osg::Node* node ) const
+    {
+        if ( node->getCullCallback() ) return false;
+
+        // Subclasses like LOD, Switch or Billboard choose children per view, which instances can't
+        osg::Transform* transform = node->asTransform();
+        if ( transform )
+        {
+            if ( !(transform->asMatrixTransform() || transform->asPositionAttitudeTransform()) ||
+                 transform->getReferenceFrame()!=osg::Transform::RELATIVE_RF )
+                return false;
+        }
+        else if ( typeid(*node)==typeid(osg::Geode) )
+        {
+            osg::Geode* geode = node->asGeode();
+            for ( unsigned int i=0; i<geode->getNumDrawables(); ++i )
+            {
+                osg::Geometry* geom = geode->getDrawable(i)->asGeometry();
+                if ( !geom || geom->getCullCallback() || geom->getDrawCallback() ||
+                     dynamic_cast<InstancedGeometry*>(geom) )
+                    return false;
+
+                // Keep clear of the instance attributes and the texture units they alias
+                if ( geom->getNumTexCoordArrays()>4 ||
+                     geom->getNumVertexAttribArrays()>InstancedGeometry::getAttributeLocation() )
+                    return false;
+            }
+            return true;
+        }
+        else if ( typeid(*node)!=typeid(osg::Group) )
+            return false;
+
+        osg::Group* group = node->asGroup();
+        for ( unsigned int i=0; i<group->getNumChildren(); ++i )
+        {
+            if ( !isInstanceable(group->getChild(i)) ) return false;
+        }
+        return true;
+    }
+
+    osg::Node* InstancingVisitor::createInstances( osg::Node* node, osg::NodePath& path,
+                                                   const std::vector<osg::Matrix>& matrices, bool animated ) const
+    {
+        path.push_back( node );
+        if ( node->asTransform() && isAnimated(node) ) animated = true;
+
+        osg::ref_ptr<osg::Node> result;
+        osg::Geode* geode = node->asGeode();
+        if ( geode )
+        {
+            osg::Matrix inner = osg::computeLocalToWorld( path );
+            osg::ref_ptr<osg::Geode> instanced = new osg::Geode;
+            for ( unsigned int i=0; i<geode->getNumDrawables(); ++i )
+            {
+                osg::ref_ptr<InstancedGeometry> geom =
+                    new InstancedGeometry( *geode->getDrawable(i)->asGeometry() );
+                std::vector<unsigned int> ids( matrices.size() );
+                for ( unsigned int j=0; j<matrices.size(); ++j )
+                    ids[j] = geom->addInstance( inner * matrices[j] );
+
+                if ( animated )
+                {
+                    geom->getUpdateCallback()->addNestedCallback(
+                        new InstanceRefreshCallback(path, matrices, ids, inner) );
+                }
+                instanced->addDrawable( geom.get() );
+            }
+            result = instanced;
+        }
+        else
+        {
+            // Transforms are part of the instance matrices, so plain groups keep the rest
+            osg::Group* group = node->asGroup();
+            osg::ref_ptr<osg::Group> instanced = new osg::Group;
+            for ( unsigned int i=0; i<group->getNumChildren(); ++i )
+                instanced->addChild( createInstances(group->getChild(i), path, matrices, animated) );
+            result = instanced;
+        }
+
+        result->setName( node->getName() );
+        result->setNodeMask( node->getNodeMask() );
+        result->setStateSet( node->getStateSet() );
+        path.pop_back();
+        return result.release();
+    }
+
+    unsigned int InstancingVisitor::replaceSubgraphs()
+    {
+        unsigned int numReplaced = 0;
+        for ( unsigned int s=0; s<_subgraphs.size(); ++s )
+        {
+            osg::Node* subgraph = _subgraphs[s].get();
+            if ( !isInstanceable(subgraph) ) continue;
+
+            // Parents which are not instanced still show the original subgraph
+            bool keepOriginal = false;
+            std::vector<InstanceGroup> groups;
+            for ( unsigned int i=0; i<subgraph->getNumParents(); ++i )
+            {
+                osg::Group* parent = subgraph->getParent(i);
+                if ( !isInstanceTransform(parent) ) { keepOriginal = true; continue; }
+
+                osg::Transform* transform = parent->asTransform();
+                osg::Group* grandParent = transform->getParent(0);
+                unsigned int g = 0;
+                for ( ; g<groups.size(); ++g )
+                {
+                    if ( groups[g].parent==grandParent && groups[g].nodeMask==transform->getNodeMask() &&
+                         groups[g].stateSet==transform->getStateSet() )
+                        break;
+                }
+                if ( g==groups.size() )
+                {
+                    InstanceGroup group;
+                    group.parent = grandParent;
+                    group.nodeMask = transform->getNodeMask();
+                    group.stateSet = transform->getStateSet();
+                    groups.push_back( group );
+                }
+
+                osg::Matrix matrix;
+                transform->computeLocalToWorldMatrix( matrix, this );
+                groups[g].transforms.push_back( transform );
+                groups[g].matrices.push_back( matrix );
+            }
+
+            for ( unsigned int g=0; g<groups.size(); )
+            {
+                if ( groups[g].transforms.size()<_minInstances )
+                {
+                    keepOriginal = true;
+                    groups.erase( groups.begin() + g );
+                }
+                else ++g;
+            }
+            if ( groups.empty() ) continue;
+
+            // Callbacks in the subgraph keep running when no other parent traverses it
+            bool needsUpdate = subgraph->getUpdateCallback() ||
+                               subgraph->getNumChildrenRequiringUpdateTraversal()>0;
+            for ( unsigned int g=0; g<groups.size(); ++g )
+            {
+                InstanceGroup& group = groups[g];
+                if ( needsUpdate && !keepOriginal && g==0 )
+                {
+                    // Added before the instances, so they are moved after the subgraph
+                    osg::ref_ptr<osg::Switch> holder = new osg::Switch;
+                    holder->addChild( subgraph, false );
+                    group.parent->addChild( holder.get() );
+                }
+
+                osg::NodePath path;
+                osg::ref_ptr<osg::Group> instanced = new osg::Group;
+                instanced->setNodeMask( group.nodeMask );
+                instanced->setStateSet( group.stateSet.get() );
+                instanced->addChild( createInstances(subgraph, path, group.matrices, false) );
+                group.parent->addChild( instanced.get() );
+
+                for ( unsigned int i=0; i<group.transforms.size(); ++i )
+                {
+                    osg::Transform* transform = group.transforms[i].get();
+                    if ( transform->getNumChildren()==1 )
+                        group.parent->removeChild( transform );
+                    else
+                        transform->removeChild( subgraph );
+                }
+                numReplaced += group.transforms.size();
+            }
+        }
+        _subgraphs.clear();
+        _visited.clear();
+        return numReplaced;
+    }
+
+}
@@ -0,0 +1,377 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Batched text labels
+*/
+
+#include <osg/BufferObject>
+#include <osg/Polytope>
+#include <osg/State>
+#include <osg/Version>
+#include <osgText/Glyph>
+
+// The vertex arrays are bound through osg::VertexArrayState, added in OpenSceneGraph 3.5.6
+#if OSG_VERSION_LESS_THAN(3,5,6)
+#error "LabelBatch needs OpenSceneGraph 3.5.6 or later"
+#endif
+
+#include "LabelBatch"
+
+namespace osgCookBook
+{
+
+    extern osg::ref_ptr<osgText::Font> g_font;
+
+    class LabelBatchUpdateCallback : public osg::Drawable::UpdateCallback
+    {
+    public:
+        virtual void update( osg::NodeVisitor* nv, osg::Drawable* drawable )
+        {
+            // Let the nested callback change the labels first, so they are laid out this frame
+            osg::Callback* nested = getNestedCallback();
+            if ( nested ) nested->run( drawable, nv );
+            static_cast<LabelBatch*>( drawable )->layout();
+        }
+    };
+
+    LabelBatch::LabelBatch()
+    :   _changed(false)
+    {
+        osg::ref_ptr<osg::VertexBufferObject> vbo = new osg::VertexBufferObject;
+        _vertices = new osg::Vec3Array;
+        _vertices->setVertexBufferObject( vbo.get() );
+        _texCoords = new osg::Vec2Array;
+        _texCoords->setVertexBufferObject( vbo.get() );
+        _colors = new osg::Vec4Array;
+        _colors->setBinding( osg::Array::BIND_PER_VERTEX );
+        _colors->setVertexBufferObject( vbo.get() );
+
+        // Arrays are rewritten in the update traversal while they may still be drawn
+        setDataVariance( osg::Object::DYNAMIC );
+        setSupportsDisplayList( false );
+        setUseVertexBufferObjects( true );
+        setUpdateCallback( new LabelBatchUpdateCallback );
+
+        osg::StateSet* ss = getOrCreateStateSet();
+        ss->setTextureMode( 0, GL_TEXTURE_2D, osg::StateAttribute::ON );
+        ss->setMode( GL_BLEND, osg::StateAttribute::ON );
+        ss->setMode( GL_LIGHTING, osg::StateAttribute::OFF );
+        ss->setRenderingHint( osg::StateSet::TRANSPARENT_BIN );
+    }
+
+    LabelBatch::LabelBatch( const LabelBatch& copy, const osg::CopyOp& copyop )
+    :   osg::Drawable(copy, copyop),
+        _labels(copy._labels), _freeLabels(copy._freeLabels), _pages(copy._pages),
+        _ranges(copy._ranges), _pageRanges(copy._pageRanges),
+        _vertices(new osg::Vec3Array(*copy._vertices)),
+        _texCoords(new osg::Vec2Array(*copy._texCoords)),
+        _colors(new osg::Vec4Array(*copy._colors)),
+        _changed(copy._changed)
+    {
+        osg::ref_ptr<osg::VertexBufferObject> vbo = new osg::VertexBufferObject;
+        _vertices->setVertexBufferObject( vbo.get() );
+        _texCoords->setVertexBufferObject( vbo.get() );
+        _colors->setVertexBufferObject( vbo.get() );
+    }
+
+    osgText::Font* LabelBatch::getSharedFont()
+    {
+        return g_font.get();
+    }
+
+    unsigned int LabelBatch::addLabel( const osg::Vec3& pos, const std::string& content, float size,
+                                       const osg::Vec4& color )
+    {
+        unsigned int id = _labels.size();
+        if ( !_freeLabels.empty() )
+        {
+            id = _freeLabels.back();
+            _freeLabels.pop_back();
+        }
+        else
+            _labels.push_back( Label() );
+
+        Label& label = _labels[id];
+        label.text.set( content, osgText::String::ENCODING_UTF8 );
+        label.position = pos;
+        label.color = color;
+        label.size = size;
+        label.used = true;
+        label.visible = true;
+        markChanged( id, true );
+        return id;
+    }
+
+    void LabelBatch::removeLabel( unsigned int id )
+    {
+        if ( id>=_labels.size() || !_labels[id].used ) return;
+        _labels[id].used = false;
+        _labels[id].text.clear();
+        _freeLabels.push_back( id );
+        markChanged( id, true );
+    }
+
+    void LabelBatch::setText( unsigned int id, const std::string& content )
+    {
+        _labels[id].text.set( content, osgText::String::ENCODING_UTF8 );
+        markChanged( id, true );
+    }
+
+    void LabelBatch::setPosition( unsigned int id, const osg::Vec3& pos )
+    {
+        _labels[id].position = pos;
+        markChanged( id, false );
+    }
+
+    void LabelBatch::setCharacterSize( unsigned int id, float size )
+    {
+        _labels[id].size = size;
+        markChanged( id, true );
+    }
+
+    void LabelBatch::setColor( unsigned int id, const osg::Vec4& color )
+    {
+        _labels[id].color = color;
+        markChanged( id, false );
+    }
+
+    void LabelBatch::setLabelVisible( unsigned int id, bool visible )
+    {
+        _labels[id].visible = visible;
+        markChanged( id, false );
+    }
+
+    void LabelBatch::markChanged( unsigned int id, bool textChanged )
+    {
+        Label& label = _labels[id];
+        label.changed = true;
+        if ( textChanged ) label.textChanged = true;
+        _changed = true;
+    }
+
+    void LabelBatch::layout()
+    {
+        if ( !_changed ) return;
+
+        // Only strings and sizes that changed are laid out again. If their quads still
+        // fit the old ranges, the vertices are rewritten in place.
+        bool repack = false;
+        for ( unsigned int i=0; i<_labels.size(); ++i )
+        {
+            Label& label = _labels[i];
+            if ( !label.textChanged ) continue;
+
+            std::vector<unsigned int> oldCounts;
+            oldCounts.swap( label.pageCounts );
+            layoutLabel( label );
+            if ( label.pageCounts!=oldCounts ) repack = true;
+        }
+
+        if ( repack ) packAll();
+        else
+        {
+            for ( unsigned int i=0; i<_labels.size(); ++i )
+            {
+                Label& label = _labels[i];
+                if ( !label.changed ) continue;
+                for ( unsigned int r=0; r<label.ranges.size(); ++r )
+                    writeRange( label, _ranges[label.ranges[r]] );
+            }
+        }
+
+        for ( unsigned int i=0; i<_labels.size(); ++i )
+            _labels[i].changed = false;
+        _changed = false;
+
+        _vertices->dirty();
+        _texCoords->dirty();
+        _colors->dirty();
+        dirtyBound();
+    }
+
+    void LabelBatch::layoutLabel( Label& label )
+    {
+        label.quads.clear();
+        label.pageCounts.clear();
+        label.localBound.init();
+        label.textChanged = false;
+
+        osgText::Font* font = getSharedFont();
+        if ( !font || !label.used ) return;
+
+        osgText::FontResolution resolution = getSharedFontResolution();
+        float size = label.size;
+        osg::Vec2 cursor;
+        for ( osgText::String::const_iterator itr=label.text.begin(); itr!=label.text.end(); ++itr )
+        {
+            unsigned int charcode = *itr;
+            if ( charcode=='\n' )
+            {
+                cursor.set( 0.0f, cursor.y() - size );
+                continue;
+            }
+
+            // Glyph metrics are normalized to a character height of 1
+            osgText::Glyph* glyph = font->getGlyph( resolution, charcode );
+            if ( !glyph ) continue;
+
+            const osgText::Glyph::TextureInfo* info = glyph->getOrCreateTextureInfo( osgText::GREYSCALE );
+            if ( info && info->texture )
+            {
+                GlyphQuad quad;
+                quad.page = findOrAddPage( info->texture );
+                quad.minCorner = cursor + glyph->getHorizontalBearing() * size;
+                quad.maxCorner = quad.minCorner + osg::Vec2(glyph->getWidth() * size, glyph->getHeight() * size);
+                quad.minTexCoord = info->minTexCoord;
+                quad.maxTexCoord = info->maxTexCoord;
+
+                // Grow the quad by the texel margin around the glyph like osgText does,
+                // so antialiased edges are not clipped
+                osg::Vec2 tcSize = info->maxTexCoord - info->minTexCoord;
+                osg::Vec2 tcMargin( info->texelMargin / (float)info->texture->getTextureWidth(),
+                                    info->texelMargin / (float)info->texture->getTextureHeight() );
+                osg::Vec2 quadSize = quad.maxCorner - quad.minCorner;
+                osg::Vec2 margin( tcSize.x()>0.0f ? quadSize.x() * tcMargin.x() / tcSize.x() : 0.0f,
+                                  tcSize.y()>0.0f ? quadSize.y() * tcMargin.y() / tcSize.y() : 0.0f );
+                quad.minCorner -= margin; quad.maxCorner += margin;
+                quad.minTexCoord -= tcMargin; quad.maxTexCoord += tcMargin;
+
+                label.quads.push_back( quad );
+                if ( label.pageCounts.size()<=quad.page ) label.pageCounts.resize( quad.page + 1, 0 );
+                label.pageCounts[quad.page]++;
+                label.localBound.expandBy( osg::Vec3(quad.minCorner, 0.0f) );
+                label.localBound.expandBy( osg::Vec3(quad.maxCorner, 0.0f) );
+            }
+            cursor.x() += glyph->getHorizontalAdvance() * size;
+        }
+    }
+
+    unsigned int LabelBatch::findOrAddPage( osg::Texture* texture )
+    {
+        for ( unsigned int i=0; i<_pages.size(); ++i )
+        {
+            if ( _pages[i]==texture ) return i;
+        }
+        _pages.push_back( texture );
+        return _pages.size() - 1;
+    }
+
+    void LabelBatch::writeRange( const Label& label, Range& range )
+    {
+        const osg::Vec3& pos = label.position;
+        unsigned int v = range.first;
+        for ( unsigned int i=0; i<label.quads.size(); ++i )
+        {
+            const GlyphQuad& quad = label.quads[i];
+            if ( quad.page!=range.page ) continue;
+
+            (*_vertices)[v+0] = pos + osg::Vec3(quad.minCorner.x(), quad.maxCorner.y(), 0.0f);
+            (*_vertices)[v+1] = pos + osg::Vec3(quad.minCorner.x(), quad.minCorner.y(), 0.0f);
+            (*_vertices)[v+2] = pos + osg::Vec3(quad.maxCorner.x(), quad.minCorner.y(), 0.0f);
+            (*_vertices)[v+3] = pos + osg::Vec3(quad.maxCorner.x(), quad.maxCorner.y(), 0.0f);
+            (*_texCoords)[v+0].set( quad.minTexCoord.x(), quad.maxTexCoord.y() );
+            (*_texCoords)[v+1].set( quad.minTexCoord.x(), quad.minTexCoord.y() );
+            (*_texCoords)[v+2].set( quad.maxTexCoord.x(), quad.minTexCoord.y() );
+            (*_texCoords)[v+3].set( quad.maxTexCoord.x(), quad.maxTexCoord.y() );
+            for ( unsigned int j=0; j<4; ++j ) (*_colors)[v+j] = label.color;
+            v += 4;
+        }
+        range.bound.set( label.localBound._min + pos, label.localBound._max + pos );
+        range.visible = label.visible;
+    }
+
+    void LabelBatch::packAll()
+    {
+        unsigned int numQuads = 0;
+        for ( unsigned int i=0; i<_labels.size(); ++i )
+        {
+            _labels[i].ranges.clear();
+            numQuads += _labels[i].quads.size();
+        }
+        _vertices->resize( numQuads * 4 );
+        _texCoords->resize( numQuads * 4 );
+        _colors->resize( numQuads * 4 );
+
+        // Group quads by atlas page so that each page needs one texture bind
+        _ranges.clear();
+        _pageRanges.clear();
+        unsigned int vertex = 0;
+        for ( unsigned int p=0; p<_pages.size(); ++p )
+        {
+            _pageRanges.push_back( _ranges.size() );
+            for ( unsigned int i=0; i<_labels.size(); ++i )
+            {
+                Label& label = _labels[i];
+                if ( p>=label.pageCounts.size() || !label.pageCounts[p] ) continue;
+
+                Range range;
+                range.label = i;
+                range.page = p;
+                range.first = vertex;
+                range.count = label.pageCounts[p] * 4;
+                writeRange( label, range );
+
+                label.ranges.push_back( _ranges.size() );
+                _ranges.push_back( range );
+                vertex += range.count;
+            }
+        }
+        _pageRanges.push_back( _ranges.size() );
+    }
+
+    osg::BoundingBox LabelBatch::computeBoundingBox() const
+    {
+        osg::BoundingBox bb;
+        for ( unsigned int i=0; i<_ranges.size(); ++i )
+        {
+            if ( _ranges[i].visible ) bb.expandBy( _ranges[i].bound );
+        }
+        return bb;
+    }
+
+    void LabelBatch::drawImplementation( osg::RenderInfo& renderInfo ) const
+    {
+        if ( _ranges.empty() ) return;
+
+        // Cull labels here rather than in the cull traversal, so that several views can
+        // share the batch without storing per-view results
+        osg::State& state = *renderInfo.getState();
+        osg::Polytope frustum;
+        frustum.setToUnitFrustum();
+        frustum.transformProvidingInverse( state.getModelViewMatrix() * state.getProjectionMatrix() );
+
+        bool usingVBO = state.useVertexBufferObject( _supportsVertexBufferObjects && _useVertexBufferObjects );
+        osg::VertexArrayState* vas = state.getCurrentVertexArrayState();
+        vas->setVertexBufferObjectSupported( usingVBO );
+        vas->lazyDisablingOfVertexAttributes();
+        vas->setVertexArray( state, _vertices.get() );
+        vas->setTexCoordArray( state, 0, _texCoords.get() );
+        vas->setColorArray( state, _colors.get() );
+        vas->applyDisablingOfVertexAttributes( state );
+
+        for ( unsigned int p=0; p+1<_pageRanges.size(); ++p )
+        {
+            state.applyTextureAttribute( 0, _pages[p].get() );
+
+            // Visible labels next to each other in the buffer are drawn with one call
+            GLint first = 0;
+            GLsizei count = 0;
+            for ( unsigned int r=_pageRanges[p]; r<_pageRanges[p+1]; ++r )
+            {
+                const Range& range = _ranges[r];
+                if ( !range.visible || !frustum.contains(range.bound) ) continue;
+
+                if ( count>0 && first+count==(GLint)range.first )
+                    count += range.count;
+                else
+                {
+                    if ( count>0 ) glDrawArrays( GL_QUADS, first, count );
+                    first = range.first;
+                    count = range.count;
+                }
+            }
+            if ( count>0 ) glDrawArrays( GL_QUADS, first, count );
+        }
+
+        if ( usingVBO ) vas->unbindVertexBufferObject();
+    }
+
+}
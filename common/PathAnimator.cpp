@@ -0,0 +1,268 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Batched animation path evaluation
+*/
+
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include "ThreadPool"
+#include "PathAnimator"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+    #include <emmintrin.h>
+    #define COOKBOOK_PATH_ANIMATOR_SSE
+#endif
+
+namespace osgCookBook
+{
+
+    static const unsigned int s_parallelThreshold = 4096;
+
+    osg::AnimationPath* getCircularAnimationPath( float radius, float time )
+    {
+        typedef std::map< std::pair<float, float>, osg::ref_ptr<osg::AnimationPath> > PathMap;
+        static PathMap s_paths;
+        static OpenThreads::Mutex s_mutex;
+
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( s_mutex );
+        osg::ref_ptr<osg::AnimationPath>& path = s_paths[std::make_pair(radius, time)];
+        if ( path.valid() ) return path.get();
+
+        path = new osg::AnimationPath;
+        path->setLoopMode( osg::AnimationPath::LOOP );
+
+        unsigned int numSamples = 32;
+        float delta_yaw = 2.0f * osg::PI/((float)numSamples - 1.0f);
+        float delta_time = time / (float)numSamples;
+        for ( unsigned int i=0; i<numSamples; ++i )
+        {
+            float yaw = delta_yaw * (float)i;
+            osg::Vec3 pos( sinf(yaw)*radius, cosf(yaw)*radius, 0.0f );
+            osg::Quat rot( -yaw, osg::Z_AXIS );
+            path->insert( delta_time * (float)i, osg::AnimationPath::ControlPoint(pos, rot) );
+        }
+        return path.get();
+    }
+
+    /* Interpolate position and scale linearly and rotation with a normalized lerp along the
+       shorter arc, then build the matrix like AnimationPath::ControlPoint::getMatrix(). */
+    static void blendKeyframes( const float* p0, const float* p1, float ratio, osg::Matrix& matrix )
+    {
+        // Each keyframe is position, rotation and scale, four floats each
+        float p[4], q[4], s[4];
+#ifdef COOKBOOK_PATH_ANIMATOR_SSE
+        __m128 r = _mm_set1_ps( ratio );
+        __m128 a = _mm_loadu_ps( p0 ), b = _mm_loadu_ps( p1 );
+        _mm_storeu_ps( p, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), r)) );
+
+        a = _mm_loadu_ps( p0 + 8 ); b = _mm_loadu_ps( p1 + 8 );
+        _mm_storeu_ps( s, _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), r)) );
+
+        a = _mm_loadu_ps( p0 + 4 ); b = _mm_loadu_ps( p1 + 4 );
+        __m128 d = _mm_mul_ps( a, b );
+        d = _mm_add_ps( d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(2, 3, 0, 1)) );
+        d = _mm_add_ps( d, _mm_shuffle_ps(d, d, _MM_SHUFFLE(1, 0, 3, 2)) );
+        b = _mm_xor_ps( b, _mm_and_ps(d, _mm_set1_ps(-0.0f)) );
+
+        __m128 c = _mm_add_ps( a, _mm_mul_ps(_mm_sub_ps(b, a), r) );
+        __m128 l = _mm_mul_ps( c, c );
+        l = _mm_add_ps( l, _mm_shuffle_ps(l, l, _MM_SHUFFLE(2, 3, 0, 1)) );
+        l = _mm_add_ps( l, _mm_shuffle_ps(l, l, _MM_SHUFFLE(1, 0, 3, 2)) );
+        _mm_storeu_ps( q, _mm_div_ps(c, _mm_sqrt_ps(l)) );
+#else
+        float dot = 0.0f;
+        for ( unsigned int i=0; i<4; ++i ) dot += p0[4+i] * p1[4+i];
+        float sign = dot<0.0f ? -1.0f : 1.0f;
+
+        float length2 = 0.0f;
+        for ( unsigned int i=0; i<4; ++i )
+        {
+            p[i] = p0[i] + (p1[i] - p0[i]) * ratio;
+            s[i] = p0[8+i] + (p1[8+i] - p0[8+i]) * ratio;
+            q[i] = p0[4+i] + (p1[4+i]*sign - p0[4+i]) * ratio;
+            length2 += q[i] * q[i];
+        }
+        float invLength = 1.0f / sqrtf(length2);
+        for ( unsigned int i=0; i<4; ++i ) q[i] *= invLength;
+#endif
+        matrix.makeRotate( osg::Quat(q[0], q[1], q[2], q[3]) );
+        for ( unsigned int i=0; i<3; ++i )
+        {
+            for ( unsigned int j=0; j<3; ++j ) matrix(i, j) *= s[i];
+        }
+        matrix.setTrans( p[0], p[1], p[2] );
+    }
+
+    PathAnimator::PathAnimator()
+    :   _lastFrameNumber(~0u), _parallel(true)
+    {
+    }
+
+    void PathAnimator::addTarget( osg::MatrixTransform* target, osg::AnimationPath* path,
+                                  double timeOffset, double timeMultiplier )
+    {
+        if ( !target || !path || path->empty() ) return;
+
+        // The matrix changes in every update, so optimizers must keep the transform
+        target->setDataVariance( osg::Object::DYNAMIC );
+
+        Target entry;
+        entry.transform = target;
+        entry.path = addPath( path );
+        entry.lastKey = 0;
+        entry.timeOffset = timeOffset;
+        entry.timeMultiplier = timeMultiplier;
+        entry.firstTime = DBL_MAX;
+        _targets.push_back( entry );
+    }
+
+    void PathAnimator::removeTarget( osg::MatrixTransform* target )
+    {
+        for ( unsigned int i=0; i<_targets.size(); )
+        {
+            if ( _targets[i].transform.get()==target )
+                _targets.erase( _targets.begin() + i );
+            else
+                ++i;
+        }
+    }
+
+    unsigned int PathAnimator::addPath( osg::AnimationPath* path )
+    {
+        std::map<osg::AnimationPath*, unsigned int>::iterator itr = _pathIndices.find( path );
+        if ( itr!=_pathIndices.end() ) return itr->second;
+
+        PathData data;
+        data.path = path;
+        data.loopMode = path->getLoopMode();
+        data.firstKey = _keyframes.size();
+        data.numKeys = 0;
+        data.firstTime = path->getFirstTime();
+        data.period = path->getPeriod();
+
+        const osg::AnimationPath::TimeControlPointMap& points = path->getTimeControlPointMap();
+        for ( osg::AnimationPath::TimeControlPointMap::const_iterator pitr=points.begin();
+              pitr!=points.end(); ++pitr )
+        {
+            const osg::AnimationPath::ControlPoint& cp = pitr->second;
+            const osg::Vec3d& pos = cp.getPosition();
+            const osg::Quat& rot = cp.getRotation();
+            const osg::Vec3d& scale = cp.getScale();
+
+            Keyframe key;
+            key.position[0] = pos.x(); key.position[1] = pos.y(); key.position[2] = pos.z(); key.position[3] = 0.0f;
+            key.rotation[0] = rot.x(); key.rotation[1] = rot.y(); key.rotation[2] = rot.z(); key.rotation[3] = rot.w();
+            key.scale[0] = scale.x(); key.scale[1] = scale.y(); key.scale[2] = scale.z(); key.scale[3] = 0.0f;
+            _keyframes.push_back( key );
+            _keyTimes.push_back( pitr->first );
+            data.numKeys++;
+        }
+
+        _pathIndices[path] = _paths.size();
+        _paths.push_back( data );
+        return _paths.size() - 1;
+    }
+
+    unsigned int PathAnimator::findKey( const PathData& path, double time, unsigned int lastKey ) const
+    {
+        // Targets move forward a little every frame, so the segment of the last frame or
+        // the next one usually still fits
+        const double* times = &_keyTimes[path.firstKey];
+        unsigned int last = path.numKeys - 1;
+        for ( unsigned int k=lastKey; k<lastKey+2 && k<last; ++k )
+        {
+            if ( times[k]<=time && time<times[k+1] ) return k;
+        }
+
+        unsigned int k = std::upper_bound( times, times + path.numKeys, time ) - times;
+        return k>0 ? osg::minimum(k - 1, last - 1) : 0;
+    }
+
+    void PathAnimator::sample( unsigned int first, unsigned int last, double simulationTime )
+    {
+        for ( unsigned int i=first; i<last; ++i )
+        {
+            Target& target = _targets[i];
+            const PathData& path = _paths[target.path];
+            const float* keys = _keyframes[path.firstKey].position;
+            const unsigned int stride = sizeof(Keyframe) / sizeof(float);
+
+            // Same time mapping as AnimationPathCallback and AnimationPath
+            double time = (simulationTime - target.firstTime - target.timeOffset) * target.timeMultiplier;
+            if ( path.period>0.0 )
+            {
+                if ( path.loopMode==osg::AnimationPath::LOOP )
+                {
+                    double t = (time - path.firstTime) / path.period;
+                    time = path.firstTime + (t - floor(t)) * path.period;
+                }
+                else if ( path.loopMode==osg::AnimationPath::SWING )
+                {
+                    double t = (time - path.firstTime) / (2.0 * path.period);
+                    double fraction = t - floor(t);
+                    if ( fraction>0.5 ) fraction = 1.0 - fraction;
+                    time = path.firstTime + (fraction * 2.0) * path.period;
+                }
+            }
+
+            const double* times = &_keyTimes[path.firstKey];
+            unsigned int lastKey = path.numKeys - 1;
+            if ( time<=times[0] || !lastKey )
+                blendKeyframes( keys, keys, 0.0f, _matrices[i] );
+            else if ( time>=times[lastKey] )
+                blendKeyframes( keys + lastKey*stride, keys + lastKey*stride, 0.0f, _matrices[i] );
+            else
+            {
+                unsigned int k = findKey( path, time, target.lastKey );
+                float ratio = (float)((time - times[k]) / (times[k+1] - times[k]));
+                blendKeyframes( keys + k*stride, keys + (k+1)*stride, ratio, _matrices[i] );
+                target.lastKey = k;
+            }
+        }
+    }
+
+    void PathAnimator::evaluate( double simulationTime )
+    {
+        // Forget targets which were deleted
+        unsigned int numTargets = 0;
+        for ( unsigned int i=0; i<_targets.size(); ++i )
+        {
+            if ( !_targets[i].transform.valid() ) continue;
+            if ( _targets[i].firstTime==DBL_MAX ) _targets[i].firstTime = simulationTime;
+            if ( numTargets!=i ) _targets[numTargets] = _targets[i];
+            numTargets++;
+        }
+        _targets.resize( numTargets );
+        _matrices.resize( numTargets );
+
+        if ( _parallel && numTargets>=s_parallelThreshold )
+        {
+            ThreadPool::instance()->parallelFor( 0, numTargets,
+                [this, simulationTime]( unsigned int first, unsigned int last )
+                { sample( first, last, simulationTime ); }, 1024 );
+        }
+        else
+            sample( 0, numTargets, simulationTime );
+
+        // setMatrix() dirties the bounds of all parents, so it stays on this thread
+        for ( unsigned int i=0; i<numTargets; ++i )
+            _targets[i].transform->setMatrix( _matrices[i] );
+    }
+
+    void PathAnimator::operator()( osg::Node* node, osg::NodeVisitor* nv )
+    {
+        // The node may be reached through several parents, but is evaluated once a frame
+        const osg::FrameStamp* fs = nv->getFrameStamp();
+        if ( nv->getVisitorType()==osg::NodeVisitor::UPDATE_VISITOR && fs &&
+             fs->getFrameNumber()!=_lastFrameNumber )
+        {
+            _lastFrameNumber = fs->getFrameNumber();
+            evaluate( fs->getSimulationTime() );
+        }
+        traverse( node, nv );
+    }
+
+}
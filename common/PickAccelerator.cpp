@@ -0,0 +1,210 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Cached picking acceleration structures
+*/
+
+#include <osg/NodeVisitor>
+#include <OpenThreads/Mutex>
+#include <OpenThreads/ScopedLock>
+#include <set>
+
+#include "ThreadPool"
+#include "PickAccelerator"
+
+namespace osgCookBook
+{
+
+    /* Collects the vertices of the primitives in one leaf. KdTree::intersect() reports them
+       without knowing how the tree stores its primitives; inner nodes are never entered. */
+    struct LeafBoundFunctor
+    {
+        bool enter( const osg::BoundingBox& ) { return false; }
+        void leave() {}
+
+        void intersect( const osg::Vec3Array* v, int, unsigned int p0 )
+        { bb.expandBy( (*v)[p0] ); }
+
+        void intersect( const osg::Vec3Array* v, int, unsigned int p0, unsigned int p1 )
+        { bb.expandBy( (*v)[p0] ); bb.expandBy( (*v)[p1] ); }
+
+        void intersect( const osg::Vec3Array* v, int, unsigned int p0, unsigned int p1, unsigned int p2 )
+        { bb.expandBy( (*v)[p0] ); bb.expandBy( (*v)[p1] ); bb.expandBy( (*v)[p2] ); }
+
+        void intersect( const osg::Vec3Array* v, int, unsigned int p0, unsigned int p1, unsigned int p2, unsigned int p3 )
+        { bb.expandBy( (*v)[p0] ); bb.expandBy( (*v)[p1] ); bb.expandBy( (*v)[p2] ); bb.expandBy( (*v)[p3] ); }
+
+        osg::BoundingBox bb;
+    };
+
+    /* Recompute the bound of a node from its primitives if it is a leaf, or from its
+       children otherwise, so children are always refitted before their parents. */
+    static void refitNode( const osg::KdTree& tree, osg::KdTree::KdNodeList& nodes, int index )
+    {
+        osg::KdTree::KdNode& node = nodes[index];
+        if ( node.first<0 )
+        {
+            LeafBoundFunctor functor;
+            tree.intersect( functor, node );
+            node.bb = functor.bb;
+            return;
+        }
+
+        node.bb.init();
+        if ( node.first>0 )
+        {
+            refitNode( tree, nodes, node.first );
+            node.bb.expandBy( nodes[node.first].bb );
+        }
+        if ( node.second>0 )
+        {
+            refitNode( tree, nodes, node.second );
+            node.bb.expandBy( nodes[node.second].bb );
+        }
+    }
+
+    PickKdTree::PickKdTree()
+    :   _numVertices(0), _numPrimitiveSets(0), _modifiedCount(0)
+    {
+    }
+
+    PickKdTree::PickKdTree( const PickKdTree& copy, const osg::CopyOp& copyop )
+    :   osg::KdTree(copy, copyop), _numVertices(copy._numVertices),
+        _numPrimitiveSets(copy._numPrimitiveSets), _modifiedCount(copy._modifiedCount)
+    {
+    }
+
+    bool PickKdTree::build( osg::Geometry* geometry )
+    {
+        osg::Vec3Array* vertices = dynamic_cast<osg::Vec3Array*>( geometry->getVertexArray() );
+        if ( !vertices ) return false;
+
+        _numVertices = vertices->size();
+        _numPrimitiveSets = geometry->getNumPrimitiveSets();
+        _modifiedCount = vertices->getModifiedCount();
+
+        osg::KdTree::BuildOptions options;
+        return osg::KdTree::build( options, geometry );
+    }
+
+    bool PickKdTree::isDirty( const osg::Geometry* geometry ) const
+    {
+        const osg::Array* vertices = geometry->getVertexArray();
+        return vertices && vertices->getModifiedCount()!=_modifiedCount;
+    }
+
+    bool PickKdTree::needsRebuild( const osg::Geometry* geometry ) const
+    {
+        const osg::Array* vertices = geometry->getVertexArray();
+        return vertices!=getVertices() || !vertices || vertices->getNumElements()!=_numVertices ||
+               geometry->getNumPrimitiveSets()!=_numPrimitiveSets;
+    }
+
+    void PickKdTree::refit( osg::Geometry* geometry )
+    {
+        if ( getNodes().empty() ) return;
+
+        refitNode( *this, getNodes(), 0 );
+        _modifiedCount = geometry->getVertexArray()->getModifiedCount();
+    }
+
+    class CollectGeometryVisitor : public osg::NodeVisitor
+    {
+    public:
+        CollectGeometryVisitor() : osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ALL_CHILDREN) {}
+
+        virtual void apply( osg::Geometry& geometry )
+        {
+            // Keep the shapes of ShapeDrawables and other user data alone
+            osg::Shape* shape = geometry.getShape();
+            if ( dynamic_cast<PickKdTree*>(shape) ) return;
+            if ( shape && !dynamic_cast<osg::KdTree*>(shape) ) return;
+            if ( _visited.insert(&geometry).second ) _geometries.push_back( &geometry );
+        }
+
+        std::set<osg::Geometry*> _visited;
+        std::vector<osg::Geometry*> _geometries;
+    };
+
+    static OpenThreads::Mutex s_dynamicMutex;
+    static std::vector< osg::observer_ptr<osg::Geometry> > s_dynamicGeometries;
+
+    static void buildTrees( const std::vector<osg::Geometry*>& geometries,
+                            std::vector< osg::ref_ptr<PickKdTree> >& trees )
+    {
+        trees.resize( geometries.size() );
+        ThreadPool::instance()->parallelFor( 0, geometries.size(),
+            [&geometries, &trees]( unsigned int first, unsigned int last )
+            {
+                for ( unsigned int i=first; i<last; ++i )
+                {
+                    osg::ref_ptr<PickKdTree> tree = new PickKdTree;
+                    if ( tree->build(geometries[i]) ) trees[i] = tree;
+                }
+            } );
+    }
+
+    void buildPickAccelerators( osg::Node* node )
+    {
+        if ( !node ) return;
+
+        CollectGeometryVisitor cgv;
+        node->accept( cgv );
+
+        std::vector< osg::ref_ptr<PickKdTree> > trees;
+        buildTrees( cgv._geometries, trees );
+
+        // Shapes are attached here rather than in the workers, so the scene graph
+        // is only changed from the calling thread
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( s_dynamicMutex );
+        for ( unsigned int i=0; i<trees.size(); ++i )
+        {
+            if ( !trees[i] ) continue;
+            osg::Geometry* geometry = cgv._geometries[i];
+            geometry->setShape( trees[i].get() );
+            if ( geometry->getDataVariance()==osg::Object::DYNAMIC )
+                s_dynamicGeometries.push_back( geometry );
+        }
+    }
+
+    void refitPickAccelerators()
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( s_dynamicMutex );
+        std::vector<osg::Geometry*> refitList, rebuildList;
+        for ( unsigned int i=0; i<s_dynamicGeometries.size(); )
+        {
+            osg::ref_ptr<osg::Geometry> geometry;
+            if ( !s_dynamicGeometries[i].lock(geometry) )
+            {
+                s_dynamicGeometries[i] = s_dynamicGeometries.back();
+                s_dynamicGeometries.pop_back();
+                continue;
+            }
+
+            PickKdTree* tree = dynamic_cast<PickKdTree*>( geometry->getShape() );
+            if ( !tree || tree->needsRebuild(geometry.get()) ) rebuildList.push_back( geometry.get() );
+            else if ( tree->isDirty(geometry.get()) ) refitList.push_back( geometry.get() );
+            ++i;
+        }
+
+        ThreadPool::instance()->parallelFor( 0, refitList.size(),
+            [&refitList]( unsigned int first, unsigned int last )
+            {
+                for ( unsigned int i=first; i<last; ++i )
+                    static_cast<PickKdTree*>( refitList[i]->getShape() )->refit( refitList[i] );
+            } );
+
+        std::vector< osg::ref_ptr<PickKdTree> > trees;
+        buildTrees( rebuildList, trees );
+        for ( unsigned int i=0; i<trees.size(); ++i )
+            rebuildList[i]->setShape( trees[i].get() );
+    }
+
+    osgDB::ReaderWriter::ReadResult PickAcceleratorReadCallback::readNode(
+        const std::string& file, const osgDB::Options* options )
+    {
+        osgDB::ReaderWriter::ReadResult result =
+            osgDB::Registry::instance()->readNodeImplementation( file, options );
+        if ( result.validNode() ) buildPickAccelerators( result.getNode() );
+        return result;
+    }
+
+}
@@ -0,0 +1,176 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Random number generation
+*/
+
+#include <OpenThreads/Atomic>
+#include "Random"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+    #include <emmintrin.h>
+    #define COOKBOOK_RANDOM_SSE
+#endif
+
+namespace osgCookBook
+{
+
+    static unsigned long long s_randomSeed = 0x853c49e6748fea9bULL;
+    static OpenThreads::Atomic s_seedGeneration;
+    static OpenThreads::Atomic s_numStreams;
+
+    static unsigned long long splitMix64( unsigned long long& x )
+    {
+        unsigned long long z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+    }
+
+    RandomGenerator::RandomGenerator( unsigned long long seed, unsigned long long stream )
+    {
+        this->seed( seed, stream );
+    }
+
+    void RandomGenerator::seed( unsigned long long seed, unsigned long long stream )
+    {
+        // Expand seed and stream with SplitMix64, as recommended for xoshiro
+        unsigned long long x = seed ^ ((stream + 1) * 0x6a09e667f3bcc909ULL);
+        for ( unsigned int i=0; i<16; i+=2 )
+        {
+            unsigned long long value = splitMix64( x );
+            _state[i] = (unsigned int)value;
+            _state[i+1] = (unsigned int)(value >> 32);
+        }
+
+        for ( unsigned int lane=0; lane<4; ++lane )
+        {
+            if ( !_state[lane] && !_state[4+lane] && !_state[8+lane] && !_state[12+lane] )
+                _state[lane] = 1;  // The all-zero state never leaves zero
+        }
+        _bufferPos = 4;
+    }
+
+    void RandomGenerator::step( unsigned int* result )
+    {
+#ifdef COOKBOOK_RANDOM_SSE
+        __m128i s0 = _mm_loadu_si128( (const __m128i*)(_state + 0) );
+        __m128i s1 = _mm_loadu_si128( (const __m128i*)(_state + 4) );
+        __m128i s2 = _mm_loadu_si128( (const __m128i*)(_state + 8) );
+        __m128i s3 = _mm_loadu_si128( (const __m128i*)(_state + 12) );
+        _mm_storeu_si128( (__m128i*)result, _mm_add_epi32(s0, s3) );
+
+        __m128i t = _mm_slli_epi32( s1, 9 );
+        s2 = _mm_xor_si128( s2, s0 );
+        s3 = _mm_xor_si128( s3, s1 );
+        s1 = _mm_xor_si128( s1, s2 );
+        s0 = _mm_xor_si128( s0, s3 );
+        s2 = _mm_xor_si128( s2, t );
+        s3 = _mm_or_si128( _mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21) );
+
+        _mm_storeu_si128( (__m128i*)(_state + 0), s0 );
+        _mm_storeu_si128( (__m128i*)(_state + 4), s1 );
+        _mm_storeu_si128( (__m128i*)(_state + 8), s2 );
+        _mm_storeu_si128( (__m128i*)(_state + 12), s3 );
+#else
+        for ( unsigned int lane=0; lane<4; ++lane )
+        {
+            unsigned int* s = _state + lane;
+            result[lane] = s[0] + s[12];
+
+            unsigned int t = s[4] << 9;
+            s[8] ^= s[0];
+            s[12] ^= s[4];
+            s[4] ^= s[8];
+            s[0] ^= s[12];
+            s[8] ^= t;
+            s[12] = (s[12] << 11) | (s[12] >> 21);
+        }
+#endif
+    }
+
+    unsigned int RandomGenerator::nextUInt()
+    {
+        if ( _bufferPos>=4 )
+        {
+            step( _buffer );
+            _bufferPos = 0;
+        }
+        return _buffer[_bufferPos++];
+    }
+
+    void RandomGenerator::fill( float* values, unsigned int n, float min, float max )
+    {
+        // Use up buffered numbers first, so the sequence matches calling uniform() n times
+        unsigned int i = 0;
+        while ( i<n && _bufferPos<4 ) values[i++] = uniform( min, max );
+        i += fillBlocks( values + i, (n - i) / 4, min, max );
+        while ( i<n ) values[i++] = uniform( min, max );
+    }
+
+    unsigned int RandomGenerator::fillBlocks( float* values, unsigned int numBlocks, float min, float max )
+    {
+#ifdef COOKBOOK_RANDOM_SSE
+        __m128i s0 = _mm_loadu_si128( (const __m128i*)(_state + 0) );
+        __m128i s1 = _mm_loadu_si128( (const __m128i*)(_state + 4) );
+        __m128i s2 = _mm_loadu_si128( (const __m128i*)(_state + 8) );
+        __m128i s3 = _mm_loadu_si128( (const __m128i*)(_state + 12) );
+        __m128 scale = _mm_set1_ps( 1.0f / 16777216.0f );
+        __m128 minValue = _mm_set1_ps( min );
+        __m128 range = _mm_set1_ps( max - min );
+        for ( unsigned int b=0; b<numBlocks; ++b )
+        {
+            __m128i result = _mm_add_epi32( s0, s3 );
+            __m128i t = _mm_slli_epi32( s1, 9 );
+            s2 = _mm_xor_si128( s2, s0 );
+            s3 = _mm_xor_si128( s3, s1 );
+            s1 = _mm_xor_si128( s1, s2 );
+            s0 = _mm_xor_si128( s0, s3 );
+            s2 = _mm_xor_si128( s2, t );
+            s3 = _mm_or_si128( _mm_slli_epi32(s3, 11), _mm_srli_epi32(s3, 21) );
+
+            // The top 24 bits convert exactly, giving the same floats as nextFloat()
+            __m128 u = _mm_mul_ps( _mm_cvtepi32_ps(_mm_srli_epi32(result, 8)), scale );
+            _mm_storeu_ps( values + b*4, _mm_add_ps(minValue, _mm_mul_ps(u, range)) );
+        }
+        _mm_storeu_si128( (__m128i*)(_state + 0), s0 );
+        _mm_storeu_si128( (__m128i*)(_state + 4), s1 );
+        _mm_storeu_si128( (__m128i*)(_state + 8), s2 );
+        _mm_storeu_si128( (__m128i*)(_state + 12), s3 );
+#else
+        unsigned int result[4];
+        for ( unsigned int b=0; b<numBlocks; ++b )
+        {
+            step( result );
+            for ( unsigned int lane=0; lane<4; ++lane )
+            {
+                float u = (float)(result[lane] >> 8) * (1.0f / 16777216.0f);
+                values[b*4 + lane] = min + u * (max - min);
+            }
+        }
+#endif
+        return numBlocks * 4;
+    }
+
+    RandomGenerator& getThreadRandomGenerator()
+    {
+        static thread_local RandomGenerator t_generator;
+        static thread_local unsigned int t_stream = (++s_numStreams) - 1;
+        static thread_local unsigned int t_generation = ~0u;
+
+        unsigned int generation = s_seedGeneration;
+        if ( t_generation!=generation )
+        {
+            t_generator.seed( s_randomSeed, t_stream );
+            t_generation = generation;
+        }
+        return t_generator;
+    }
+
+    void setRandomSeed( unsigned long long seed )
+    {
+        // Threads reading the seed at the same time may still see the old value, so set
+        // it before starting other threads that use random numbers
+        s_randomSeed = seed;
+        ++s_seedGeneration;
+    }
+
+}
@@ -0,0 +1,366 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Rectangle and lasso selection
+*/
+
+#include <osg/Geode>
+#include <osg/Transform>
+#include <osgViewer/View>
+
+#include "CommonFunctions"
+#include "ThreadPool"
+#include "RegionSelectHandler"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP>=2)
+    #include <emmintrin.h>
+    #define COOKBOOK_REGION_SELECT_SSE
+#endif
+
+namespace osgCookBook
+{
+
+    struct RegionGeometry
+    {
+        osg::Geometry* geometry;
+        osg::Matrix localToWorld;
+        std::vector<osg::Vec4f> planes;
+        osg::Matrix windowMatrix;
+        bool fullyInside;
+    };
+
+    struct RegionTask
+    {
+        unsigned int item, first, last;
+        std::vector<unsigned int> indices;
+    };
+
+    class CollectRegionGeometryVisitor : public osg::NodeVisitor
+    {
+    public:
+        CollectRegionGeometryVisitor()
+        :   osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ACTIVE_CHILDREN)
+        { _matrices.push_back( osg::Matrix() ); }
+
+        virtual void apply( osg::Transform& transform )
+        {
+            osg::Matrix matrix = _matrices.back();
+            transform.computeLocalToWorldMatrix( matrix, this );
+            _matrices.push_back( matrix );
+            traverse( transform );
+            _matrices.pop_back();
+        }
+
+        // HUD, RTT and overlay cameras don't share the view's screen space
+        virtual void apply( osg::Camera& ) {}
+
+        virtual void apply( osg::Geometry& geometry )
+        {
+            if ( !dynamic_cast<osg::Vec3Array*>(geometry.getVertexArray()) ) return;
+            RegionGeometry item;
+            item.geometry = &geometry;
+            item.localToWorld = _matrices.back();
+            item.fullyInside = false;
+            _items.push_back( item );
+        }
+
+        std::vector<osg::Matrix> _matrices;
+        std::vector<RegionGeometry> _items;
+    };
+
+    static bool isInsidePolygon( const std::vector<osg::Vec2>& polygon, float x, float y )
+    {
+        bool inside = false;
+        for ( unsigned int i=0, j=polygon.size()-1; i<polygon.size(); j=i++ )
+        {
+            const osg::Vec2& a = polygon[i];
+            const osg::Vec2& b = polygon[j];
+            if ( (a.y()>y)!=(b.y()>y) && x<(b.x()-a.x()) * (y-a.y()) / (b.y()-a.y()) + a.x() )
+                inside = !inside;
+        }
+        return inside;
+    }
+
+    /* Rejects the box if all corners are outside one plane; sets fullyInside if all
+       corners are inside every plane */
+    static bool testBox( const osg::BoundingBox& bb, const std::vector<osg::Vec4f>& planes, bool& fullyInside )
+    {
+        fullyInside = true;
+        for ( unsigned int p=0; p<planes.size(); ++p )
+        {
+            const osg::Vec4f& plane = planes[p];
+            unsigned int numInside = 0;
+            for ( unsigned int c=0; c<8; ++c )
+            {
+                const osg::Vec3 corner = bb.corner(c);
+                if ( corner * osg::Vec3(plane[0], plane[1], plane[2]) + plane[3]>=0.0f ) ++numInside;
+            }
+            if ( !numInside ) return false;
+            if ( numInside<8 ) fullyInside = false;
+        }
+        return true;
+    }
+
+    static void selectVertices( const osg::Vec3* vertices, unsigned int first, unsigned int last,
+                                const std::vector<osg::Vec4f>& planes, std::vector<unsigned int>& indices )
+    {
+        unsigned int i = first;
+#ifdef COOKBOOK_REGION_SELECT_SSE
+        unsigned int numPlanes = planes.size();
+        __m128 nx[6], ny[6], nz[6], nd[6];
+        for ( unsigned int p=0; p<numPlanes && p<6; ++p )
+        {
+            nx[p] = _mm_set1_ps( planes[p][0] );
+            ny[p] = _mm_set1_ps( planes[p][1] );
+            nz[p] = _mm_set1_ps( planes[p][2] );
+            nd[p] = _mm_set1_ps( planes[p][3] );
+        }
+
+        const __m128 zero = _mm_setzero_ps();
+        for ( ; numPlanes<=6 && i+4<=last; i+=4 )
+        {
+            // Load 4 packed Vec3s and transpose them to x, y and z lanes
+            const float* ptr = vertices[i].ptr();
+            __m128 a = _mm_loadu_ps( ptr );      // x0 y0 z0 x1
+            __m128 b = _mm_loadu_ps( ptr + 4 );  // y1 z1 x2 y2
+            __m128 c = _mm_loadu_ps( ptr + 8 );  // z2 x3 y3 z3
+            __m128 t = _mm_shuffle_ps( b, c, _MM_SHUFFLE(0, 1, 0, 2) );
+            __m128 x = _mm_shuffle_ps( a, t, _MM_SHUFFLE(2, 0, 3, 0) );
+            __m128 y = _mm_shuffle_ps( _mm_shuffle_ps(a, b, _MM_SHUFFLE(0, 0, 1, 1)),
+                                       _mm_shuffle_ps(b, c, _MM_SHUFFLE(2, 2, 3, 3)), _MM_SHUFFLE(2, 0, 2, 0) );
+            __m128 z = _mm_shuffle_ps( _mm_shuffle_ps(a, b, _MM_SHUFFLE(1, 1, 2, 2)),
+                                       _mm_shuffle_ps(c, c, _MM_SHUFFLE(3, 3, 0, 0)), _MM_SHUFFLE(2, 0, 2, 0) );
+
+            __m128 inside = _mm_cmpeq_ps( zero, zero );
+            for ( unsigned int p=0; p<numPlanes; ++p )
+            {
+                __m128 d = _mm_add_ps( _mm_add_ps(_mm_mul_ps(x, nx[p]), _mm_mul_ps(y, ny[p])),
+                                       _mm_add_ps(_mm_mul_ps(z, nz[p]), nd[p]) );
+                inside = _mm_and_ps( inside, _mm_cmpge_ps(d, zero) );
+            }
+
+            int mask = _mm_movemask_ps( inside );
+            for ( unsigned int k=0; mask; ++k, mask>>=1 )
+            {
+                if ( mask&1 ) indices.push_back( i + k );
+            }
+        }
+#endif
+        for ( ; i<last; ++i )
+        {
+            const osg::Vec3& v = vertices[i];
+            bool inside = true;
+            for ( unsigned int p=0; p<planes.size() && inside; ++p )
+            {
+                const osg::Vec4f& plane = planes[p];
+                inside = v.x()*plane[0] + v.y()*plane[1] + v.z()*plane[2] + plane[3]>=0.0f;
+            }
+            if ( inside ) indices.push_back( i );
+        }
+    }
+
+    RegionSelectHandler::RegionSelectHandler()
+    :   _mode(RECTANGLE), _dragging(false), _traversalMask(0xffffffff)
+    {
+    }
+
+    osg::Camera* RegionSelectHandler::createSelectionOverlay()
+    {
+        osg::ref_ptr<osg::Vec4Array> colors = new osg::Vec4Array(1);
+        (*colors)[0].set( 1.0f, 1.0f, 0.0f, 1.0f );
+
+        _outline = new osg::Geometry;
+        _outline->setDataVariance( osg::Object::DYNAMIC );
+        _outline->setUseDisplayList( false );
+        _outline->setUseVertexBufferObjects( true );
+        _outline->setVertexArray( new osg::Vec3Array );
+        _outline->setColorArray( colors.get() );
+        _outline->setColorBinding( osg::Geometry::BIND_OVERALL );
+        _outline->addPrimitiveSet( new osg::DrawArrays(GL_LINE_LOOP, 0, 0) );
+
+        osg::ref_ptr<osg::Geode> geode = new osg::Geode;
+        geode->addDrawable( _outline.get() );
+
+        _overlay = createHUDCamera( 0.0, 1.0, 0.0, 1.0 );
+        _overlay->addChild( geode.get() );
+        return _overlay.get();
+    }
+
+    void RegionSelectHandler::updateOverlay( const osgGA::GUIEventAdapter& ea )
+    {
+        if ( !_overlay || !_outline ) return;
+        _overlay->setProjectionMatrix( osg::Matrix::ortho2D(ea.getXmin(), ea.getXmax(), ea.getYmin(), ea.getYmax()) );
+
+        osg::Vec3Array* vertices = static_cast<osg::Vec3Array*>( _outline->getVertexArray() );
+        vertices->clear();
+        if ( _dragging && _mode==RECTANGLE && _region.size()==2 )
+        {
+            vertices->push_back( osg::Vec3(_region[0].x(), _region[0].y(), 0.0f) );
+            vertices->push_back( osg::Vec3(_region[1].x(), _region[0].y(), 0.0f) );
+            vertices->push_back( osg::Vec3(_region[1].x(), _region[1].y(), 0.0f) );
+            vertices->push_back( osg::Vec3(_region[0].x(), _region[1].y(), 0.0f) );
+        }
+        else if ( _dragging && _mode==LASSO )
+        {
+            for ( unsigned int i=0; i<_region.size(); ++i )
+                vertices->push_back( osg::Vec3(_region[i].x(), _region[i].y(), 0.0f) );
+        }
+
+        static_cast<osg::DrawArrays*>( _outline->getPrimitiveSet(0) )->setCount( vertices->size() );
+        vertices->dirty();
+        _outline->dirtyBound();
+    }
+
+    bool RegionSelectHandler::handle( const osgGA::GUIEventAdapter& ea, osgGA::GUIActionAdapter& aa )
+    {
+        osg::Vec2 point( ea.getX(), ea.getY() );
+        switch ( ea.getEventType() )
+        {
+        case osgGA::GUIEventAdapter::PUSH:
+            if ( ea.getButton()!=osgGA::GUIEventAdapter::LEFT_MOUSE_BUTTON ||
+                 !(ea.getModKeyMask()&osgGA::GUIEventAdapter::MODKEY_SHIFT) )
+                return false;
+            _mode = (ea.getModKeyMask()&osgGA::GUIEventAdapter::MODKEY_ALT) ? LASSO : RECTANGLE;
+            _region.clear();
+            _region.push_back( point );
+            _dragging = true;
+            updateOverlay( ea );
+            return true;
+
+        case osgGA::GUIEventAdapter::DRAG:
+            if ( !_dragging ) return false;
+            if ( _mode==RECTANGLE )
+            {
+                _region.resize( 2 );
+                _region[1] = point;
+            }
+            else if ( (point - _region.back()).length2()>4.0f )
+                _region.push_back( point );
+            updateOverlay( ea );
+            return true;
+
+        case osgGA::GUIEventAdapter::RELEASE:
+            if ( !_dragging ) return false;
+            _dragging = false;
+            updateOverlay( ea );
+            {
+                osgViewer::View* viewer = dynamic_cast<osgViewer::View*>(&aa);
+                if ( viewer && _region.size()>=(_mode==RECTANGLE ? 2u : 3u) )
+                {
+                    Selections results;
+                    select( viewer->getCamera(), viewer->getSceneData(), _region, results );
+                    doUserOperations( results );
+                }
+            }
+            return true;
+
+        default:
+            return false;
+        }
+    }
+
+    void RegionSelectHandler::select( osg::Camera* camera, osg::Node* scene, const std::vector<osg::Vec2>& region,
+                                      Selections& results ) const
+    {
+        if ( !camera || !camera->getViewport() || !scene || region.size()<2 ) return;
+        const osg::Viewport* vp = camera->getViewport();
+
+        // Bounding rectangle of the region in normalized device coordinates
+        osg::BoundingBox rect;
+        for ( unsigned int i=0; i<region.size(); ++i )
+            rect.expandBy( osg::Vec3(region[i].x(), region[i].y(), 0.0f) );
+        double x0 = 2.0 * (rect.xMin() - vp->x()) / vp->width() - 1.0;
+        double x1 = 2.0 * (rect.xMax() - vp->x()) / vp->width() - 1.0;
+        double y0 = 2.0 * (rect.yMin() - vp->y()) / vp->height() - 1.0;
+        double y1 = 2.0 * (rect.yMax() - vp->y()) / vp->height() - 1.0;
+
+        // Clip-space planes of the selection frustum, inside where dot(plane, clipPos)>=0
+        std::vector<osg::Vec4d> clipPlanes;
+        clipPlanes.push_back( osg::Vec4d( 1.0, 0.0, 0.0,-x0) );
+        clipPlanes.push_back( osg::Vec4d(-1.0, 0.0, 0.0, x1) );
+        clipPlanes.push_back( osg::Vec4d( 0.0, 1.0, 0.0,-y0) );
+        clipPlanes.push_back( osg::Vec4d( 0.0,-1.0, 0.0, y1) );
+        clipPlanes.push_back( osg::Vec4d( 0.0, 0.0, 1.0, 1.0) );
+        clipPlanes.push_back( osg::Vec4d( 0.0, 0.0,-1.0, 1.0) );
+
+        CollectRegionGeometryVisitor crgv;
+        crgv.setTraversalMask( camera->getCullMask() & _traversalMask );
+        scene->accept( crgv );
+
+        bool isLasso = region.size()>2;
+        osg::Matrix viewProj = camera->getViewMatrix() * camera->getProjectionMatrix();
+        std::vector<RegionGeometry>& items = crgv._items;
+        std::vector<RegionTask> tasks;
+        for ( unsigned int i=0; i<items.size(); ++i )
+        {
+            RegionGeometry& item = items[i];
+            osg::Matrix mvp = item.localToWorld * viewProj;
+            item.windowMatrix = mvp * vp->computeWindowMatrix();
+            for ( unsigned int p=0; p<clipPlanes.size(); ++p )
+                item.planes.push_back( osg::Vec4f(mvp * clipPlanes[p]) );
+
+            bool fullyInside = false;
+            if ( !testBox(item.geometry->getBoundingBox(), item.planes, fullyInside) ) continue;
+            item.fullyInside = fullyInside && !isLasso;
+
+            // Split large geometries so a single huge mesh still uses all threads
+            unsigned int numVertices = item.geometry->getVertexArray()->getNumElements();
+            for ( unsigned int first=0; first<numVertices; first+=16384 )
+            {
+                RegionTask task;
+                task.item = i;
+                task.first = first;
+                task.last = osg::minimum( first + 16384, numVertices );
+                tasks.push_back( task );
+            }
+        }
+
+        ThreadPool::instance()->parallelFor( 0, tasks.size(),
+            [&tasks, &items, &region, isLasso]( unsigned int first, unsigned int last )
+            {
+                for ( unsigned int t=first; t<last; ++t )
+                {
+                    RegionTask& task = tasks[t];
+                    const RegionGeometry& item = items[task.item];
+                    const osg::Vec3Array* vertices = static_cast<const osg::Vec3Array*>( item.geometry->getVertexArray() );
+                    if ( item.fullyInside )
+                    {
+                        for ( unsigned int i=task.first; i<task.last; ++i ) task.indices.push_back( i );
+                        continue;
+                    }
+
+                    selectVertices( &(vertices->front()), task.first, task.last, item.planes, task.indices );
+                    if ( !isLasso ) continue;
+
+                    // The polytope only bounds the lasso; keep vertices inside the polygon itself
+                    unsigned int numKept = 0;
+                    for ( unsigned int i=0; i<task.indices.size(); ++i )
+                    {
+                        osg::Vec3 pos = (*vertices)[task.indices[i]] * item.windowMatrix;
+                        if ( isInsidePolygon(region, pos.x(), pos.y()) )
+                            task.indices[numKept++] = task.indices[i];
+                    }
+                    task.indices.resize( numKept );
+                }
+            } );
+
+        // Tasks of the same geometry instance are consecutive and in vertex order
+        unsigned int lastItem = items.size();
+        for ( unsigned int t=0; t<tasks.size(); ++t )
+        {
+            const RegionTask& task = tasks[t];
+            if ( task.indices.empty() ) continue;
+
+            RegionGeometry& item = items[task.item];
+            if ( task.item!=lastItem )
+            {
+                lastItem = task.item;
+                Selection selection;
+                selection.geometry = item.geometry;
+                selection.localToWorld = item.localToWorld;
+                results.push_back( selection );
+            }
+            std::vector<unsigned int>& indices = results.back().vertexIndices;
+            indices.insert( indices.end(), task.indices.begin(), task.indices.end() );
+        }
+    }
+
+}
@@ -0,0 +1,307 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Post-processing render graph
+*/
+
+#include <osg/Notify>
+#include <algorithm>
+
+#include "CommonFunctions"
+#include "RenderGraph"
+
+namespace osgCookBook
+{
+
+    RenderGraph::Pass::Pass( const std::string& name )
+    :   _name(name), _renderToScreen(false)
+    {
+    }
+
+    void RenderGraph::Pass::addInput( const std::string& resource, const std::string& uniformName )
+    {
+        Input input;
+        input.resource = resource;
+        input.uniformName = uniformName;
+        _inputs.push_back( input );
+    }
+
+    void RenderGraph::Pass::addOutput( const std::string& resource, osg::Camera::BufferComponent buffer,
+                                       const RenderTargetPool::Format& format )
+    {
+        Output output;
+        output.resource = resource;
+        output.buffer = buffer;
+        output.format = format;
+        _outputs.push_back( output );
+    }
+
+    osg::StateSet* RenderGraph::Pass::getOrCreateStateSet()
+    {
+        if ( !_stateset ) _stateset = new osg::StateSet;
+        return _stateset.get();
+    }
+
+    RenderGraph::RenderGraph( RenderTargetPool* pool )
+    :   _pool(pool)
+    {
+        if ( !_pool ) _pool = new RenderTargetPool;
+    }
+
+    RenderGraph::Pass* RenderGraph::addPass( const std::string& name )
+    {
+        Pass* pass = new Pass( name );
+        _passes.push_back( pass );
+        return pass;
+    }
+
+    RenderGraph::Pass* RenderGraph::getPass( const std::string& name )
+    {
+        for ( unsigned int i=0; i<_passes.size(); ++i )
+        {
+            if ( _passes[i]->getName()==name ) return _passes[i].get();
+        }
+        return NULL;
+    }
+
+    void RenderGraph::markUsed( const std::string& resource )
+    {
+        if ( std::find(_usedResources.begin(), _usedResources.end(), resource)==_usedResources.end() )
+            _usedResources.push_back( resource );
+    }
+
+    osg::Texture* RenderGraph::getTexture( const std::string& resource ) const
+    {
+        std::map< std::string, osg::ref_ptr<osg::Texture> >::const_iterator itr = _textures.find( resource );
+        return itr!=_textures.end() ? itr->second.get() : NULL;
+    }
+
+    void RenderGraph::cullPasses( std::vector<bool>& active ) const
+    {
+        // Walk back from the screen passes and the marked targets to the passes they need
+        std::vector<unsigned int> stack;
+        for ( unsigned int i=0; i<_passes.size(); ++i )
+        {
+            if ( _passes[i]->getRenderToScreen() ) stack.push_back( i );
+        }
+
+        for ( unsigned int i=0; i<_usedResources.size(); ++i )
+        {
+            std::map<std::string, unsigned int>::const_iterator itr = _producers.find( _usedResources[i] );
+            if ( itr!=_producers.end() ) stack.push_back( itr->second );
+        }
+
+        active.assign( _passes.size(), false );
+        while ( !stack.empty() )
+        {
+            unsigned int index = stack.back(); stack.pop_back();
+            if ( active[index] ) continue;
+            active[index] = true;
+
+            const std::vector<Pass::Input>& inputs = _passes[index]->getInputs();
+            for ( unsigned int i=0; i<inputs.size(); ++i )
+            {
+                std::map<std::string, unsigned int>::const_iterator itr = _producers.find( inputs[i].resource );
+                if ( itr!=_producers.end() )
+                    stack.push_back( itr->second );
+                else
+                {
+                    OSG_WARN << "RenderGraph: Pass " << _passes[index]->getName() << " reads "
+                             << inputs[i].resource << " which no pass writes" << std::endl;
+                }
+            }
+        }
+    }
+
+    void RenderGraph::sortPasses( const std::vector<bool>& active )
+    {
+        // Each pass waits for the passes writing its inputs. Ready passes are taken in the
+        // order they were added, so independent passes keep the declared order
+        std::vector<unsigned int> numWaiting( _passes.size(), 0 );
+        for ( unsigned int i=0; i<_passes.size(); ++i )
+        {
+            if ( !active[i] ) continue;
+            const std::vector<Pass::Input>& inputs = _passes[i]->getInputs();
+            for ( unsigned int j=0; j<inputs.size(); ++j )
+            {
+                std::map<std::string, unsigned int>::const_iterator itr = _producers.find( inputs[j].resource );
+                if ( itr!=_producers.end() && itr->second!=i ) numWaiting[i]++;
+            }
+        }
+
+        std::vector<bool> done( _passes.size(), false );
+        _order.clear();
+        bool progress = true;
+        while ( progress )
+        {
+            progress = false;
+            for ( unsigned int i=0; i<_passes.size(); ++i )
+            {
+                if ( !active[i] || done[i] || numWaiting[i]>0 ) continue;
+                done[i] = true;
+                progress = true;
+                _order.push_back( _passes[i].get() );
+
+                for ( unsigned int j=0; j<_passes.size(); ++j )
+                {
+                    if ( !active[j] || done[j] ) continue;
+                    const std::vector<Pass::Input>& inputs = _passes[j]->getInputs();
+                    for ( unsigned int k=0; k<inputs.size(); ++k )
+                    {
+                        std::map<std::string, unsigned int>::const_iterator itr = _producers.find( inputs[k].resource );
+                        if ( itr!=_producers.end() && itr->second==i ) numWaiting[j]--;
+                    }
+                }
+                break;
+            }
+        }
+
+        for ( unsigned int i=0; i<_passes.size(); ++i )
+        {
+            if ( !active[i] || done[i] ) continue;
+            OSG_WARN << "RenderGraph: Pass " << _passes[i]->getName() << " is part of a cycle" << std::endl;
+            _order.push_back( _passes[i].get() );
+        }
+    }
+
+    static bool isOffscreenPass( const RenderGraph::Pass* pass )
+    {
+        return !pass->getRenderToScreen();
+    }
+
+    osg::Group* RenderGraph::build()
+    {
+        _producers.clear();
+        _textures.clear();
+        for ( unsigned int i=0; i<_passes.size(); ++i )
+        {
+            _passes[i]->_camera = NULL;
+            const std::vector<Pass::Output>& outputs = _passes[i]->getOutputs();
+            for ( unsigned int j=0; j<outputs.size(); ++j )
+            {
+                if ( _producers.count(outputs[j].resource) )
+                {
+                    OSG_WARN << "RenderGraph: " << outputs[j].resource << " is written by more than one pass, "
+                             << "ignoring " << _passes[i]->getName() << std::endl;
+                    continue;
+                }
+                _producers[outputs[j].resource] = i;
+            }
+        }
+
+        std::vector<bool> active;
+        cullPasses( active );
+        sortPasses( active );
+
+        // Screen passes are POST_RENDER cameras drawn after all targets, and nothing reads
+        // them, so they go last. The order is then the real rendering order for lifetimes
+        std::stable_partition( _order.begin(), _order.end(), isOffscreenPass );
+
+        // A target dies after the last pass reading it, or right after its own pass if
+        // nothing reads it. Marked targets stay alive
+        std::map<std::string, unsigned int> lastUse;
+        for ( unsigned int i=0; i<_order.size(); ++i )
+        {
+            const std::vector<Pass::Output>& outputs = _order[i]->getOutputs();
+            for ( unsigned int j=0; j<outputs.size(); ++j )
+                lastUse[outputs[j].resource] = i;
+
+            const std::vector<Pass::Input>& inputs = _order[i]->getInputs();
+            for ( unsigned int j=0; j<inputs.size(); ++j )
+                lastUse[inputs[j].resource] = i;
+        }
+
+        osg::ref_ptr<osg::Group> root = new osg::Group;
+        for ( unsigned int i=0; i<_order.size(); ++i )
+        {
+            // Outputs are acquired before the inputs are released, so a pass never gets
+            // one of its own inputs as output
+            Pass* pass = _order[i];
+            unsigned int index = std::find(_passes.begin(), _passes.end(), pass) - _passes.begin();
+            const std::vector<Pass::Output>& outputs = pass->getOutputs();
+            for ( unsigned int j=0; j<outputs.size(); ++j )
+            {
+                if ( _producers[outputs[j].resource]==index )
+                    _textures[outputs[j].resource] = _pool->acquire( outputs[j].format );
+            }
+
+            pass->_camera = createCamera( pass, i );
+            if ( pass->_camera.valid() ) root->addChild( pass->_camera.get() );
+
+            for ( std::map<std::string, unsigned int>::iterator itr=lastUse.begin(); itr!=lastUse.end(); ++itr )
+            {
+                if ( itr->second!=i || !_textures.count(itr->first) ) continue;
+                if ( std::find(_usedResources.begin(), _usedResources.end(), itr->first)!=_usedResources.end() )
+                    continue;
+                _pool->release( _textures[itr->first].get() );
+            }
+        }
+        return root.release();
+    }
+
+    osg::Camera* RenderGraph::createCamera( Pass* pass, unsigned int order )
+    {
+        osg::ref_ptr<osg::Camera> camera;
+        const std::vector<Pass::Output>& outputs = pass->getOutputs();
+        if ( pass->getRenderToScreen() )
+        {
+            camera = createHUDCamera( 0.0, 1.0, 0.0, 1.0 );
+            camera->setRenderOrder( osg::Camera::POST_RENDER, order );
+            camera->addChild( createScreenQuad(1.0f, 1.0f) );
+        }
+        else if ( !outputs.empty() )
+        {
+            camera = createRTTCamera( outputs[0].buffer, _textures[outputs[0].resource].get(),
+                                      !pass->getScene(), outputs[0].format.samples );
+            camera->setRenderOrder( osg::Camera::PRE_RENDER, order );
+            for ( unsigned int i=1; i<outputs.size(); ++i )
+            {
+                osg::Texture* tex = _textures[outputs[i].resource].get();
+                if ( !tex ) continue;
+                tex->setFilter( osg::Texture::MIN_FILTER, osg::Texture::LINEAR );
+                tex->setFilter( osg::Texture::MAG_FILTER, osg::Texture::LINEAR );
+                camera->attach( outputs[i].buffer, tex, 0, 0, false, outputs[i].format.samples );
+            }
+        }
+        else
+        {
+            OSG_WARN << "RenderGraph: Pass " << pass->getName() << " has no output" << std::endl;
+            return NULL;
+        }
+
+        if ( pass->getScene() ) camera->addChild( pass->getScene() );
+        osg::StateSet* ss = camera->getOrCreateStateSet();
+        if ( pass->_stateset.valid() ) ss->merge( *pass->_stateset );
+        if ( pass->getProgram() )
+            ss->setAttributeAndModes( pass->getProgram(), osg::StateAttribute::ON|osg::StateAttribute::OVERRIDE );
+
+        const std::vector<Pass::Input>& inputs = pass->getInputs();
+        for ( unsigned int i=0; i<inputs.size(); ++i )
+        {
+            ss->setTextureAttributeAndModes( i, getTexture(inputs[i].resource) );
+            if ( !inputs[i].uniformName.empty() )
+                ss->addUniform( new osg::Uniform(inputs[i].uniformName.c_str(), (int)i) );
+        }
+        return camera.release();
+    }
+
+    void RenderGraph::report( std::ostream& out ) const
+    {
+        out << "Render graph: " << _order.size() << " of " << _passes.size() << " passes active" << std::endl;
+        for ( unsigned int i=0; i<_order.size(); ++i )
+        {
+            const Pass* pass = _order[i];
+            out << "  " << i << ": " << pass->getName();
+            const std::vector<Pass::Output>& outputs = pass->getOutputs();
+            for ( unsigned int j=0; j<outputs.size(); ++j )
+            {
+                std::map< std::string, osg::ref_ptr<osg::Texture> >::const_iterator itr =
+                    _textures.find( outputs[j].resource );
+                out << (j ? ", " : " -> ") << outputs[j].resource;
+                if ( itr!=_textures.end() ) out << " [" << itr->second.get() << "]";
+            }
+            if ( pass->getRenderToScreen() ) out << " -> screen";
+            out << std::endl;
+        }
+        _pool->report( out );
+    }
+
+}
@@ -0,0 +1,142 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Render target pool
+*/
+
+#include <osg/FrameBufferObject>
+#include <osg/Notify>
+#include "RenderTargetPool"
+
+namespace osgCookBook
+{
+
+    static bool isDepthFormat( GLenum format )
+    {
+        return format==GL_DEPTH_COMPONENT || format==GL_DEPTH_COMPONENT16 ||
+               format==GL_DEPTH_COMPONENT24 || format==GL_DEPTH_COMPONENT32;
+    }
+
+    static bool isFloatFormat( GLenum format )
+    {
+        return format==GL_RGBA16F_ARB || format==GL_RGBA32F_ARB ||
+               format==GL_RGB16F_ARB || format==GL_RGB32F_ARB;
+    }
+
+    bool RenderTargetPool::Format::operator<( const Format& rhs ) const
+    {
+        if ( width!=rhs.width ) return width<rhs.width;
+        if ( height!=rhs.height ) return height<rhs.height;
+        if ( internalFormat!=rhs.internalFormat ) return internalFormat<rhs.internalFormat;
+        return samples<rhs.samples;
+    }
+
+    RenderTargetPool::RenderTargetPool()
+    :   _numAcquired(0), _allocatedBytes(0), _liveBytes(0), _peakLiveBytes(0), _requestedBytes(0)
+    {
+    }
+
+    osg::Texture2D* RenderTargetPool::acquire( const Format& format )
+    {
+        osg::Texture2D* texture = NULL;
+        FreeTextures::iterator itr = _freeTextures.find( format );
+        if ( itr!=_freeTextures.end() )
+        {
+            texture = itr->second;
+            _freeTextures.erase( itr );
+        }
+        else
+        {
+            texture = createTexture( format );
+            _textures.push_back( texture );
+            _formats[texture] = format;
+            _allocatedBytes += computeBytes( format );
+        }
+
+        unsigned long long bytes = computeBytes( format );
+        _liveTextures[texture] = texture;
+        _liveBytes += bytes;
+        _requestedBytes += bytes;
+        if ( _liveBytes>_peakLiveBytes ) _peakLiveBytes = _liveBytes;
+        _numAcquired++;
+        return texture;
+    }
+
+    void RenderTargetPool::release( osg::Texture* texture )
+    {
+        // Only textures of the pool are live, so the typed pointer comes from the pool itself
+        std::map<const osg::Texture*, osg::Texture2D*>::iterator itr = _liveTextures.find( texture );
+        if ( itr==_liveTextures.end() )
+        {
+            OSG_WARN << "RenderTargetPool: Released a texture which is not acquired" << std::endl;
+            return;
+        }
+
+        osg::Texture2D* texture2D = itr->second;
+        _liveTextures.erase( itr );
+
+        const Format& format = _formats[texture2D];
+        _liveBytes -= computeBytes( format );
+        _freeTextures.insert( FreeTextures::value_type(format, texture2D) );
+    }
+
+    bool RenderTargetPool::getFormat( const osg::Texture* texture, Format& format ) const
+    {
+        std::map<const osg::Texture*, Format>::const_iterator itr = _formats.find( texture );
+        if ( itr==_formats.end() ) return false;
+        format = itr->second;
+        return true;
+    }
+
+    void RenderTargetPool::report( std::ostream& out ) const
+    {
+        const double mb = 1.0 / (1024.0 * 1024.0);
+        out << "Render targets: " << _numAcquired << " acquired, " << _textures.size()
+            << " textures allocated" << std::endl;
+        out << "  Allocated: " << _allocatedBytes * mb << " MB" << std::endl;
+        out << "  Peak live: " << _peakLiveBytes * mb << " MB" << std::endl;
+        out << "  Without pooling: " << _requestedBytes * mb << " MB" << std::endl;
+    }
+
+    unsigned long long RenderTargetPool::computeBytes( const Format& format )
+    {
+        // Drivers usually pad three-component and 24-bit formats to four bytes per texel
+        unsigned int texelBytes = 4;
+        switch ( format.internalFormat )
+        {
+        case GL_DEPTH_COMPONENT16: texelBytes = 2; break;
+        case GL_RGBA16F_ARB: case GL_RGB16F_ARB: texelBytes = 8; break;
+        case GL_RGBA32F_ARB: case GL_RGB32F_ARB: texelBytes = 16; break;
+        case GL_LUMINANCE: case GL_ALPHA: texelBytes = 1; break;
+        default: break;
+        }
+
+        // The camera renders to a multisampled buffer and resolves into the texture
+        unsigned long long texels = (unsigned long long)format.width * format.height;
+        unsigned long long bytes = texels * texelBytes;
+        if ( format.samples>1 ) bytes += texels * texelBytes * format.samples;
+        return bytes;
+    }
+
+    osg::Texture2D* RenderTargetPool::createTexture( const Format& format ) const
+    {
+        osg::ref_ptr<osg::Texture2D> texture = new osg::Texture2D;
+        texture->setTextureSize( format.width, format.height );
+        texture->setInternalFormat( format.internalFormat );
+        if ( isDepthFormat(format.internalFormat) )
+        {
+            texture->setSourceFormat( GL_DEPTH_COMPONENT );
+            texture->setSourceType( GL_FLOAT );
+        }
+        else if ( format.internalFormat==GL_DEPTH24_STENCIL8_EXT )
+        {
+            texture->setSourceFormat( GL_DEPTH_STENCIL_EXT );
+            texture->setSourceType( GL_UNSIGNED_INT_24_8_EXT );
+        }
+        else if ( isFloatFormat(format.internalFormat) )
+        {
+            texture->setSourceFormat( GL_RGBA );
+            texture->setSourceType( GL_FLOAT );
+        }
+        return texture.release();
+    }
+
+}
@@ -0,0 +1,298 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Screen-space index of projected vertices
+*/
+
+#include <osg/NodeVisitor>
+#include <osg/Transform>
+#include <OpenThreads/ScopedLock>
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include "ThreadPool"
+#include "ScreenPointIndex"
+
+namespace osgCookBook
+{
+
+    /* Geometries and camera at the time the rebuild was started. Cells hold the depth
+       bits above the global vertex number, so the smallest value is the front-most vertex
+       and concurrent writers only need an atomic minimum. */
+    struct ScreenPointIndex::Snapshot : public osg::Referenced
+    {
+        struct Item
+        {
+            osg::ref_ptr<osg::Geometry> geometry;
+            osg::ref_ptr<const osg::Vec3Array> vertices;
+            osg::Matrix localToWorld;
+            osg::Matrix windowMatrix;
+            unsigned int first;             // Global number of the first vertex
+            unsigned int modifiedCount;
+        };
+
+        const Item* findItem( unsigned int number ) const
+        {
+            unsigned int lo = 0, hi = items.size();
+            while ( hi-lo>1 )
+            {
+                unsigned int mid = (lo + hi) / 2;
+                if ( items[mid].first<=number ) lo = mid; else hi = mid;
+            }
+            return items.empty() ? 0 : &items[lo];
+        }
+
+        std::vector<Item> items;
+        osg::Matrixd windowMatrix;
+        int x, y, width, height;
+        std::vector< std::atomic<unsigned long long> > cells;
+    };
+
+    static const unsigned long long EMPTY_CELL = ~0ull;
+
+    class CollectPointGeometryVisitor : public osg::NodeVisitor
+    {
+    public:
+        CollectPointGeometryVisitor()
+        :   osg::NodeVisitor(osg::NodeVisitor::TRAVERSE_ACTIVE_CHILDREN), _numVertices(0)
+        { _matrices.push_back( osg::Matrix() ); }
+
+        virtual void apply( osg::Transform& transform )
+        {
+            osg::Matrix matrix = _matrices.back();
+            transform.computeLocalToWorldMatrix( matrix, this );
+            _matrices.push_back( matrix );
+            traverse( transform );
+            _matrices.pop_back();
+        }
+
+        // HUD, RTT and overlay cameras don't share the view's screen space
+        virtual void apply( osg::Camera& ) {}
+
+        virtual void apply( osg::Geometry& geometry )
+        {
+            const osg::Vec3Array* vertices = dynamic_cast<const osg::Vec3Array*>( geometry.getVertexArray() );
+            if ( !vertices || vertices->empty() ) return;
+
+            // Vertex numbers must fit below the empty cell value
+            if ( (unsigned long long)_numVertices + vertices->size()>=0xffffffffull ) return;
+
+            ScreenPointIndex::Snapshot::Item item;
+            item.geometry = &geometry;
+            item.vertices = vertices;
+            item.localToWorld = _matrices.back();
+            item.first = _numVertices;
+            item.modifiedCount = vertices->getModifiedCount();
+            _items.push_back( item );
+            _numVertices += vertices->size();
+        }
+
+        std::vector<osg::Matrix> _matrices;
+        std::vector<ScreenPointIndex::Snapshot::Item> _items;
+        unsigned int _numVertices;
+    };
+
+    class BuildPointIndexOperation : public osg::Operation
+    {
+    public:
+        BuildPointIndexOperation( ScreenPointIndex* index, ScreenPointIndex::Snapshot* snapshot )
+        :   osg::Operation("BuildPointIndexOperation", false), _index(index), _snapshot(snapshot) {}
+
+        virtual void operator()( osg::Object* ) { _index->build( _snapshot.get() ); }
+
+    protected:
+        osg::ref_ptr<ScreenPointIndex> _index;
+        osg::ref_ptr<ScreenPointIndex::Snapshot> _snapshot;
+    };
+
+    static osg::Matrixd computeWindowMatrix( osg::Camera* camera )
+    {
+        return camera->getViewMatrix() * camera->getProjectionMatrix() *
+               camera->getViewport()->computeWindowMatrix();
+    }
+
+    static void projectVertices( ScreenPointIndex::Snapshot* snapshot, const ScreenPointIndex::Snapshot::Item& item,
+                                 unsigned int first, unsigned int last )
+    {
+        osg::Matrixf m( item.windowMatrix );
+        const osg::Vec3* vertices = &(item.vertices->front());
+        float x0 = snapshot->x, y0 = snapshot->y;
+        int width = snapshot->width, height = snapshot->height;
+        for ( unsigned int i=first; i<last; ++i )
+        {
+            const osg::Vec3& v = vertices[i];
+            float w = v.x()*m(0,3) + v.y()*m(1,3) + v.z()*m(2,3) + m(3,3);
+            if ( w<=0.0f ) continue;
+
+            float inv = 1.0f / w;
+            float z = (v.x()*m(0,2) + v.y()*m(1,2) + v.z()*m(2,2) + m(3,2)) * inv;
+            if ( !(z>=0.0f && z<=1.0f) ) continue;
+
+            int px = (int)floorf( (v.x()*m(0,0) + v.y()*m(1,0) + v.z()*m(2,0) + m(3,0)) * inv - x0 );
+            int py = (int)floorf( (v.x()*m(0,1) + v.y()*m(1,1) + v.z()*m(2,1) + m(3,1)) * inv - y0 );
+            if ( px<0 || py<0 || px>=width || py>=height ) continue;
+
+            // Non-negative floats keep their order when compared as integers
+            unsigned int depthBits = 0;
+            memcpy( &depthBits, &z, sizeof(float) );
+            unsigned long long key = ((unsigned long long)depthBits << 32) | (item.first + i);
+
+            std::atomic<unsigned long long>& cell = snapshot->cells[py * width + px];
+            unsigned long long current = cell.load( std::memory_order_relaxed );
+            while ( key<current && !cell.compare_exchange_weak(current, key, std::memory_order_relaxed) ) {}
+        }
+    }
+
+    ScreenPointIndex::ScreenPointIndex()
+    :   _building(false), _dirty(false), _lastChangeTime(0.0), _settleTime(0.2), _traversalMask(0xffffffff)
+    {
+    }
+
+    ScreenPointIndex::~ScreenPointIndex()
+    {
+    }
+
+    void ScreenPointIndex::dirty()
+    {
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        _dirty = true;
+    }
+
+    void ScreenPointIndex::update( osg::Camera* camera, osg::Node* scene, double time )
+    {
+        if ( !camera || !camera->getViewport() || !scene ) return;
+
+        // Wait until the camera stops, as every move makes the grid useless
+        osg::Matrixd matrix = computeWindowMatrix( camera );
+        if ( matrix!=_lastMatrix || scene!=_lastScene.get() )
+        {
+            _lastMatrix = matrix;
+            _lastScene = scene;
+            _lastChangeTime = time;
+            return;
+        }
+        if ( time - _lastChangeTime<_settleTime ) return;
+
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+            if ( _building ) return;
+            if ( _current.valid() && !_dirty && _current->windowMatrix==matrix )
+            {
+                bool modified = false;
+                for ( unsigned int i=0; i<_current->items.size() && !modified; ++i )
+                {
+                    const Snapshot::Item& item = _current->items[i];
+                    modified = item.geometry->getVertexArray()!=item.vertices.get() ||
+                               item.vertices->getModifiedCount()!=item.modifiedCount;
+                }
+                if ( !modified ) return;
+            }
+            _building = true;
+            _dirty = false;
+        }
+
+        // Geometries are collected here, so the worker doesn't traverse the live scene
+        ThreadPool::instance()->add( new BuildPointIndexOperation(this, createSnapshot(camera, scene)) );
+    }
+
+    ScreenPointIndex::Snapshot* ScreenPointIndex::createSnapshot( osg::Camera* camera, osg::Node* scene ) const
+    {
+        CollectPointGeometryVisitor cpgv;
+        cpgv.setTraversalMask( camera->getCullMask() & _traversalMask );
+        scene->accept( cpgv );
+
+        const osg::Viewport* vp = camera->getViewport();
+        osg::ref_ptr<Snapshot> snapshot = new Snapshot;
+        snapshot->items.swap( cpgv._items );
+        snapshot->windowMatrix = computeWindowMatrix( camera );
+        snapshot->x = (int)vp->x();
+        snapshot->y = (int)vp->y();
+        snapshot->width = osg::maximum( (int)vp->width(), 0 );
+        snapshot->height = osg::maximum( (int)vp->height(), 0 );
+        for ( unsigned int i=0; i<snapshot->items.size(); ++i )
+        {
+            Snapshot::Item& item = snapshot->items[i];
+            item.windowMatrix = item.localToWorld * snapshot->windowMatrix;
+        }
+        return snapshot.release();
+    }
+
+    void ScreenPointIndex::build( Snapshot* snapshot )
+    {
+        unsigned int numCells = snapshot->width * snapshot->height;
+        std::vector< std::atomic<unsigned long long> > cells( numCells );
+        snapshot->cells.swap( cells );
+
+        ThreadPool* pool = ThreadPool::instance();
+        pool->parallelFor( 0, numCells, [snapshot]( unsigned int first, unsigned int last )
+            {
+                for ( unsigned int i=first; i<last; ++i )
+                    snapshot->cells[i].store( EMPTY_CELL, std::memory_order_relaxed );
+            }, 65536 );
+
+        // Split large geometries so a single huge point cloud still uses all threads
+        for ( unsigned int i=0; i<snapshot->items.size(); ++i )
+        {
+            const Snapshot::Item& item = snapshot->items[i];
+            pool->parallelFor( 0, item.vertices->size(), [snapshot, &item]( unsigned int first, unsigned int last )
+                { projectVertices(snapshot, item, first, last); }, 65536 );
+        }
+
+        OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+        _current = snapshot;
+        _building = false;
+    }
+
+    bool ScreenPointIndex::query( osg::Camera* camera, float x, float y, float tolerance, Result& result ) const
+    {
+        osg::ref_ptr<Snapshot> snapshot;
+        {
+            OpenThreads::ScopedLock<OpenThreads::Mutex> lock( _mutex );
+            snapshot = _current;
+        }
+        if ( !snapshot || !camera || !camera->getViewport() ) return false;
+        if ( snapshot->windowMatrix!=computeWindowMatrix(camera) ) return false;
+
+        // Only cells within the tolerance can hold a candidate
+        int radius = (int)ceilf( tolerance );
+        int cx = (int)floorf( x - snapshot->x ), cy = (int)floorf( y - snapshot->y );
+        int xMin = osg::maximum(cx - radius, 0), xMax = osg::minimum(cx + radius, snapshot->width - 1);
+        int yMin = osg::maximum(cy - radius, 0), yMax = osg::minimum(cy + radius, snapshot->height - 1);
+
+        const Snapshot::Item* bestItem = 0;
+        unsigned int bestIndex = 0;
+        float bestDistance = FLT_MAX;
+        for ( int py=yMin; py<=yMax; ++py )
+        {
+            for ( int px=xMin; px<=xMax; ++px )
+            {
+                unsigned long long key = snapshot->cells[py * snapshot->width + px].load( std::memory_order_relaxed );
+                if ( key==EMPTY_CELL ) continue;
+
+                unsigned int number = (unsigned int)(key & 0xffffffffull);
+                const Snapshot::Item* item = snapshot->findItem( number );
+                unsigned int index = number - item->first;
+                if ( index>=item->vertices->size() ) continue;
+
+                osg::Vec3 pos = (*item->vertices)[index] * item->windowMatrix;
+                float distance = (osg::Vec2(pos.x(), pos.y()) - osg::Vec2(x, y)).length();
+                if ( distance<=tolerance && distance<bestDistance )
+                {
+                    bestItem = item;
+                    bestIndex = index;
+                    bestDistance = distance;
+                }
+            }
+        }
+        if ( !bestItem ) return false;
+
+        result.geometry = bestItem->geometry;
+        result.vertexIndex = bestIndex;
+        result.worldPoint = (*bestItem->vertices)[bestIndex] * bestItem->localToWorld;
+        result.distance = bestDistance;
+        return true;
+    }
+
+}
@@ -0,0 +1,112 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Thread pool
+*/
+
+#include <OpenThreads/Atomic>
+#include <OpenThreads/Thread>
+
+#include "ThreadPool"
+
+namespace osgCookBook
+{
+
+    /* The chunks of one parallelFor() call. Chunks are claimed through a counter, so the
+       calling thread and the workers only ever run chunks of this call. */
+    class RangeJob : public osg::Referenced
+    {
+    public:
+        RangeJob( const ThreadPool::RangeFunction& func, unsigned int begin, unsigned int end,
+                  unsigned int chunkSize )
+        :   _func(func), _begin(begin), _end(end), _chunkSize(chunkSize),
+            _numChunks((end - begin + chunkSize - 1) / chunkSize), _next(0), _remaining(_numChunks) {}
+
+        /** Run chunks until none is left to claim. */
+        void runChunks()
+        {
+            for ( unsigned int chunk=++_next - 1; chunk<_numChunks; chunk=++_next - 1 )
+            {
+                unsigned int first = _begin + chunk * _chunkSize;
+                _func( first, osg::minimum(first + _chunkSize, _end) );
+                --_remaining;
+            }
+        }
+
+        bool done() const { return (unsigned int)_remaining==0; }
+
+    protected:
+        // Only called while chunks are left, i.e. before parallelFor() returns
+        const ThreadPool::RangeFunction& _func;
+        unsigned int _begin, _end, _chunkSize, _numChunks;
+        OpenThreads::Atomic _next;
+        OpenThreads::Atomic _remaining;
+    };
+
+    class RangeOperation : public osg::Operation
+    {
+    public:
+        RangeOperation( RangeJob* job )
+        :   osg::Operation("RangeOperation", false), _job(job) {}
+
+        virtual void operator()( osg::Object* ) { _job->runChunks(); }
+
+    protected:
+        osg::ref_ptr<RangeJob> _job;
+    };
+
+    ThreadPool::ThreadPool( unsigned int numThreads )
+    {
+        if ( !numThreads ) numThreads = OpenThreads::GetNumberOfProcessors();
+        if ( !numThreads ) numThreads = 1;
+
+        _queue = new osg::OperationQueue;
+        for ( unsigned int i=0; i<numThreads; ++i )
+        {
+            osg::ref_ptr<osg::OperationThread> thread = new osg::OperationThread;
+            thread->setOperationQueue( _queue.get() );
+            thread->startThread();
+            _threads.push_back( thread );
+        }
+    }
+
+    ThreadPool::~ThreadPool()
+    {
+        for ( unsigned int i=0; i<_threads.size(); ++i )
+            _threads[i]->setDone( true );
+        for ( unsigned int i=0; i<_threads.size(); ++i )
+            _threads[i]->cancel();
+    }
+
+    ThreadPool* ThreadPool::instance()
+    {
+        static osg::ref_ptr<ThreadPool> s_pool = new ThreadPool;
+        return s_pool.get();
+    }
+
+    void ThreadPool::parallelFor( unsigned int begin, unsigned int end, const RangeFunction& func,
+                                  unsigned int minChunkSize )
+    {
+        if ( end<=begin ) return;
+        unsigned int total = end - begin;
+        unsigned int numChunks = osg::minimum( getNumThreads() * 4,
+                                               (total + minChunkSize - 1) / osg::maximum(minChunkSize, 1u) );
+        if ( numChunks<=1 )
+        {
+            func( begin, end );
+            return;
+        }
+
+        unsigned int chunkSize = (total + numChunks - 1) / numChunks;
+        osg::ref_ptr<RangeJob> job = new RangeJob( func, begin, end, chunkSize );
+        unsigned int numHelpers = osg::minimum( numChunks - 1, getNumThreads() );
+        for ( unsigned int i=0; i<numHelpers; ++i )
+            _queue->add( new RangeOperation(job.get()) );
+
+        // Work on the chunks of this call instead of sleeping, so calling parallelFor() from
+        // a pooled operation can't starve the queue. Other queued operations are left alone:
+        // they might lock what the caller holds, or be far too slow for a draw callback.
+        job->runChunks();
+        while ( !job->done() )
+            OpenThreads::Thread::YieldCurrentThread();
+    }
+
+}
@@ -1,6 +1,34 @@
 
-HEADERS += $$PWD/common/CommonFunctions
-SOURCES += $$PWD/common/CommonFunctions.cpp
+HEADERS += $$PWD/common/ColorIdPickHandler \
+           $$PWD/common/CommonFunctions \
+           $$PWD/common/FrameBenchmark \
+           $$PWD/common/HighlightOverlay \
+           $$PWD/common/InstancedGeometry \
+           $$PWD/common/InstancingVisitor \
+           $$PWD/common/LabelBatch \
+           $$PWD/common/PathAnimator \
+           $$PWD/common/PickAccelerator \
+           $$PWD/common/Random \
+           $$PWD/common/RegionSelectHandler \
+           $$PWD/common/RenderGraph \
+           $$PWD/common/RenderTargetPool \
+           $$PWD/common/ScreenPointIndex \
+           $$PWD/common/ThreadPool
+SOURCES += $$PWD/common/ColorIdPickHandler.cpp \
+           $$PWD/common/CommonFunctions.cpp \
+           $$PWD/common/FrameBenchmark.cpp \
+           $$PWD/common/HighlightOverlay.cpp \
+           $$PWD/common/InstancedGeometry.cpp \
+           $$PWD/common/InstancingVisitor.cpp \
+           $$PWD/common/LabelBatch.cpp \
+           $$PWD/common/PathAnimator.cpp \
+           $$PWD/common/PickAccelerator.cpp \
+           $$PWD/common/Random.cpp \
+           $$PWD/common/RegionSelectHandler.cpp \
+           $$PWD/common/RenderGraph.cpp \
+           $$PWD/common/RenderTargetPool.cpp \
+           $$PWD/common/ScreenPointIndex.cpp \
+           $$PWD/common/ThreadPool.cpp
 win32:CONFIG(debug, debug|release):{
  LIBS += -LE:/environment/osg/osg365/lib/
  LIBS += -lOpenThreadsd\
@@ -43,6 +71,26 @@ win32:CONFIG(debug, debug|release):{
          -losgViewer\
          -losgVolume\
          -losgWidget\
+}else:unix:{
+ LIBS += -lOpenThreads\
+         -losg\
+         -losgAnimation\
+         -losgDB\
+         -losgFX\
+         -losgGA\
+         -losgManipulator\
+         -losgParticle\
+         -losgPresentation\
+         -losgShadow\
+         -losgSim\
+         -losgTerrain\
+         -losgText\
+         -losgUI\
+         -losgUtil\
+         -losgViewer\
+         -losgVolume\
+         -losgWidget\
+         -lGL
 }
 
 win32-msvc* {
@@ -49,6 +49,10 @@ SUBDIRS += \
     TwoDimManipulator \
     VertexOffsetMapping \
     Water \
-    osgPhys
+    osgPhys \
+    tests/SceneIndexTest
 
 
+# "make benchmark" runs every example offscreen, see benchmark.sh
+benchmark.commands = $$PWD/benchmark.sh $$OUT_PWD
+QMAKE_EXTRA_TARGETS += benchmark
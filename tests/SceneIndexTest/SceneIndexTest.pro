@@ -0,0 +1,16 @@
+TEMPLATE = app
+CONFIG += console c++11 testcase
+CONFIG -= app_bundle
+CONFIG -= qt
+
+INCLUDEPATH += $$PWD/../../BFSVistor
+
+SOURCES += \
+        ../../BFSVistor/BFSVisitor.cpp \
+        ../../BFSVistor/SceneIndex.cpp \
+        main.cpp
+
+HEADERS += \
+    ../../BFSVistor/BFSVisitor \
+    ../../BFSVistor/SceneIndex
+include(../../osg.pri)
@@ -0,0 +1,78 @@
+/* -*-c++-*- OpenSceneGraph Cookbook
+ * Scene index tests, run with "make check"
+*/
+
+#include <osg/Geode>
+#include <algorithm>
+#include <iostream>
+
+#include "SceneIndex"
+
+static int s_numFailures = 0;
+
+static void check( bool condition, const char* message )
+{
+    if ( condition ) return;
+    std::cerr << "FAILED: " << message << std::endl;
+    s_numFailures++;
+}
+
+static bool hasDuplicates( const SceneIndex& index )
+{
+    std::vector<osg::Node*> nodes;
+    for ( unsigned int i=0; i<index.size(); ++i )
+    {
+        if ( !index.isRemoved(i) ) nodes.push_back( index.getNode(i) );
+    }
+    std::sort( nodes.begin(), nodes.end() );
+    return std::adjacent_find( nodes.begin(), nodes.end() )!=nodes.end();
+}
+
+// A node indexed under one parent must not be indexed again when a new subgraph
+// containing it is added
+static void testAddSharedChild( bool parallel )
+{
+    osg::ref_ptr<osg::Group> root = new osg::Group;
+    osg::ref_ptr<osg::Group> groupA = new osg::Group;
+    osg::ref_ptr<osg::Group> groupB = new osg::Group;
+    osg::ref_ptr<osg::Geode> shared = new osg::Geode;
+    root->addChild( groupA.get() );
+    root->addChild( groupB.get() );
+    groupA->addChild( shared.get() );
+    groupB->addChild( shared.get() );
+
+    osg::ref_ptr<SceneIndex> index = new SceneIndex;
+    index->build( root.get(), true, parallel );
+    check( index->size()==4, "build() indexes a shared node once" );
+    check( !hasDuplicates(*index), "build() creates no duplicate entries" );
+
+    osg::ref_ptr<osg::Group> groupC = new osg::Group;
+    osg::ref_ptr<osg::Geode> leaf = new osg::Geode;
+    groupC->addChild( shared.get() );
+    groupC->addChild( leaf.get() );
+    root->addChild( groupC.get() );
+    index->addChild( root.get(), groupC.get() );
+    check( index->size()==6, "addChild() indexes only the new nodes" );
+    check( !hasDuplicates(*index), "addChild() creates no duplicate entries" );
+    check( index->find(groupC.get())>=0 && index->find(leaf.get())>=0, "addChild() indexes the new nodes" );
+
+    // Adding the same shared node directly must not change the index either
+    groupB->addChild( groupC.get() );
+    index->addChild( groupB.get(), groupC.get() );
+    check( index->size()==6, "addChild() skips an already indexed child" );
+    check( !hasDuplicates(*index), "addChild() of an indexed child creates no duplicates" );
+}
+
+int main()
+{
+    testAddSharedChild( false );
+    testAddSharedChild( true );
+
+    if ( s_numFailures>0 )
+    {
+        std::cerr << s_numFailures << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << "All checks passed" << std::endl;
+    return 0;
+}